@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ttree.h"
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static void usage(const char *appname)
+{
+    fprintf(stderr, "Usage: %s <number of keys> [keys per node]\n", appname);
+    exit(EXIT_FAILURE);
+}
+
+static double nsecs_per_op(struct timespec *start, int num_ops)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start->tv_sec) * 1e9 +
+            (end.tv_nsec - start->tv_nsec)) / num_ops;
+}
+
+static void shuffle(int *keys, int num)
+{
+    int tmp, i, j;
+
+    for (i = num - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+/*
+ * Insert, lookup and delete the same set of keys in a tree balanced
+ * with given maximum imbalance and print rotations and latencies.
+ */
+static int bench(struct item *items, int *keys, int num, int keys_per_node,
+                 int imbalance)
+{
+    Ttree ttree;
+    struct timespec start;
+    unsigned long rotations;
+    double ins, look, del;
+    int i;
+
+    if (ttree_init(&ttree, keys_per_node, true, __cmpfunc,
+                   struct item, key) < 0) {
+        return -1;
+    }
+    if (ttree_set_balance(&ttree, imbalance) < 0) {
+        ttree_destroy(&ttree);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < num; i++) {
+        ttree_insert(&ttree, &items[keys[i]]);
+    }
+
+    ins = nsecs_per_op(&start, num);
+    rotations = ttree.num_rotations;
+    shuffle(keys, num);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < num; i++) {
+        if (!ttree_lookup(&ttree, &keys[i], NULL)) {
+            fprintf(stderr, "Key %d is lost!\n", keys[i]);
+            ttree_destroy(&ttree);
+            return -1;
+        }
+    }
+
+    look = nsecs_per_op(&start, num);
+    shuffle(keys, num);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < num; i++) {
+        ttree_delete(&ttree, &keys[i]);
+    }
+
+    del = nsecs_per_op(&start, num);
+    printf("%9d %14lu %14lu %10.1f %10.1f %10.1f\n", imbalance, rotations,
+           ttree.num_rotations - rotations, ins, look, del);
+    ttree_destroy(&ttree);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_keys, keys_per_node = 8, i;
+    struct item *items;
+    int *keys;
+
+    if ((argc < 2) || (argc > 3)) {
+        usage(argv[0]);
+    }
+
+    num_keys = atoi(argv[1]);
+    if (argc == 3) {
+        keys_per_node = atoi(argv[2]);
+    }
+    if ((num_keys <= 0) || (keys_per_node < TNODE_ITEMS_MIN) ||
+        (keys_per_node > TNODE_ITEMS_MAX)) {
+        usage(argv[0]);
+    }
+
+    items = malloc(sizeof(*items) * num_keys);
+    keys = malloc(sizeof(*keys) * num_keys);
+    if (!items || !keys) {
+        fprintf(stderr, "Failed to allocate %d items\n", num_keys);
+        exit(EXIT_FAILURE);
+    }
+
+    srandom(time(NULL));
+    for (i = 0; i < num_keys; i++) {
+        items[i].key = keys[i] = i;
+    }
+
+    printf("%9s %14s %14s %10s %10s %10s\n", "imbalance", "ins rotations",
+           "del rotations", "ins ns/op", "look ns/op", "del ns/op");
+    for (i = 1; i <= TTREE_MAX_IMBALANCE; i++) {
+        shuffle(keys, num_keys);
+        if (bench(items, keys, num_keys, keys_per_node, i) < 0) {
+            fprintf(stderr, "Benchmark failed for imbalance %d\n", i);
+            free(items);
+            free(keys);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(items);
+    free(keys);
+    return 0;
+}
@@ -248,6 +248,286 @@ UTEST_FUNCTION(ut_insert_inc, args)
     UTEST_PASSED();
 }
 
+static bool check_capacities(Ttree *tree, int min_keys)
+{
+    TtreeNode *tnode;
+    int *key, *prev = NULL, i;
+
+    for (tnode = ttree_node_leftmost(tree->root); tnode;
+         tnode = tnode->successor) {
+        if ((tnode->capacity < min_keys) ||
+            (tnode->capacity > tree->keys_per_tnode) ||
+            (tnode->min_idx < 0) || (tnode->max_idx >= tnode->capacity) ||
+            tnode_is_empty(tnode)) {
+            utest_warning("Node %p has capacity %d and keys [%d, %d]",
+                          tnode, tnode->capacity, tnode->min_idx,
+                          tnode->max_idx);
+            return false;
+        }
+
+        tnode_for_each_index(tnode, i) {
+            key = tnode_key(tnode, i);
+            if (prev && (*prev >= *key)) {
+                utest_warning("Key %d follows key %d", *key, *prev);
+                return false;
+            }
+
+            prev = key;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * ut_node_growth inserts and removes keys in random order into
+ * a tree whose nodes change their capacity. Tree balance, order of
+ * keys and node capacities are checked after each step.
+ */
+UTEST_FUNCTION(ut_node_growth, args)
+{
+    Ttree tree;
+    int num_keys, min_keys, num_items, ret, i, j, tmp;
+    int *keys;
+    struct item *items;
+    size_t max_mem;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    min_keys = utest_get_arg(args, 1, INT);
+    num_items = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_set_node_growth(&tree, min_keys) == 0);
+    UTEST_ASSERT(ttree_set_node_growth(&tree, num_keys + 1) < 0);
+
+    keys = malloc(sizeof(*keys) * num_items);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT((keys != NULL) && (items != NULL));
+    srandom(num_items);
+    for (i = 0; i < num_items; i++) {
+        keys[i] = i;
+    }
+    for (i = num_items - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+    for (i = 0; i < num_items; i++) {
+        items[i].key = keys[i];
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+        UTEST_ASSERT(check_capacities(&tree, min_keys));
+    }
+
+    max_mem = ttree_mem_usage(&tree);
+    for (i = 0; i < num_items; i += 2) {
+        UTEST_ASSERT(ttree_delete(&tree, &keys[i]) == &items[i]);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+        UTEST_ASSERT(check_capacities(&tree, min_keys));
+    }
+    for (i = 1; i < num_items; i += 2) {
+        UTEST_ASSERT(ttree_lookup(&tree, &keys[i], NULL) == &items[i]);
+    }
+
+    /* Sparse nodes must become smaller */
+    if ((num_items > num_keys * 2) && (ttree_mem_usage(&tree) >= max_mem)) {
+        UTEST_FAILED("Tree uses %zd bytes after a half of keys is removed, "
+                     "%zd before", ttree_mem_usage(&tree), max_mem);
+    }
+    for (i = 1; i < num_items; i += 2) {
+        UTEST_ASSERT(ttree_delete(&tree, &keys[i]) == &items[i]);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+        UTEST_ASSERT(check_capacities(&tree, min_keys));
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    UTEST_ASSERT(ttree_mem_usage(&tree) == 0);
+    ttree_destroy(&tree);
+    free(keys);
+    free(items);
+    UTEST_PASSED();
+}
+
+static void count_internal_tnodes(TtreeNode *tnode, int num_keys,
+                                  int *total, int *oversized)
+{
+    if (!tnode) {
+        return;
+    }
+    if (tnode->left && tnode->right) {
+        (*total)++;
+        if (tnode->capacity > num_keys) {
+            (*oversized)++;
+        }
+    }
+
+    count_internal_tnodes(tnode->left, num_keys, total, oversized);
+    count_internal_tnodes(tnode->right, num_keys, total, oversized);
+}
+
+/*
+ * ut_internal_nodes checks a tree whose internal nodes are smaller than
+ * leafs. Most of internal nodes must have the size of internal nodes
+ * after random insertions: only nodes became internal because of
+ * rotations and not touched since then may be bigger.
+ */
+UTEST_FUNCTION(ut_internal_nodes, args)
+{
+    Ttree tree;
+    int num_keys, internal_keys, num_items, ret, i, j, tmp;
+    int total = 0, oversized = 0;
+    int *keys;
+    struct item *items;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    internal_keys = utest_get_arg(args, 1, INT);
+    num_items = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_set_internal_node_size(&tree, num_keys + 1) < 0);
+    if (internal_keys < num_keys) {
+        /* New nodes mustn't be bigger than internal ones. */
+        UTEST_ASSERT(ttree_set_internal_node_size(&tree, internal_keys) < 0);
+    }
+
+    UTEST_ASSERT(ttree_set_node_growth(&tree, internal_keys) == 0);
+    UTEST_ASSERT(ttree_set_internal_node_size(&tree, internal_keys) == 0);
+
+    keys = malloc(sizeof(*keys) * num_items);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT((keys != NULL) && (items != NULL));
+    srandom(num_items);
+    for (i = 0; i < num_items; i++) {
+        keys[i] = i;
+    }
+    for (i = num_items - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+    for (i = 0; i < num_items; i++) {
+        items[i].key = keys[i];
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+        UTEST_ASSERT(check_capacities(&tree, internal_keys));
+    }
+
+    count_internal_tnodes(tree.root, internal_keys, &total, &oversized);
+    if (oversized * 4 > total) {
+        UTEST_FAILED("%d of %d internal nodes are bigger than %d keys",
+                     oversized, total, internal_keys);
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_lookup(&tree, &keys[i], NULL) == &items[i]);
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_delete(&tree, &keys[i]) == &items[i]);
+        UTEST_ASSERT(tree_is_balanced(&tree));
+        UTEST_ASSERT(check_capacities(&tree, internal_keys));
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    free(keys);
+    free(items);
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_relaxed_balance, args)
+{
+    Ttree tree, avl;
+    int num_keys, num_items, imbalance, ret, i, j, tmp, round;
+    unsigned long rotations = 0, avl_rotations = 0;
+    int *keys;
+    struct item *items;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    imbalance = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+    keys = malloc(sizeof(*keys) * num_items);
+    items = malloc(sizeof(*items) * num_items * 2);
+    UTEST_ASSERT((keys != NULL) && (items != NULL));
+
+    /*
+     * A single order of keys may need a few more rotations with relaxed
+     * balancing in a small tree, so rotations of several orders are
+     * compared.
+     */
+    for (round = 0; round < 4; round++) {
+        ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+        UTEST_ASSERT(ret >= 0);
+        ret = ttree_init(&avl, num_keys, true, __cmpfunc, struct item, key);
+        UTEST_ASSERT(ret >= 0);
+        UTEST_ASSERT(ttree_set_balance(&tree, 0) < 0);
+        UTEST_ASSERT(ttree_set_balance(&tree, TTREE_MAX_IMBALANCE + 1) < 0);
+        UTEST_ASSERT(ttree_set_balance(&tree, imbalance) == 0);
+
+        srandom(num_items + round);
+        for (i = 0; i < num_items; i++) {
+            keys[i] = i;
+        }
+        for (i = num_items - 1; i > 0; i--) {
+            j = random() % (i + 1);
+            tmp = keys[i];
+            keys[i] = keys[j];
+            keys[j] = tmp;
+        }
+
+        /* Both trees get the same keys in the same order. */
+        for (i = 0; i < num_items; i++) {
+            items[i].key = items[num_items + i].key = keys[i];
+            UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+            UTEST_ASSERT(ttree_insert(&avl, &items[num_items + i]) == 0);
+            UTEST_ASSERT(tree_is_balanced(&tree));
+        }
+
+        UTEST_ASSERT(ttree_set_balance(&tree, imbalance) < 0);
+        for (i = 0; i < num_items; i++) {
+            UTEST_ASSERT(ttree_lookup(&tree, &keys[i], NULL) == &items[i]);
+        }
+
+        /* Delete a half of keys and insert them back. */
+        for (i = 0; i < num_items; i += 2) {
+            UTEST_ASSERT(ttree_delete(&tree, &keys[i]) == &items[i]);
+            UTEST_ASSERT(ttree_delete(&avl, &keys[i]) ==
+                         &items[num_items + i]);
+            UTEST_ASSERT(tree_is_balanced(&tree));
+        }
+        for (i = 0; i < num_items; i += 2) {
+            UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+            UTEST_ASSERT(ttree_insert(&avl, &items[num_items + i]) == 0);
+            UTEST_ASSERT(tree_is_balanced(&tree));
+        }
+        for (i = 0; i < num_items; i++) {
+            UTEST_ASSERT(ttree_delete(&tree, &keys[i]) == &items[i]);
+            UTEST_ASSERT(ttree_delete(&avl, &keys[i]) ==
+                         &items[num_items + i]);
+            UTEST_ASSERT(tree_is_balanced(&tree));
+        }
+
+        UTEST_ASSERT(ttree_is_empty(&tree));
+        rotations += tree.num_rotations;
+        avl_rotations += avl.num_rotations;
+        ttree_destroy(&tree);
+        ttree_destroy(&avl);
+    }
+
+    if (rotations > avl_rotations) {
+        UTEST_FAILED("%lu rotations were done with imbalance %d, "
+                     "but only %lu with AVL balancing", rotations,
+                     imbalance, avl_rotations);
+    }
+
+    free(keys);
+    free(items);
+    UTEST_PASSED();
+}
+
 DEFINE_UTESTS_LIST(tests) = {
     {
         "UT_INSERT_INC",
@@ -286,7 +566,55 @@ DEFINE_UTESTS_LIST(tests) = {
             UTEST_ARGS_LIST_END,
         },
     },
+    {
+        "UT_NODE_GROWTH",
+        "Insert and remove items into a tree with growing nodes",
+        ut_node_growth,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Maximum number of keys per T*-tree node" },
+            { "min_keys", UT_ARG_INT, "Number of keys in new nodes" },
+            {
+                "total_items", UT_ARG_INT,
+                "Total number of items that will be inserted into the tree.",
+            },
 
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_INTERNAL_NODES",
+        "Insert and remove items into a tree with small internal nodes",
+        ut_internal_nodes,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree leaf node" },
+            {
+                "internal_keys", UT_ARG_INT,
+                "Number of keys per internal T*-tree node",
+            },
+            {
+                "total_items", UT_ARG_INT,
+                "Total number of items that will be inserted into the tree.",
+            },
+
+            UTEST_ARGS_LIST_END,
+        },
+    },
+
+    {
+        "UT_RELAXED_BALANCE",
+        "Keep a tree balanced with bigger difference of subtrees heights",
+        ut_relaxed_balance,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items to insert" },
+            {
+                "imbalance", UT_ARG_INT,
+                "Maximum difference of heights of subtrees",
+            },
+
+            UTEST_ARGS_LIST_END,
+        },
+    },
     UTESTS_LIST_END,
 };
 
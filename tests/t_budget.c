@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+#define ITEM_SIZE 16
+
+struct item {
+    int key;
+    bool evicted;
+};
+
+struct evict_info {
+    int num_evicted;
+    int next_key;
+    bool in_order;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static size_t item_size(void *item)
+{
+    return ITEM_SIZE;
+}
+
+static void evict_item(void *item, void *arg)
+{
+    struct item *it = item;
+    struct evict_info *ei = arg;
+
+    if (it->key != ei->next_key) {
+        ei->in_order = false;
+    }
+
+    it->evicted = true;
+    ei->next_key = it->key + 1;
+    ei->num_evicted++;
+}
+
+static int count_items(Ttree *tree)
+{
+    TtreeCursor cursor;
+    int cnt = 0;
+
+    if (ttree_cursor_open(&cursor, tree) < 0) {
+        return 0;
+    }
+    if (ttree_cursor_first(&cursor) != TCSR_OK) {
+        return 0;
+    }
+
+    do {
+        cnt++;
+    } while (ttree_cursor_next(&cursor) == TCSR_OK);
+
+    return cnt;
+}
+
+UTEST_FUNCTION(ut_budget_left_edge, args)
+{
+    Ttree tree;
+    struct item *items;
+    struct evict_info ei;
+    int num_keys, num_items, i, ret;
+    size_t budget;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    budget = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    items = calloc(num_items, sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+
+    ei.num_evicted = 0;
+    ei.next_key = 0;
+    ei.in_order = true;
+    ret = ttree_set_budget(&tree, budget, TTREE_EVICT_LEFT_EDGE,
+                           item_size, evict_item, &ei);
+    UTEST_ASSERT(ret == 0);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+        if (ttree_mem_usage(&tree) > budget) {
+            UTEST_FAILED("Tree uses %zd bytes after %d items are inserted, "
+                         "budget is %zd", ttree_mem_usage(&tree), i + 1,
+                         budget);
+        }
+    }
+    if (!ei.in_order) {
+        UTEST_FAILED("Items were not evicted from the left edge");
+    }
+    if (ei.num_evicted + count_items(&tree) != num_items) {
+        UTEST_FAILED("%d items are evicted, %d are in the tree, "
+                     "%d were inserted", ei.num_evicted,
+                     count_items(&tree), num_items);
+    }
+
+    /* Make the budget smaller. */
+    budget /= 2;
+    ret = ttree_set_budget(&tree, budget, TTREE_EVICT_LEFT_EDGE,
+                           item_size, evict_item, &ei);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ttree_mem_usage(&tree) <= budget);
+    UTEST_ASSERT(ei.in_order);
+
+    /* Memory used by the rest of items is released when they're removed */
+    for (i = ei.next_key; i < num_items; i++) {
+        UTEST_ASSERT(ttree_delete(&tree, &i) == &items[i]);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    UTEST_ASSERT(ttree_mem_usage(&tree) == 0);
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_budget_lru, args)
+{
+    Ttree tree;
+    struct item *items;
+    struct evict_info ei;
+    int num_keys, num_items, num_hot, i, j, ret;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_hot = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items / 2 >= num_hot) && (num_hot >= 0));
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    items = calloc(num_items, sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+
+    /*
+     * Fill the tree with a half of items and limit its memory
+     * by the amount it uses(including items).
+     */
+    for (i = 0; i < num_items / 2; i++) {
+        items[i].key = i;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    ei.num_evicted = 0;
+    ei.next_key = 0;
+    ret = ttree_set_budget(&tree, 0, TTREE_EVICT_LRU, item_size, NULL, NULL);
+    UTEST_ASSERT(ret == 0);
+    ret = ttree_set_budget(&tree, ttree_mem_usage(&tree) + ITEM_SIZE,
+                           TTREE_EVICT_LRU, item_size, evict_item, &ei);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ei.num_evicted == 0);
+    for (; i < num_items; i++) {
+        /* Items with the smallest keys are accessed all the time. */
+        for (j = 0; j < num_hot; j++) {
+            if (!ttree_lookup(&tree, &j, NULL)) {
+                UTEST_FAILED("Frequently accessed item %d was evicted "
+                             "after %d items are inserted", j, i);
+            }
+        }
+
+        items[i].key = i;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+        UTEST_ASSERT(ttree_mem_usage(&tree) <= tree.mem_budget);
+    }
+
+    UTEST_ASSERT(ei.num_evicted > 0);
+    UTEST_ASSERT(ei.num_evicted + count_items(&tree) == num_items);
+    for (i = 0; i < num_items; i++) {
+        if (items[i].evicted != !ttree_lookup(&tree, &i, NULL)) {
+            UTEST_FAILED("Item %d is %s evicted, but it is %s in the tree",
+                         i, items[i].evicted ? "" : "not",
+                         items[i].evicted ? "still" : "not");
+        }
+    }
+
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct spilled_item {
+    int key;
+    char data[ITEM_SIZE - sizeof(int)];
+};
+
+struct spill_info {
+    int num_live;  /* Number of items in memory */
+    int num_faults;
+};
+
+static ssize_t spill_item(void *item, int fd, off_t offs, void *arg)
+{
+    struct spill_info *si = arg;
+    ssize_t ret;
+
+    ret = pwrite(fd, item, sizeof(struct spilled_item), offs);
+    if (ret == sizeof(struct spilled_item)) {
+        free(item);
+        si->num_live--;
+    }
+
+    return ret;
+}
+
+static void *fault_item(int fd, off_t offs, void *arg)
+{
+    struct spill_info *si = arg;
+    struct spilled_item *it;
+
+    it = malloc(sizeof(*it));
+    if (!it || (pread(fd, it, sizeof(*it), offs) != sizeof(*it))) {
+        return NULL;
+    }
+
+    si->num_live++;
+    si->num_faults++;
+    return it;
+}
+
+static struct spilled_item *new_spilled_item(struct spill_info *si, int key)
+{
+    struct spilled_item *it;
+
+    it = malloc(sizeof(*it));
+    if (it) {
+        it->key = key;
+        memset(it->data, key & 0xff, sizeof(it->data));
+        si->num_live++;
+    }
+
+    return it;
+}
+
+UTEST_FUNCTION(ut_spill, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    FILE *file;
+    struct spilled_item *it;
+    struct spill_info si;
+    int num_keys, num_items, num_hot, i, ret, spilled;
+    size_t mem_nodes;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_hot = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= num_hot) && (num_hot >= 0));
+
+    file = tmpfile();
+    UTEST_ASSERT(file != NULL);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc,
+                     struct spilled_item, key);
+    UTEST_ASSERT(ret == 0);
+
+    /* Lookups must not touch items, so keys are kept inside nodes. */
+    ret = ttree_set_spill(&tree, fileno(file), spill_item, fault_item, &si);
+    UTEST_ASSERT(ret < 0);
+    UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int)) == 0);
+    ret = ttree_set_budget(&tree, 0, TTREE_EVICT_LRU, item_size, NULL, NULL);
+    UTEST_ASSERT(ret == 0);
+    ret = ttree_set_spill(&tree, fileno(file), spill_item, fault_item, &si);
+    UTEST_ASSERT(ret == 0);
+
+    /* Even keys are inserted now, odd ones when items are spilled. */
+    memset(&si, 0, sizeof(si));
+    for (i = 0; i < num_items; i++) {
+        it = new_spilled_item(&si, 2 * i);
+        UTEST_ASSERT(it != NULL);
+        UTEST_ASSERT(ttree_insert(&tree, it) == 0);
+    }
+
+    mem_nodes = ttree_mem_usage(&tree) - num_items * ITEM_SIZE;
+    for (i = 0; i < num_items; i++) {
+        int key, j;
+
+        for (j = 0; j < num_hot; j++) {
+            key = 2 * j;
+            it = ttree_lookup(&tree, &key, NULL);
+            if (!it || (it->key != key)) {
+                UTEST_FAILED("Lookup of spilled item %d failed", key);
+            }
+        }
+
+        UTEST_ASSERT(ttree_spill_cold(&tree, 1) >= 0);
+        if (ttree_mem_usage(&tree) != mem_nodes + si.num_live * ITEM_SIZE) {
+            UTEST_FAILED("Tree uses %zd bytes, but only %d items of %zd "
+                         "bytes are in memory", ttree_mem_usage(&tree),
+                         si.num_live, (size_t)ITEM_SIZE);
+        }
+    }
+    if (si.num_live > 2 * (num_hot + num_keys)) {
+        UTEST_FAILED("%d items are in memory, only %d are accessed",
+                     si.num_live, num_hot);
+    }
+
+    /* Items of nodes keys are inserted to are read back. */
+    for (i = 0; i < num_items; i++) {
+        it = new_spilled_item(&si, 2 * i + 1);
+        UTEST_ASSERT(it != NULL);
+        UTEST_ASSERT(ttree_insert(&tree, it) == 0);
+        if (!(i % 8)) {
+            UTEST_ASSERT(ttree_spill_cold(&tree, 2) >= 0);
+        }
+    }
+
+    spilled = ttree_spill_cold(&tree, 2 * num_items);
+    UTEST_ASSERT(spilled >= 0);
+    UTEST_ASSERT(si.num_live == 0);
+
+    /* Cursors read items back in order. */
+    i = 0;
+    ttree_cursor_open(&cursor, &tree);
+    ret = ttree_cursor_first(&cursor);
+    while (ret == TCSR_OK) {
+        it = ttree_item_from_cursor(&cursor);
+        if (it->key != i) {
+            UTEST_FAILED("Cursor found item %d instead of %d", it->key, i);
+        }
+
+        i++;
+        ret = ttree_cursor_next(&cursor);
+    }
+
+    UTEST_ASSERT(i == 2 * num_items);
+    UTEST_ASSERT(si.num_live == 2 * num_items);
+    UTEST_ASSERT(ttree_spill_cold(&tree, 2 * num_items) == 2 * num_items);
+    for (i = 2 * num_items - 1; i >= 0; i--) {
+        it = ttree_delete(&tree, &i);
+        if (!it || (it->key != i)) {
+            UTEST_FAILED("Failed to delete spilled item %d", i);
+        }
+
+        free(it);
+        si.num_live--;
+    }
+
+    UTEST_ASSERT(si.num_live == 0);
+    UTEST_ASSERT(ttree_mem_usage(&tree) == 0);
+    ttree_destroy(&tree);
+    fclose(file);
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_top_k, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct item *items, *dropped, dup;
+    struct evict_info ei;
+    int num_keys, num_items, k, i, ret, tmp, min_kept;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    k = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((k > 0) && (k <= num_items));
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ttree_set_capacity(&tree, k, TNODE_BOUND, NULL, NULL) < 0);
+    UTEST_ASSERT(ttree_set_capacity(&tree, k, TNODE_LEFT, NULL, NULL) == 0);
+    items = calloc(num_items, sizeof(*items));
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+    }
+    for (i = num_items - 1; i > 0; i--) {
+        ret = random() % (i + 1);
+        tmp = items[i].key;
+        items[i].key = items[ret].key;
+        items[ret].key = tmp;
+    }
+
+    /* Only k items with the biggest keys stay in the tree. */
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert_bounded(&tree, &items[i],
+                                          (void **)&dropped) == 0);
+        if (dropped) {
+            if (dropped->evicted) {
+                UTEST_FAILED("Item %d was dropped twice", dropped->key);
+            }
+
+            dropped->evicted = true;
+        }
+
+        UTEST_ASSERT(ttree_num_items(&tree) == ((i < k) ? (i + 1) : k));
+
+        /* The same key is either a duplicate or rejected again. */
+        ret = ttree_insert_bounded(&tree, &items[i], (void **)&dropped);
+        if (items[i].evicted) {
+            UTEST_ASSERT((ret == 0) && (dropped == &items[i]));
+        }
+        else {
+            UTEST_ASSERT((ret < 0) && (errno == EEXIST) && !dropped);
+        }
+    }
+
+    /* A duplicate doesn't move the cursor on the edge item. */
+    ttree_cursor_open(&cursor, &tree);
+    UTEST_ASSERT(ttree_cursor_first(&cursor) == TCSR_OK);
+    UTEST_ASSERT(ttree_cursor_register(&cursor) == 0);
+    memset(&dup, 0, sizeof(dup));
+    dup.key = num_items - 1;
+    tmp = ttree_insert_bounded(&tree, &dup, (void **)&dropped);
+    UTEST_ASSERT((tmp < 0) && (errno == EEXIST) && !dropped);
+    UTEST_ASSERT((cursor.state == CURSOR_OPENED) &&
+                 (((struct item *)ttree_item_from_cursor(&cursor))->key ==
+                  num_items - k));
+    UTEST_ASSERT(ttree_cursor_unregister(&cursor) == 0);
+
+    min_kept = num_items - k;
+    for (i = 0; i < num_items; i++) {
+        if (items[i].evicted != (items[i].key < min_kept)) {
+            UTEST_FAILED("Item %d is %s", items[i].key,
+                         items[i].evicted ? "dropped" : "kept");
+        }
+    }
+    UTEST_ASSERT(count_items(&tree) == k);
+
+    /*
+     * Keep k / 2 smallest keys now, extra items are evicted
+     * by usual insertions too.
+     */
+    ei.num_evicted = 0;
+    ei.next_key = 0;
+    ei.in_order = true;
+    ret = ttree_set_capacity(&tree, k / 2 + 1, TNODE_RIGHT, evict_item, &ei);
+    UTEST_ASSERT(ret == 0);
+    UTEST_ASSERT(ei.num_evicted == k - k / 2 - 1);
+    ttree_destroy(&tree);
+    UTEST_ASSERT(ttree_num_items(&tree) == 0);
+    ei.num_evicted = 0;
+    for (i = 0; i < num_items; i++) {
+        items[i].evicted = false;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    UTEST_ASSERT(ttree_num_items(&tree) == k / 2 + 1);
+    UTEST_ASSERT(ei.num_evicted == num_items - k / 2 - 1);
+    for (i = 0; i < num_items; i++) {
+        if (items[i].evicted != (items[i].key > k / 2)) {
+            UTEST_FAILED("Item %d is %s", items[i].key,
+                         items[i].evicted ? "evicted" : "kept");
+        }
+    }
+
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_BUDGET_LEFT_EDGE",
+        "Evict items with the smallest keys when memory budget is exceeded",
+        ut_budget_left_edge,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items to insert" },
+            { "budget", UT_ARG_INT, "Memory budget in bytes" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_BUDGET_LRU",
+        "Evict items from least recently used nodes",
+        ut_budget_lru,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items to insert" },
+            { "hot", UT_ARG_INT, "Number of frequently accessed items" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_TOP_K",
+        "Keep a limited number of items with the biggest keys",
+        ut_top_k,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items to insert" },
+            { "k", UT_ARG_INT, "Maximum number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_SPILL",
+        "Write items of cold nodes to a file and read them back",
+        ut_spill,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items to insert" },
+            { "hot", UT_ARG_INT, "Number of frequently accessed items" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "utest.h"
 #include "test_utils.h"
 #include "ttree.h"
@@ -245,6 +246,171 @@ UTEST_FUNCTION(ut_cursor_move, args)
     UTEST_PASSED();
 }
 
+UTEST_FUNCTION(ut_cursor_delete, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct balance_info binfo;
+    int num_keys, num_items, i, ret;
+    struct item *item;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    for (i = 0; i < num_items; i++) {
+        item = alloc_item(((i % 2) ? (num_items - 1 - i / 2) : (i / 2)) * 2);
+        UTEST_ASSERT(ttree_insert(&tree, item) == 0);
+    }
+
+    /*
+     * Walk through the tree removing each item whose key is not
+     * divisible by 3. After each deletion the cursor should point
+     * to the item following the removed one.
+     */
+    UTEST_ASSERT(ttree_cursor_open(&cursor, &tree) == 0);
+    UTEST_ASSERT(ttree_cursor_first(&cursor) == TCSR_OK);
+    i = 0;
+    while ((item = ttree_item_from_cursor(&cursor)) != NULL) {
+        if (item->key != i) {
+            UTEST_FAILED("Unexpected item with key %d. %d was expected!",
+                         item->key, i);
+        }
+
+        i += 2;
+        if (item->key % 3) {
+            UTEST_ASSERT(ttree_delete_at_cursor(&cursor) == item);
+            free(item);
+        }
+        else if (ttree_cursor_next(&cursor) != TCSR_OK) {
+            break;
+        }
+    }
+    if (i != num_items * 2) {
+        UTEST_FAILED("Iteration stopped on key %d. %d was expected!",
+                     i, num_items * 2);
+    }
+
+    check_tree_balance(&tree, &binfo);
+    if (binfo.balance != TREE_BALANCED) {
+        UTEST_FAILED("Tree is unbalanced on a node %p BFC = %d, %s\n",
+                     binfo.tnode, binfo.tnode->bfc,
+                     balance_name(binfo.balance));
+    }
+    for (i = 0; i < num_items * 2; i += 2) {
+        item = ttree_lookup(&tree, &i, NULL);
+        if ((i % 3) && item) {
+            UTEST_FAILED("Item with key %d was not removed!", i);
+        }
+        else if (!(i % 3) && !item) {
+            UTEST_FAILED("Item with key %d was lost!", i);
+        }
+    }
+
+    /* Now remove the rest items using the same cursor. */
+    UTEST_ASSERT(ttree_cursor_first(&cursor) == TCSR_OK);
+    while ((item = ttree_delete_at_cursor(&cursor)) != NULL) {
+        free(item);
+        if (cursor.state != CURSOR_OPENED) {
+            break;
+        }
+    }
+
+    UTEST_ASSERT(cursor.state == CURSOR_CLOSED);
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_cursor_stable, args)
+{
+    Ttree tree;
+    TtreeCursor cursor, copy;
+    int num_keys, num_items, i, ret, middle;
+    struct item *item;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 3);
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret == 0);
+    middle = num_items;
+    item = alloc_item(middle);
+    UTEST_ASSERT(ttree_insert(&tree, item) == 0);
+    UTEST_ASSERT(ttree_lookup(&tree, &middle, &cursor) == item);
+    UTEST_ASSERT(ttree_cursor_register(&cursor) == 0);
+    UTEST_ASSERT(ttree_cursor_register(&cursor) < 0);
+
+    /*
+     * Insert items from both sides of the one the cursor points to.
+     * Registered cursor should stay on the same item while it moves
+     * through T*-tree nodes.
+     */
+    for (i = 1; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, alloc_item(middle - i)) == 0);
+        UTEST_ASSERT(ttree_insert(&tree, alloc_item(middle + i)) == 0);
+        item = ttree_item_from_cursor(&cursor);
+        if (!item || (item->key != middle)) {
+            UTEST_FAILED("[step %d] Cursor lost its item after insertion!", i);
+        }
+    }
+
+    /* Remove every second item and check the cursor again. */
+    for (i = 1; i < 2 * num_items; i += 2) {
+        if (i == middle) {
+            continue;
+        }
+
+        free(ttree_delete(&tree, &i));
+        item = ttree_item_from_cursor(&cursor);
+        if (!item || (item->key != middle)) {
+            UTEST_FAILED("[key %d] Cursor lost its item after deletion!", i);
+        }
+    }
+
+    /*
+     * When the item under the cursor is removed, the cursor
+     * moves to the following item.
+     */
+    free(ttree_delete(&tree, &middle));
+    item = ttree_item_from_cursor(&cursor);
+    UTEST_ASSERT(item != NULL);
+    i = middle + ((middle % 2) ? 1 : 2);
+    if (item->key != i) {
+        UTEST_FAILED("Cursor points to %d, but %d was expected!",
+                     item->key, i);
+    }
+
+    /*
+     * A copy of a registered cursor isn't registered, a registered
+     * cursor stays registered after a copy is made to it.
+     */
+    memset(&copy, 0xff, sizeof(copy));
+    UTEST_ASSERT(ttree_cursor_copy(&copy, &cursor) == &copy);
+    UTEST_ASSERT(ttree_item_from_cursor(&copy) == item);
+    UTEST_ASSERT(ttree_cursor_unregister(&copy) < 0);
+    UTEST_ASSERT(ttree_cursor_register(&copy) == 0);
+    ttree_cursor_first(&copy);
+    ttree_cursor_copy(&copy, &cursor);
+    UTEST_ASSERT(ttree_item_from_cursor(&copy) == item);
+    UTEST_ASSERT(ttree_cursor_unregister(&copy) == 0);
+
+    /* Resume the scan from the cursor position. */
+    while (ttree_cursor_next(&cursor) == TCSR_OK) {
+        i += 2;
+        item = ttree_item_from_cursor(&cursor);
+        UTEST_ASSERT(item != NULL);
+        UTEST_ASSERT(item->key == i);
+    }
+
+    UTEST_ASSERT(ttree_cursor_unregister(&cursor) == 0);
+    UTEST_ASSERT(ttree_cursor_unregister(&cursor) < 0);
+    ttree_destroy(&tree);
+    UTEST_PASSED();
+}
+
 DEFINE_UTESTS_LIST(tests) = {
     {
         "UTEST_CURSOR_MOVE",
@@ -266,6 +432,26 @@ DEFINE_UTESTS_LIST(tests) = {
             UTEST_ARGS_LIST_END,
         },
     },
+    {
+        "UTEST_CURSOR_DELETE",
+        "Deletion at cursor while iterating test",
+        ut_cursor_delete,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UTEST_CURSOR_STABLE",
+        "Registered cursor should keep its item while tree is modified",
+        ut_cursor_stable,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
     {
         "UTEST_CURSOR_MOVE_PENDING",
         "Moving backward and forward on pending cursor",
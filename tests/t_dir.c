@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+#include "ttree_dir.h"
+
+struct item {
+    char key[16];
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return strcmp(key1, key2);
+}
+
+static int __qsort_cmpfunc(const void *item1, const void *item2)
+{
+    return strcmp(((struct item *)item1)->key, ((struct item *)item2)->key);
+}
+
+/*
+ * Keys are made of few letters, so many of them share prefixes,
+ * and some keys are shorter than prefixes.
+ */
+static struct item *alloc_items(int num_items, int alphabet)
+{
+    struct item *items;
+    int i, j, len;
+
+    items = calloc(num_items, sizeof(*items));
+    if (!items) {
+        return NULL;
+    }
+    for (i = 0; i < num_items; i++) {
+        len = random() % 6;
+        for (j = 0; j < len; j++) {
+            items[i].key[j] = 'a' + random() % alphabet;
+        }
+
+        snprintf(items[i].key + len, sizeof(items[i].key) - len, "%d", i);
+        if (len && !(i % 7)) {
+            /* Keys with unsigned bytes greater than ASCII ones */
+            items[i].key[0] = (char)0xe0 + random() % alphabet;
+        }
+    }
+
+    return items;
+}
+
+static bool check_order(TtreeDir *dir, struct item *sorted, int num_items,
+                        int step)
+{
+    TtreeDirCursor cursor;
+    struct item *item;
+    int i = 0, ret;
+
+    ret = ttree_dir_cursor_first(&cursor, dir);
+    while (ret == TCSR_OK) {
+        item = ttree_dir_item_from_cursor(&cursor);
+        if ((i >= num_items) || strcmp(item->key, sorted[i].key)) {
+            utest_warning("Item %d is %s, expected %s", i / step, item->key,
+                          (i < num_items) ? sorted[i].key : "nothing");
+            return false;
+        }
+
+        i += step;
+        ret = ttree_dir_cursor_next(&cursor);
+    }
+    if (i < num_items) {
+        utest_warning("Only %d items are found", i / step);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * ut_dir inserts items into a directory, then checks that all of them
+ * are found and iterated in the order of keys. Then items are removed
+ * and empty trees must be removed from the directory too.
+ */
+UTEST_FUNCTION(ut_dir, args)
+{
+    TtreeDir dir;
+    struct item *items, *sorted;
+    int prefix_len, alphabet, num_items, i;
+
+    prefix_len = utest_get_arg(args, 0, INT);
+    alphabet = utest_get_arg(args, 1, INT);
+    num_items = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(ttree_dir_init(&dir, TTREE_DIR_PREFIX_MAX + 1, 8, true,
+                                __cmpfunc, struct item, key) < 0);
+    UTEST_ASSERT(ttree_dir_init(&dir, prefix_len, 8, true, __cmpfunc,
+                                struct item, key) == 0);
+    srandom(num_items);
+    items = alloc_items(num_items, alphabet);
+    sorted = malloc(sizeof(*sorted) * num_items);
+    UTEST_ASSERT((items != NULL) && (sorted != NULL));
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_dir_insert(&dir, &items[i]) == 0);
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_dir_insert(&dir, &items[i]) < 0);
+        UTEST_ASSERT(ttree_dir_lookup(&dir, items[i].key) == &items[i]);
+    }
+
+    UTEST_ASSERT(ttree_dir_num_items(&dir) == num_items);
+    UTEST_ASSERT(ttree_dir_lookup(&dir, "") == NULL);
+    UTEST_ASSERT(ttree_dir_lookup(&dir, "zzzzzzzzzz") == NULL);
+    memcpy(sorted, items, sizeof(*sorted) * num_items);
+    qsort(sorted, num_items, sizeof(*sorted), __qsort_cmpfunc);
+    UTEST_ASSERT(check_order(&dir, sorted, num_items, 1));
+
+    /* Remove every second item in sorted order */
+    for (i = 1; i < num_items; i += 2) {
+        UTEST_ASSERT(ttree_dir_delete(&dir, sorted[i].key) != NULL);
+        UTEST_ASSERT(ttree_dir_delete(&dir, sorted[i].key) == NULL);
+    }
+
+    UTEST_ASSERT(check_order(&dir, sorted, num_items, 2));
+    for (i = 0; i < num_items; i += 2) {
+        UTEST_ASSERT(ttree_dir_delete(&dir, sorted[i].key) != NULL);
+    }
+
+    UTEST_ASSERT(ttree_dir_is_empty(&dir));
+    UTEST_ASSERT(ttree_dir_num_items(&dir) == 0);
+
+    /* Destroying directory frees all its trees */
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_dir_insert(&dir, &items[i]) == 0);
+    }
+
+    ttree_dir_destroy(&dir);
+    UTEST_ASSERT(ttree_dir_is_empty(&dir));
+    free(items);
+    free(sorted);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_DIR",
+        "Insert, lookup, iterate and remove items of trees directory",
+        ut_dir,
+        UTEST_ARGS_LIST {
+            { "prefix_len", UT_ARG_INT, "Number of bytes trees are found by" },
+            { "alphabet", UT_ARG_INT, "Number of different letters in keys" },
+            { "total_items", UT_ARG_INT, "Number of items in a directory" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
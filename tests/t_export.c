@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+#include "ttree_export.h"
+
+struct item {
+    int key;
+};
+
+struct row {
+    char name[6];
+    int key;
+    double value;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static ssize_t encode_item(void *item, void *buf, size_t size, void *arg)
+{
+    char str[16];
+    int len = sprintf(str, "%d\n", ((struct item *)item)->key);
+
+    if (len <= size) {
+        memcpy(buf, str, len);
+    }
+
+    return len;
+}
+
+/* Read exported data back from the beginning of a file. */
+static char *read_all(int fd, size_t size)
+{
+    char *data = malloc(size + 1);
+    size_t done = 0;
+    ssize_t ret;
+
+    if (!data) {
+        utest_error("Failed to allocate %zd bytes!", size + 1);
+    }
+
+    while (done < size) {
+        ret = pread(fd, data + done, size - done, done);
+        if (ret <= 0) {
+            break;
+        }
+
+        done += ret;
+    }
+
+    data[done] = '\0';
+    return data;
+}
+
+UTEST_FUNCTION(ut_export, args)
+{
+    Ttree tree;
+    struct item *items;
+    int num_keys, num_items, lo, hi, ret, i, num, start, pfd[2];
+    int *keys;
+    char *text, *p;
+    FILE *file;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    lo = utest_get_arg(args, 2, INT);
+    hi = utest_get_arg(args, 3, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int)) == 0);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+
+    /* Keys are even numbers inserted in random order. */
+    for (i = 0; i < num_items; i++) {
+        items[i].key = 2 * i;
+    }
+    for (i = num_items - 1; i > 0; i--) {
+        ret = random() % (i + 1);
+        num = items[i].key;
+        items[i].key = items[ret].key;
+        items[ret].key = num;
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    num = 0;
+    for (i = 0; i < num_items; i++) {
+        num += ((2 * i >= lo) && (2 * i <= hi));
+    }
+
+    start = (lo > 0) ? (lo + (lo & 1)) : 0;
+
+    /* Raw keys are written straight from nodes. */
+    file = tmpfile();
+    UTEST_ASSERT(file != NULL);
+    ret = ttree_export_range(&tree, fileno(file), &lo, &hi, 0, NULL, NULL);
+    if (ret != num) {
+        UTEST_FAILED("Exported %d keys instead of %d [ERR=%d]",
+                     ret, num, errno);
+    }
+
+    keys = (int *)read_all(fileno(file), num * sizeof(int));
+    for (i = 0; i < num; i++) {
+        if (keys[i] != start + 2 * i) {
+            UTEST_FAILED("Key %d is %d", i, keys[i]);
+        }
+    }
+
+    free(keys);
+    fclose(file);
+
+    /* Encoded items. */
+    file = tmpfile();
+    UTEST_ASSERT(file != NULL);
+    ret = ttree_export_range(&tree, fileno(file), &lo, &hi, 0,
+                             encode_item, NULL);
+    UTEST_ASSERT(ret == num);
+    text = read_all(fileno(file), num * 16);
+    for (i = 0, p = text; i < num; i++) {
+        if (strtol(p, &p, 10) != start + 2 * i) {
+            UTEST_FAILED("Item %d isn't exported", i);
+        }
+    }
+
+    UTEST_ASSERT(!num || (*p == '\n'));
+    free(text);
+    fclose(file);
+
+    /*
+     * Keys spliced into a pipe. Each slice takes a slot of the pipe,
+     * so only a few slices fit into it without a reader.
+     */
+    UTEST_ASSERT(pipe(pfd) == 0);
+    hi = lo + 40;
+    ret = ttree_export_range(&tree, pfd[1], &lo, &hi, TEXPORT_SPLICE,
+                             NULL, NULL);
+    UTEST_ASSERT(ret >= 0);
+    keys = malloc(sizeof(int) * (ret + 1));
+    UTEST_ASSERT(keys != NULL);
+    UTEST_ASSERT(read(pfd[0], keys, ret * sizeof(int)) ==
+                 ret * sizeof(int));
+    for (i = 0; i < ret; i++) {
+        UTEST_ASSERT(keys[i] == start + 2 * i);
+    }
+
+    free(keys);
+    close(pfd[0]);
+    close(pfd[1]);
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_columns, args)
+{
+    Ttree tree;
+    TtreeRange range;
+    struct ttree_column cols[3];
+    struct row *rows;
+    int num_keys, num_items, batch, packed, ret, i, j, lo, hi, num;
+    int *keys;
+    double *values;
+    char *names;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    batch = utest_get_arg(args, 2, INT);
+    packed = utest_get_arg(args, 3, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct row, key);
+    UTEST_ASSERT(ret >= 0);
+    if (packed) {
+        UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int)) == 0);
+    }
+
+    rows = malloc(sizeof(*rows) * num_items);
+    keys = malloc(sizeof(*keys) * batch);
+    values = malloc(sizeof(*values) * batch);
+    names = malloc(sizeof(rows->name) * batch);
+    UTEST_ASSERT(rows && keys && values && names);
+    for (i = 0; i < num_items; i++) {
+        rows[i].key = (num_items - i) * 3;
+        rows[i].value = rows[i].key / 2.0;
+        sprintf(rows[i].name, "%05d", rows[i].key % 100000);
+        UTEST_ASSERT(ttree_insert(&tree, &rows[i]) == 0);
+    }
+
+    cols[0].offs = TTREE_COLUMN_KEY;
+    cols[0].width = sizeof(int);
+    cols[0].buf = keys;
+    cols[1].offs = offsetof(struct row, value);
+    cols[1].width = sizeof(double);
+    cols[1].buf = values;
+    cols[2].offs = offsetof(struct row, name);
+    cols[2].width = sizeof(rows->name);
+    cols[2].buf = names;
+
+    /* Keys of the range are multiples of 3 in [lo, hi]. */
+    lo = num_items / 4;
+    hi = num_items * 2;
+    ttree_range_open(&range, &tree, &lo, &hi);
+    num = 0;
+    while ((ret = ttree_range_fetch(&range, cols, 3, batch)) > 0) {
+        for (j = 0; j < ret; j++, num++) {
+            i = ((lo + 2) / 3 + num) * 3;
+            if ((keys[j] != i) || (values[j] != i / 2.0) ||
+                (atoi(names + j * sizeof(rows->name)) != i % 100000)) {
+                UTEST_FAILED("Row %d is (%d, %g), but key %d is expected",
+                             num, keys[j], values[j], i);
+            }
+        }
+    }
+
+    UTEST_ASSERT(ret == 0);
+    if (num != (hi / 3) - (lo + 2) / 3 + 1) {
+        UTEST_FAILED("Fetched %d rows", num);
+    }
+
+    /* Only the key column is fetched without touching items. */
+    ttree_range_open(&range, &tree, NULL, NULL);
+    UTEST_ASSERT(ttree_range_fetch(&range, cols, 1, batch) ==
+                 ((batch < num_items) ? batch : num_items));
+    UTEST_ASSERT(keys[0] == 3);
+    UTEST_ASSERT(ttree_range_fetch(&range, cols, 1, -1) < 0);
+
+    ttree_destroy(&tree);
+    free(rows);
+    free(keys);
+    free(values);
+    free(names);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_EXPORT",
+        "Export keys and items of a range of a tree to files and pipes",
+        ut_export,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items in a tree" },
+            { "lo", UT_ARG_INT, "The lowest key of the range" },
+            { "hi", UT_ARG_INT, "The highest key of the range" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_COLUMNS",
+        "Fetch items of a range into column buffers by batches",
+        ut_columns,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items in a tree" },
+            { "batch", UT_ARG_INT, "Number of rows in a batch" },
+            { "packed", UT_ARG_INT, "Keep copies of keys in nodes(0 or 1)" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
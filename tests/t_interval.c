@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+
+struct interval {
+    int start;
+    int end;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+struct query {
+    struct interval *lo_bound;
+    int lo;
+    int hi;
+    int found;
+    bool sorted;
+};
+
+static int check_interval(void *item, void *arg)
+{
+    struct interval *iv = item;
+    struct query *q = arg;
+
+    if ((iv->start > q->hi) || (iv->end < q->lo)) {
+        q->sorted = false;
+    }
+    if (q->lo_bound && (q->lo_bound->start > iv->start)) {
+        q->sorted = false;
+    }
+
+    q->lo_bound = iv;
+    q->found++;
+    return 0;
+}
+
+static int count_overlaps(struct interval *ivs, bool *present,
+                          int num, int lo, int hi)
+{
+    int i, cnt = 0;
+
+    for (i = 0; i < num; i++) {
+        if (present[i] && (ivs[i].start <= hi) && (ivs[i].end >= lo)) {
+            cnt++;
+        }
+    }
+
+    return cnt;
+}
+
+static bool run_queries(Ttree *tree, struct interval *ivs, bool *present,
+                        int num_items, int range, int num_queries)
+{
+    struct query q;
+    int i, ret, exp;
+
+    for (i = 0; i < num_queries; i++) {
+        q.lo = random() % range;
+        q.hi = q.lo + random() % (range / 10 + 1);
+        q.lo_bound = NULL;
+        q.found = 0;
+        q.sorted = true;
+        ret = ttree_overlaps(tree, &q.lo, &q.hi, check_interval, &q);
+        exp = count_overlaps(ivs, present, num_items, q.lo, q.hi);
+        if ((ret != exp) || (q.found != exp) || !q.sorted) {
+            utest_warning("Query [%d, %d] found %d intervals, %d expected",
+                          q.lo, q.hi, ret, exp);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+UTEST_FUNCTION(ut_overlaps, args)
+{
+    Ttree tree;
+    struct interval *ivs;
+    bool *present;
+    int num_keys, num_items, i, ret, range;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    ret = ttree_init_intervals(&tree, num_keys, false, __cmpfunc,
+                               struct interval, start, end);
+    UTEST_ASSERT(ret == 0);
+    ivs = malloc(sizeof(*ivs) * num_items);
+    present = calloc(num_items, sizeof(*present));
+    UTEST_ASSERT((ivs != NULL) && (present != NULL));
+
+    srandom(num_items);
+    range = num_items * 10;
+    for (i = 0; i < num_items; i++) {
+        ivs[i].start = random() % range;
+        ivs[i].end = ivs[i].start + random() % (range / 20 + 1);
+        UTEST_ASSERT(ttree_insert(&tree, &ivs[i]) == 0);
+        present[i] = true;
+    }
+
+    UTEST_ASSERT(run_queries(&tree, ivs, present, num_items, range, 100));
+
+    /* Remove a half of intervals and check that the tree still works. */
+    for (i = 0; i < num_items; i += 2) {
+        TtreeCursor cursor;
+        struct interval *iv;
+
+        iv = ttree_lookup(&tree, &ivs[i].start, &cursor);
+        UTEST_ASSERT(iv != NULL);
+
+        /* Keys aren't unique, so find exactly the same item */
+        while (iv != &ivs[i]) {
+            UTEST_ASSERT(ttree_cursor_prev(&cursor) == TCSR_OK);
+            iv = ttree_item_from_cursor(&cursor);
+            if (iv->start != ivs[i].start) {
+                break;
+            }
+        }
+        while (iv != &ivs[i]) {
+            UTEST_ASSERT(ttree_cursor_next(&cursor) == TCSR_OK);
+            iv = ttree_item_from_cursor(&cursor);
+            UTEST_ASSERT(iv->start == ivs[i].start);
+        }
+
+        UTEST_ASSERT(ttree_delete_at_cursor(&cursor) == &ivs[i]);
+        present[i] = false;
+    }
+
+    UTEST_ASSERT(run_queries(&tree, ivs, present, num_items, range, 100));
+    ttree_destroy(&tree);
+    free(ivs);
+    free(present);
+    UTEST_PASSED();
+}
+
+/*
+ * Insert and delete intervals in random order. Many intervals end at
+ * the same points, so nodes may find the same maximum end point in
+ * different items. Ends of deleted intervals are damaged, so queries
+ * fail if a node still refers to a deleted interval.
+ */
+UTEST_FUNCTION(ut_overlaps_churn, args)
+{
+    Ttree tree;
+    struct interval *ivs;
+    bool *present;
+    int num_keys, num_items, num_ops, i, j, range;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    num_ops = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT(num_items >= 1);
+
+    UTEST_ASSERT(ttree_init_intervals(&tree, num_keys, true, __cmpfunc,
+                                      struct interval, start, end) == 0);
+    ivs = malloc(sizeof(*ivs) * num_items);
+    present = calloc(num_items, sizeof(*present));
+    UTEST_ASSERT((ivs != NULL) && (present != NULL));
+
+    srandom(num_ops);
+    range = num_items * 3 + 64;
+    for (i = 0; i < num_ops; i++) {
+        j = random() % num_items;
+        if (present[j]) {
+            if (ttree_delete(&tree, &ivs[j].start) != &ivs[j]) {
+                UTEST_FAILED("Interval %d isn't deleted at step %d", j, i);
+            }
+
+            ivs[j].end = -1;
+            present[j] = false;
+        }
+        else {
+            ivs[j].start = j * 3;
+            ivs[j].end = (ivs[j].start + random() % 64) / 8 * 8 + 7;
+            UTEST_ASSERT(ttree_insert(&tree, &ivs[j]) == 0);
+            present[j] = true;
+        }
+        if (!run_queries(&tree, ivs, present, num_items, range, 4)) {
+            UTEST_FAILED("Queries failed after step %d", i);
+        }
+    }
+
+    ttree_destroy(&tree);
+    free(ivs);
+    free(present);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_OVERLAPS",
+        "Search for intervals overlapping given one",
+        ut_overlaps,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of intervals in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_OVERLAPS_CHURN",
+        "Query intervals while they're inserted and deleted in random order",
+        ut_overlaps_churn,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Maximum number of intervals in a tree" },
+            { "ops", UT_ARG_INT, "Number of insertions and deletions" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
 #include "utest.h"
 #include "test_utils.h"
 #include "ttree.h"
@@ -102,6 +105,1042 @@ UTEST_FUNCTION(ut_lookup, args)
     UTEST_PASSED();
 }
 
+/*
+ * Small tree keeps its only node inside Ttree structure. Check
+ * that the node is moved to the heap properly when the tree grows.
+ */
+UTEST_FUNCTION(ut_inline_root, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct item *items;
+    int num_keys, num_items, ret, i;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT((num_keys <= TTREE_INLINE_NUMKEYS) &&
+                 (num_items > num_keys));
+
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+
+    /* The root is kept at the heap unless inlining is enabled. */
+    items[0].key = 1;
+    UTEST_ASSERT(ttree_insert(&tree, &items[0]) == 0);
+    UTEST_ASSERT(tree.root != &tree.inline_root);
+    UTEST_ASSERT(ttree_set_inline_root(&tree, true) < 0);
+    UTEST_ASSERT(ttree_delete(&tree, &items[0].key) == &items[0]);
+    UTEST_ASSERT(ttree_set_inline_root(&tree, true) == 0);
+    for (i = 0; i < num_keys; i++) {
+        items[i].key = i * 2 + 1;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    UTEST_ASSERT(tree.root == &tree.inline_root);
+    UTEST_ASSERT(ttree_mem_usage(&tree) == 0);
+
+    /* Keep the cursor on the greatest key while the root is moved */
+    UTEST_ASSERT(ttree_lookup(&tree, &items[num_keys - 1].key, &cursor));
+    UTEST_ASSERT(ttree_cursor_register(&cursor) == 0);
+    items[num_keys].key = 0;
+    UTEST_ASSERT(ttree_insert(&tree, &items[num_keys]) == 0);
+    UTEST_ASSERT(tree.root != &tree.inline_root);
+    UTEST_ASSERT(ttree_item_from_cursor(&cursor) == &items[num_keys - 1]);
+    UTEST_ASSERT(ttree_cursor_unregister(&cursor) == 0);
+
+    for (i = num_keys + 1; i < num_items; i++) {
+        items[i].key = i * 2 + 1;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+    for (i = 0; i < num_items; i++) {
+        CHECK_ITEM((struct item *)ttree_lookup(&tree, &items[i].key, NULL),
+                   items[i].key);
+    }
+
+    /* Inline root is used again after the tree becomes empty */
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_delete(&tree, &items[i].key) == &items[i]);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    UTEST_ASSERT(ttree_insert(&tree, &items[0]) == 0);
+    UTEST_ASSERT(tree.root == &tree.inline_root);
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+/*
+ * Move an array of trees of different sizes the way a growing array
+ * is reallocated and check that trees and their registered cursors
+ * work at the new place.
+ */
+UTEST_FUNCTION(ut_relocate, args)
+{
+    Ttree *trees, *moved;
+    TtreeCursor *cursors;
+    struct item *items;
+    int num_keys, num_trees, num_items, ret, i, j, k, n;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_trees = utest_get_arg(args, 1, INT);
+    num_items = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_trees > 0) && (num_items > 0));
+
+    trees = malloc(sizeof(*trees) * num_trees);
+    cursors = malloc(sizeof(*cursors) * num_trees);
+    items = malloc(sizeof(*items) * num_trees * num_items);
+    UTEST_ASSERT(trees && cursors && items);
+
+    /* Tree i gets i items(modulo num_items), some of them stay inline. */
+    for (i = 0; i < num_trees; i++) {
+        ret = ttree_init(&trees[i], num_keys, true, __cmpfunc,
+                         struct item, key);
+        UTEST_ASSERT(ret >= 0);
+        UTEST_ASSERT(ttree_set_inline_root(&trees[i], true) == 0);
+        for (j = 0; j < num_items; j++) {
+            items[i * num_items + j].key = j * 2 + 1;
+        }
+        for (j = 0; j < i % num_items; j++) {
+            UTEST_ASSERT(ttree_insert(&trees[i],
+                                      &items[i * num_items + j]) == 0);
+        }
+
+        ttree_cursor_open(&cursors[i], &trees[i]);
+        ttree_cursor_first(&cursors[i]);
+        UTEST_ASSERT(ttree_cursor_register(&cursors[i]) == 0);
+    }
+
+    for (k = 0; k < 3; k++) {
+        moved = malloc(sizeof(*moved) * num_trees);
+        UTEST_ASSERT(moved != NULL);
+        memcpy(moved, trees, sizeof(*trees) * num_trees);
+        for (i = 0; i < num_trees; i++) {
+            ttree_relocate(&moved[i], &trees[i]);
+        }
+
+        memset(trees, 0xff, sizeof(*trees) * num_trees);
+        free(trees);
+        trees = moved;
+
+        /* Trees keep growing at the new place. */
+        for (i = 0; i < num_trees; i++) {
+            n = i % num_items + k;
+            if (n < num_items) {
+                UTEST_ASSERT(ttree_insert(&trees[i],
+                                          &items[i * num_items + n]) == 0);
+            }
+        }
+        for (i = 0; i < num_trees; i++) {
+            n = i % num_items + k + 1;
+            n = (n < num_items) ? n : num_items;
+            if (ttree_num_items(&trees[i]) != n) {
+                UTEST_FAILED("Tree %d has %zd items instead of %d", i,
+                             ttree_num_items(&trees[i]), n);
+            }
+            for (j = 0; j < n; j++) {
+                CHECK_ITEM((struct item *)
+                           ttree_lookup(&trees[i], &items[j].key, NULL),
+                           items[j].key);
+            }
+            if ((i % num_items) &&
+                (ttree_item_from_cursor(&cursors[i]) !=
+                 &items[i * num_items])) {
+                UTEST_FAILED("Cursor of tree %d lost its item", i);
+            }
+        }
+    }
+
+    for (i = 0; i < num_trees; i++) {
+        UTEST_ASSERT(ttree_cursor_unregister(&cursors[i]) == 0);
+        ttree_destroy(&trees[i]);
+    }
+
+    /* Trees don't inline roots by default, so they may be just copied. */
+    ret = ttree_init(&trees[0], num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_insert(&trees[0], &items[0]) == 0);
+    trees[1 % num_trees] = trees[0];
+    CHECK_ITEM((struct item *)ttree_lookup(&trees[1 % num_trees],
+                                           &items[0].key, NULL),
+               items[0].key);
+    ttree_destroy(&trees[1 % num_trees]);
+
+    free(trees);
+    free(cursors);
+    free(items);
+    UTEST_PASSED();
+}
+
+static bool packed_keys_match(Ttree *tree)
+{
+    TtreeNode *tnode;
+    int i;
+
+    for (tnode = ttree_node_leftmost(tree->root); tnode;
+         tnode = tnode->successor) {
+        tnode_for_each_index(tnode, i) {
+            if (*(int *)tnode_packed_key(tree, tnode, i) !=
+                *(int *)tnode_key(tnode, i)) {
+                utest_warning("Copy of key %d differs from the key",
+                              *(int *)tnode_key(tnode, i));
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+UTEST_FUNCTION(ut_packed_keys, args)
+{
+    Ttree tree;
+    struct item *items, *new_items;
+    int num_keys, num_items, ret, i, key;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int)) == 0);
+    items = malloc(sizeof(*items) * num_items);
+    new_items = malloc(sizeof(*new_items) * num_items);
+    UTEST_ASSERT((items != NULL) && (new_items != NULL));
+
+    /* Insert keys from both ends to the middle */
+    for (i = 0; i < num_items; i++) {
+        items[i].key = (i & 1) ? (num_items - i) * 2 + 1 : i * 2 + 1;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    UTEST_ASSERT(ttree_pack_keys(&tree, 0) < 0);
+    UTEST_ASSERT(packed_keys_match(&tree));
+    for (i = 0; i < num_items; i++) {
+        CHECK_ITEM((struct item *)ttree_lookup(&tree, &items[i].key, NULL),
+                   items[i].key);
+        key = items[i].key - 1;
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == NULL);
+    }
+    for (i = 0; i < num_items; i += 2) {
+        UTEST_ASSERT(ttree_delete(&tree, &items[i].key) == &items[i]);
+    }
+
+    UTEST_ASSERT(packed_keys_match(&tree));
+    for (i = 1; i < num_items; i += 2) {
+        new_items[i].key = items[i].key;
+        UTEST_ASSERT(ttree_replace(&tree, &items[i].key, &new_items[i]) == 0);
+    }
+
+    UTEST_ASSERT(packed_keys_match(&tree));
+    for (i = 0; i < num_items; i++) {
+        if (i & 1) {
+            UTEST_ASSERT(ttree_lookup(&tree, &items[i].key, NULL) ==
+                         &new_items[i]);
+        }
+        else {
+            UTEST_ASSERT(ttree_lookup(&tree, &items[i].key, NULL) == NULL);
+        }
+    }
+
+    ttree_destroy(&tree);
+    free(items);
+    free(new_items);
+    UTEST_PASSED();
+}
+
+static int encoded_key_size;
+
+/* Big-endian integer with flipped sign bit, cut to encoded_key_size. */
+static void encode_int(void *key, void *buf)
+{
+    unsigned int val = (unsigned int)*(int *)key ^ 0x80000000U;
+    unsigned char bytes[sizeof(val)];
+    int i;
+
+    for (i = 0; i < sizeof(val); i++) {
+        bytes[i] = val >> ((sizeof(val) - i - 1) * 8);
+    }
+
+    memcpy(buf, bytes, encoded_key_size);
+}
+
+UTEST_FUNCTION(ut_encoded_keys, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct item *items;
+    int num_keys, num_items, ret, i, key, prev;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    encoded_key_size = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((encoded_key_size > 0) && (encoded_key_size <= sizeof(int)));
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_encode_keys(&tree, encode_int,
+                                   TTREE_ENCODED_KEY_MAX + 1, true) < 0);
+    UTEST_ASSERT(ttree_encode_keys(&tree, encode_int, encoded_key_size,
+                                   encoded_key_size == sizeof(int)) == 0);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+
+    /* Negative and positive keys, their encodings differ in sign bit */
+    for (i = 0; i < num_items; i++) {
+        items[i].key = ((i & 1) ? (num_items - i) : i) * 2 * 0x10001 -
+            num_items * 0x10001;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+    for (i = 0; i < num_items; i++) {
+        CHECK_ITEM((struct item *)ttree_lookup(&tree, &items[i].key, NULL),
+                   items[i].key);
+        key = items[i].key + 1;
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == NULL);
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) < 0);
+    }
+
+    i = 0;
+    UTEST_ASSERT(ttree_cursor_open(&cursor, &tree) == 0);
+    UTEST_ASSERT(ttree_cursor_first(&cursor) == TCSR_OK);
+    do {
+        key = *(int *)ttree_key_from_cursor(&cursor);
+        if (i++ && (key <= prev)) {
+            UTEST_FAILED("Key %d follows key %d", key, prev);
+        }
+
+        prev = key;
+    } while (ttree_cursor_next(&cursor) == TCSR_OK);
+
+    UTEST_ASSERT(i == num_items);
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_delete(&tree, &items[i].key) == &items[i]);
+    }
+
+    UTEST_ASSERT(ttree_is_empty(&tree));
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+struct row_key {
+    int32_t tenant;
+    int64_t timestamp;
+    char name[8];
+};
+
+struct row {
+    struct row_key key;
+};
+
+static const struct ttree_key_column row_columns[] = {
+    ttree_key_column(struct row_key, tenant, TTREE_COL_INT, false),
+    ttree_key_column(struct row_key, timestamp, TTREE_COL_INT, true),
+    ttree_key_column(struct row_key, name, TTREE_COL_STRING, false),
+};
+
+static int __row_cmpfunc(void *key1, void *key2)
+{
+    struct row_key *k1 = key1, *k2 = key2;
+
+    if (k1->tenant != k2->tenant) {
+        return (k1->tenant < k2->tenant) ? -1 : 1;
+    }
+    if (k1->timestamp != k2->timestamp) {
+        return (k1->timestamp > k2->timestamp) ? -1 : 1;
+    }
+
+    return strncmp(k1->name, k2->name, sizeof(k1->name));
+}
+
+struct prefix_scan {
+    struct row_key *prev;
+    struct row_key *prefix;
+    int num_cols;
+    int failed;
+};
+
+static int check_prefix_row(void *item, void *arg)
+{
+    struct prefix_scan *scan = arg;
+    struct row_key *key = &((struct row *)item)->key;
+
+    if ((key->tenant != scan->prefix->tenant) ||
+        ((scan->num_cols > 1) &&
+         (key->timestamp != scan->prefix->timestamp)) ||
+        (scan->prev && (__row_cmpfunc(scan->prev, key) >= 0))) {
+        scan->failed++;
+    }
+
+    scan->prev = key;
+    return 0;
+}
+
+UTEST_FUNCTION(ut_key_columns, args)
+{
+    Ttree tree;
+    TtreeCursor cursor;
+    struct row *rows;
+    struct row_key key, *prev = NULL;
+    struct prefix_scan scan;
+    int num_tenants, num_rows, ret, i, j, n;
+
+    num_tenants = utest_get_arg(args, 0, INT);
+    num_rows = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT((num_tenants > 0) && (num_rows > 0) && (num_rows < 10000));
+    ret = ttree_init(&tree, 16, true, __row_cmpfunc, struct row, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_set_key_columns(&tree, row_columns, 0) < 0);
+    UTEST_ASSERT(ttree_set_key_columns(&tree, row_columns, 3) == 0);
+    rows = calloc(num_tenants * num_rows, sizeof(*rows));
+    UTEST_ASSERT(rows != NULL);
+
+    srandom(num_rows);
+    for (i = 0; i < num_tenants * num_rows; i++) {
+        rows[i].key.tenant = i % num_tenants - num_tenants / 2;
+        rows[i].key.timestamp = (int64_t)(random() % 64 - 32) * (1LL << 40);
+        snprintf(rows[i].key.name, sizeof(rows[i].key.name), "%c%d",
+                 'a' + (int)(random() % 26), (i / num_tenants) % 10000);
+        UTEST_ASSERT(ttree_insert(&tree, &rows[i]) == 0);
+    }
+
+    /* Items follow in the order of columns */
+    n = 0;
+    UTEST_ASSERT(ttree_cursor_open(&cursor, &tree) == 0);
+    UTEST_ASSERT(ttree_cursor_first(&cursor) == TCSR_OK);
+    do {
+        struct row_key *k = ttree_key_from_cursor(&cursor);
+
+        if (prev && (__row_cmpfunc(prev, k) >= 0)) {
+            UTEST_FAILED("Row %d:%lld:%s follows row %d:%lld:%s",
+                         k->tenant, (long long)k->timestamp, k->name,
+                         prev->tenant, (long long)prev->timestamp,
+                         prev->name);
+        }
+
+        prev = k;
+        n++;
+    } while (ttree_cursor_next(&cursor) == TCSR_OK);
+
+    UTEST_ASSERT(n == num_tenants * num_rows);
+    for (i = 0; i < num_tenants * num_rows; i++) {
+        UTEST_ASSERT(ttree_lookup(&tree, &rows[i].key, NULL) == &rows[i]);
+    }
+
+    /* All rows of a tenant */
+    for (i = 0; i < num_tenants; i++) {
+        memset(&scan, 0, sizeof(scan));
+        scan.prefix = &rows[i].key;
+        scan.num_cols = 1;
+        n = ttree_scan_prefix(&tree, &rows[i].key, 1, check_prefix_row, &scan);
+        if ((n != num_rows) || scan.failed) {
+            UTEST_FAILED("Found %d rows of tenant %d(%d are wrong)",
+                         n, rows[i].key.tenant, scan.failed);
+        }
+    }
+
+    /* All rows of a tenant with the same timestamp */
+    for (i = 0; i < num_tenants * num_rows; i += num_rows / 4 + 1) {
+        memset(&scan, 0, sizeof(scan));
+        scan.prefix = &rows[i].key;
+        scan.num_cols = 2;
+        n = ttree_scan_prefix(&tree, &rows[i].key, 2, check_prefix_row, &scan);
+        for (j = 0; j < num_tenants * num_rows; j++) {
+            if ((rows[j].key.tenant == rows[i].key.tenant) &&
+                (rows[j].key.timestamp == rows[i].key.timestamp)) {
+                n--;
+            }
+        }
+        if (n || scan.failed) {
+            UTEST_FAILED("Prefix scan of %d:%lld is wrong",
+                         rows[i].key.tenant,
+                         (long long)rows[i].key.timestamp);
+        }
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.tenant = num_tenants;
+    UTEST_ASSERT(ttree_scan_prefix(&tree, &key, 1, NULL, NULL) == 0);
+    key.tenant = -num_tenants;
+    UTEST_ASSERT(ttree_scan_prefix(&tree, &key, 1, NULL, NULL) == 0);
+    UTEST_ASSERT(ttree_scan_prefix(&tree, &key, 4, NULL, NULL) < 0);
+    ttree_destroy(&tree);
+    free(rows);
+    UTEST_PASSED();
+}
+
+static int rank_calls;
+
+/* Compare the key with all keys without branches. */
+static int rank_ints(void *key, void *keys, int num_keys)
+{
+    int val = *(int *)key, rank = 0, i;
+
+    rank_calls++;
+    for (i = 0; i < num_keys; i++) {
+        rank += ((int *)keys)[i] < val;
+    }
+
+    return rank;
+}
+
+static int rank_int_ptrs(void *key, void *keys, int num_keys)
+{
+    int val = *(int *)key, rank = 0, i;
+
+    rank_calls++;
+    for (i = 0; i < num_keys; i++) {
+        rank += *((int **)keys)[i] < val;
+    }
+
+    return rank;
+}
+
+UTEST_FUNCTION(ut_rank_fn, args)
+{
+    Ttree tree;
+    struct item *items;
+    int num_keys, num_items, packed, ret, i, key;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    packed = utest_get_arg(args, 2, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    if (packed) {
+        UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int)) == 0);
+        UTEST_ASSERT(ttree_set_rank_fn(&tree, rank_ints) == 0);
+    }
+    else {
+        UTEST_ASSERT(ttree_set_rank_fn(&tree, rank_int_ptrs) == 0);
+    }
+
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+    rank_calls = 0;
+    for (i = 0; i < num_items; i++) {
+        items[i].key = ((i & 1) ? (num_items - i) : i) * 2 + 1;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+    for (i = 0; i < num_items; i++) {
+        CHECK_ITEM((struct item *)ttree_lookup(&tree, &items[i].key, NULL),
+                   items[i].key);
+        key = items[i].key - 1;
+        UTEST_ASSERT(ttree_lookup(&tree, &key, NULL) == NULL);
+    }
+    if ((num_keys > 2) && !rank_calls) {
+        UTEST_FAILED("Rank function was never called");
+    }
+
+    UTEST_ASSERT(ttree_set_rank_fn(&tree, NULL) < 0);
+    UTEST_ASSERT(errno == EBUSY);
+
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_heat, args)
+{
+    Ttree tree;
+    struct item *items;
+    struct ttree_heat_range *ranges;
+    struct item *first, *last;
+    int num_keys, num_items, rate, ret, i, j, hot_lo, hot_hi, num;
+    unsigned int heat, total_heat, num_lookups = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    rate = utest_get_arg(args, 2, INT);
+    UTEST_ASSERT((num_items >= num_keys) && (rate > 0));
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    items = malloc(sizeof(*items) * num_items);
+    ranges = malloc(sizeof(*ranges) * num_items);
+    UTEST_ASSERT((items != NULL) && (ranges != NULL));
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    UTEST_ASSERT(ttree_track_heat(&tree, -1) < 0);
+    UTEST_ASSERT(ttree_track_heat(&tree, rate) == 0);
+    UTEST_ASSERT(ttree_hot_ranges(&tree, ranges, num_items) == 0);
+
+    /* Keys in the middle of the tree are looked up far more often. */
+    hot_lo = (num_items - num_keys) / 2;
+    hot_hi = hot_lo + num_keys - 1;
+    for (j = 0; j < 16; j++) {
+        for (i = 0; i < num_items; i++) {
+            if (!j || ((i >= hot_lo) && (i <= hot_hi))) {
+                first = ttree_lookup(&tree, &i, NULL);
+                CHECK_ITEM(first, i);
+                num_lookups++;
+            }
+        }
+    }
+
+    num = ttree_hot_ranges(&tree, ranges, num_items);
+    UTEST_ASSERT(num > 0);
+    total_heat = 0;
+    for (i = 0; i < num; i++) {
+        first = ranges[i].first;
+        last = ranges[i].last;
+        if ((first->key > last->key) ||
+            (i && (ranges[i].heat > ranges[i - 1].heat))) {
+            UTEST_FAILED("Range %d [%d, %d] with heat %u is out of order",
+                         i, first->key, last->key, ranges[i].heat);
+        }
+
+        total_heat += ranges[i].heat;
+    }
+    if (total_heat != num_lookups / rate) {
+        UTEST_FAILED("Total heat is %u, but %u lookups were sampled",
+                     total_heat, num_lookups / rate);
+    }
+
+    first = ranges[0].first;
+    last = ranges[0].last;
+    if ((first->key > hot_hi) || (last->key < hot_lo)) {
+        UTEST_FAILED("The hottest range [%d, %d] doesn't hold hot keys "
+                     "[%d, %d]", first->key, last->key, hot_lo, hot_hi);
+    }
+
+    /* The hottest range only is requested. */
+    heat = ranges[0].heat;
+    UTEST_ASSERT(ttree_hot_ranges(&tree, ranges, 1) == 1);
+    UTEST_ASSERT((ranges[0].first == first) && (ranges[0].heat == heat));
+    ttree_decay_heat(&tree);
+    UTEST_ASSERT(ttree_hot_ranges(&tree, ranges, 1) == 1);
+    UTEST_ASSERT(ranges[0].heat == heat / 2);
+    UTEST_ASSERT(ttree_track_heat(&tree, 0) == 0);
+    UTEST_ASSERT(ttree_hot_ranges(&tree, ranges, num_items) == 0);
+
+    /* 14 bit heat stops at its maximum until hot ranges are requested. */
+    UTEST_ASSERT(ttree_track_heat(&tree, 1) == 0);
+    for (i = 0; i < (1 << 14) + 100; i++) {
+        UTEST_ASSERT(ttree_lookup(&tree, &hot_lo, NULL) != NULL);
+    }
+
+    UTEST_ASSERT(ttree_hot_ranges(&tree, ranges, 1) == 1);
+    UTEST_ASSERT(ranges[0].heat == ((1 << 14) - 1) / 2);
+    UTEST_ASSERT(ttree_hot_ranges(&tree, ranges, 1) == 1);
+    UTEST_ASSERT(ranges[0].heat == ((1 << 14) - 1) / 2);
+
+    ttree_destroy(&tree);
+    free(items);
+    free(ranges);
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_estimate_range, args)
+{
+    Ttree tree;
+    struct item *items;
+    int num_keys, num_items, counts, ret, i, lo, hi, first, last, tmp;
+    size_t est, exact, sum_err = 0;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    counts = utest_get_arg(args, 2, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_count_subtrees(&tree, counts) == 0);
+    UTEST_ASSERT(ttree_estimate_range(&tree, &num_items, &num_items) == 0);
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+
+    /* Keys are even numbers inserted in random order. */
+    for (i = 0; i < num_items; i++) {
+        items[i].key = 2 * i;
+    }
+    for (i = num_items - 1; i > 0; i--) {
+        ret = random() % (i + 1);
+        tmp = items[i].key;
+        items[i].key = items[ret].key;
+        items[ret].key = tmp;
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    for (i = 0; i < 1000; i++) {
+        lo = random() % (2 * num_items + 2) - 1;
+        hi = random() % (2 * num_items + 2) - 1;
+        first = (lo < 0) ? 0 : lo;
+        last = (hi > 2 * num_items - 2) ? (2 * num_items - 2) : hi;
+        exact = (first <= last) ? (last / 2 - (first + 1) / 2 + 1) : 0;
+
+        if (i & 1) {
+            /* Items of short ranges are counted exactly. */
+            hi = lo + random() % 16;
+            last = (hi > 2 * num_items - 2) ? (2 * num_items - 2) : hi;
+            exact = (first <= last) ? (last / 2 - (first + 1) / 2 + 1) : 0;
+        }
+
+        est = ttree_estimate_range(&tree, &lo, &hi);
+        if (((counts || (i & 1)) && (est != exact)) || (est > num_items)) {
+            UTEST_FAILED("Range [%d, %d] has %zd items, but %zd are counted",
+                         lo, hi, exact, est);
+        }
+
+        sum_err += (est > exact) ? est - exact : exact - est;
+    }
+
+    /* Estimations are scaled to the number of items in the tree. */
+    lo = -1;
+    hi = 2 * num_items;
+    est = ttree_estimate_range(&tree, &lo, &hi);
+    if (est != num_items) {
+        UTEST_FAILED("The whole tree of %d items is estimated as %zd",
+                     num_items, est);
+    }
+
+    /*
+     * Estimation error isn't bounded, but in a tree filled in random
+     * order it's small on average.
+     */
+    if (sum_err / 1000 > num_items / 20 + num_keys) {
+        UTEST_FAILED("Mean estimation error %zd is too big for %d items",
+                     sum_err / 1000, num_items);
+    }
+
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+static uint64_t xorshift(void *arg)
+{
+    uint64_t *state = arg;
+
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+UTEST_FUNCTION(ut_sample, args)
+{
+    Ttree tree;
+    struct item *items, **out;
+    int num_keys, num_items, counts, num, ret, i, j, lo, hi;
+    int *hits, *last_trial;
+    uint64_t state = 88172645463325252ULL;
+    double expected;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    counts = utest_get_arg(args, 2, INT);
+    num = utest_get_arg(args, 3, INT);
+    UTEST_ASSERT((num > 0) && (num <= num_items));
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_count_subtrees(&tree, counts) == 0);
+    items = malloc(sizeof(*items) * num_items);
+    out = malloc(sizeof(*out) * num_items);
+    hits = calloc(num_items, sizeof(*hits));
+    last_trial = calloc(num_items, sizeof(*last_trial));
+    UTEST_ASSERT(items && out && hits && last_trial);
+    UTEST_ASSERT(ttree_sample(&tree, num, xorshift, &state,
+                              (void **)out) == 0);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = (i & 1) ? (num_items - i) : i;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    /* Each item must be picked equally often. */
+    for (i = 0; i < 400 * num_items / num; i++) {
+        ret = ttree_sample(&tree, num, xorshift, &state, (void **)out);
+        UTEST_ASSERT(ret == num);
+        for (j = 0; j < num; j++) {
+            if (last_trial[out[j]->key] == i + 1) {
+                UTEST_FAILED("Item %d was picked twice", out[j]->key);
+            }
+
+            last_trial[out[j]->key] = i + 1;
+            hits[out[j]->key]++;
+        }
+    }
+
+    expected = 400;
+    for (i = 0; i < num_items; i++) {
+        if ((hits[i] < expected * 0.7) || (hits[i] > expected * 1.3)) {
+            UTEST_FAILED("Item %d was picked %d times, expected %.0f",
+                         i, hits[i], expected);
+        }
+    }
+
+    /* Items are picked from the range only. */
+    for (i = 0; i < 100; i++) {
+        lo = random() % num_items - 1;
+        hi = lo + random() % (num_items / 4 + 1);
+        ret = ttree_sample_range(&tree, &lo, &hi, num, xorshift, &state,
+                                 (void **)out);
+        j = ((hi >= num_items) ? num_items - 1 : hi) - ((lo < 0) ? 0 : lo) + 1;
+        UTEST_ASSERT(ret == ((j < num) ? j : num));
+        for (j = 0; j < ret; j++) {
+            if ((out[j]->key < lo) || (out[j]->key > hi)) {
+                UTEST_FAILED("Item %d is out of range [%d, %d]",
+                             out[j]->key, lo, hi);
+            }
+        }
+    }
+
+    UTEST_ASSERT(ttree_sample_range(&tree, &hi, &lo, num, xorshift, &state,
+                                    (void **)out) == 0);
+    ttree_destroy(&tree);
+    free(items);
+    free(out);
+    free(hits);
+    free(last_trial);
+    UTEST_PASSED();
+}
+
+struct record {
+    int64_t amount;
+    int key;
+    double score;
+};
+
+struct filter_scan {
+    int num;
+    int last_key;
+    int limit;
+};
+
+static int odd_amount(void *item, void *arg)
+{
+    return ((struct record *)item)->amount & 1;
+}
+
+static int check_filtered(void *item, void *arg)
+{
+    struct filter_scan *fs = arg;
+    struct record *rec = item;
+
+    if (rec->key <= fs->last_key) {
+        utest_error("Key %d follows key %d", rec->key, fs->last_key);
+    }
+
+    fs->last_key = rec->key;
+    return (++fs->num == fs->limit);
+}
+
+/* Count records with keys in [lo, hi] matching a predicate. */
+static int count_matching(struct record *recs, int num_items, int lo, int hi,
+                          const struct ttree_pred *pred)
+{
+    int i, num = 0;
+
+    for (i = 0; i < num_items; i++) {
+        if ((recs[i].key < lo) || (recs[i].key > hi)) {
+            continue;
+        }
+        if (pred->fn) {
+            num += !!pred->fn(&recs[i], pred->arg);
+        }
+        else if (pred->offs == offsetof(struct record, amount)) {
+            num += (recs[i].amount > pred->value.i64);
+        }
+        else if (pred->offs == offsetof(struct record, score)) {
+            num += (recs[i].score <= pred->value.d);
+        }
+        else {
+            num += (recs[i].key != pred->value.i32);
+        }
+    }
+
+    return num;
+}
+
+UTEST_FUNCTION(ut_scan_filtered, args)
+{
+    Ttree tree;
+    struct record *recs;
+    struct ttree_pred preds[4];
+    struct filter_scan fs;
+    int num_keys, num_items, packed, ret, i, lo, hi, expected;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    packed = utest_get_arg(args, 2, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct record, key);
+    UTEST_ASSERT(ret >= 0);
+    if (packed) {
+        UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int)) == 0);
+    }
+
+    recs = malloc(sizeof(*recs) * num_items);
+    UTEST_ASSERT(recs != NULL);
+    for (i = 0; i < num_items; i++) {
+        recs[i].key = i;
+        recs[i].amount = random() % 1000 - 500;
+        recs[i].score = (random() % 1000) / 10.0;
+    }
+    for (i = num_items - 1; i >= 0; i--) {
+        UTEST_ASSERT(ttree_insert(&tree, &recs[i]) == 0);
+    }
+
+    memset(preds, 0, sizeof(preds));
+    preds[0].fn = odd_amount;
+    preds[1].offs = offsetof(struct record, amount);
+    preds[1].type = TTREE_PRED_INT64;
+    preds[1].op = TTREE_PRED_GT;
+    preds[1].value.i64 = 400;
+    preds[2].offs = offsetof(struct record, score);
+    preds[2].type = TTREE_PRED_DOUBLE;
+    preds[2].op = TTREE_PRED_LE;
+    preds[2].value.d = 2.5;
+    preds[3].offs = TTREE_COLUMN_KEY;
+    preds[3].type = TTREE_PRED_INT32;
+    preds[3].op = TTREE_PRED_NE;
+    preds[3].value.i32 = num_items / 2;
+    for (i = 0; i < 40; i++) {
+        lo = random() % (num_items + 2) - 1;
+        hi = lo + random() % (num_items / 2 + 1);
+        memset(&fs, 0, sizeof(fs));
+        fs.last_key = -1;
+        expected = count_matching(recs, num_items, lo, hi, &preds[i % 4]);
+        ret = ttree_scan_filtered(&tree, &lo, &hi, &preds[i % 4],
+                                  check_filtered, &fs);
+        if ((ret != expected) || (fs.num != expected)) {
+            UTEST_FAILED("Predicate %d matched %d items in [%d, %d], "
+                         "expected %d", i % 4, ret, lo, hi, expected);
+        }
+    }
+
+    /* Non-zero return value of the function stops the scan. */
+    memset(&fs, 0, sizeof(fs));
+    fs.last_key = -1;
+    fs.limit = 3;
+    ret = ttree_scan_filtered(&tree, NULL, NULL, NULL, check_filtered, &fs);
+    UTEST_ASSERT(ret == ((num_items < 3) ? num_items : 3));
+    UTEST_ASSERT(ttree_scan_filtered(&tree, NULL, NULL, NULL, NULL, NULL) ==
+                 num_items);
+    preds[1].op = TTREE_PRED_GE + 1;
+    ret = ttree_scan_filtered(&tree, NULL, NULL, &preds[1], NULL, NULL);
+    UTEST_ASSERT(ret < 0);
+
+    ttree_destroy(&tree);
+    free(recs);
+    UTEST_PASSED();
+}
+
+struct wide_item {
+    int64_t key;
+};
+
+static int __wide_cmpfunc(void *key1, void *key2)
+{
+    int64_t k1 = *(int64_t *)key1, k2 = *(int64_t *)key2;
+
+    return (k1 > k2) - (k1 < k2);
+}
+
+UTEST_FUNCTION(ut_aggregate, args)
+{
+    Ttree tree;
+    struct item *items;
+    struct wide_item wide[4];
+    struct ttree_aggregate agg, uagg;
+    int num_keys, num_items, packed, ret, i, j, lo, hi, num;
+    int64_t sum, min, max;
+    uint64_t usum;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    packed = utest_get_arg(args, 2, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    if (packed) {
+        UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int)) == 0);
+    }
+
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = 3 * i + 1;
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    for (i = 0; i < 100; i++) {
+        lo = random() % (3 * num_items + 2) - 1;
+        hi = lo + random() % (3 * num_items / 2 + 1);
+        num = 0;
+        sum = 0;
+        min = INT64_MAX;
+        max = INT64_MIN;
+        for (j = 0; j < num_items; j++) {
+            if ((items[j].key >= lo) && (items[j].key <= hi)) {
+                num++;
+                sum += items[j].key;
+                min = (items[j].key < min) ? items[j].key : min;
+                max = (items[j].key > max) ? items[j].key : max;
+            }
+        }
+
+        UTEST_ASSERT(ttree_aggregate_range(&tree, &lo, &hi, TTREE_PRED_INT32,
+                                           &agg) == 0);
+        UTEST_ASSERT(ttree_aggregate_range(&tree, &lo, &hi,
+                                           TTREE_PRED_UINT32, &uagg) == 0);
+        if ((agg.count != num) || (agg.sum.i64 != sum) ||
+            (num && ((agg.min.i64 != min) || (agg.max.i64 != max)))) {
+            UTEST_FAILED("Range [%d, %d]: got (%zu, %lld, %lld, %lld), "
+                         "expected (%d, %lld, %lld, %lld)", lo, hi,
+                         agg.count, (long long)agg.sum.i64,
+                         (long long)agg.min.i64, (long long)agg.max.i64,
+                         num, (long long)sum, (long long)min,
+                         (long long)max);
+        }
+        if ((uagg.count != num) || (uagg.sum.u64 != (uint64_t)sum) ||
+            (num && (uagg.max.u64 != (uint64_t)max))) {
+            UTEST_FAILED("Unsigned aggregates of range [%d, %d] differ",
+                         lo, hi);
+        }
+    }
+
+    UTEST_ASSERT(ttree_aggregate_range(&tree, NULL, NULL, TTREE_PRED_INT32,
+                                       &agg) == 0);
+    UTEST_ASSERT(agg.count == num_items);
+    UTEST_ASSERT(ttree_aggregate_range(&tree, NULL, NULL,
+                                       TTREE_PRED_DOUBLE + 1, &agg) < 0);
+    lo = 1;
+    hi = 0;
+    UTEST_ASSERT(ttree_aggregate_range(&tree, &lo, &hi, TTREE_PRED_INT32,
+                                       &agg) == 0);
+    UTEST_ASSERT((agg.count == 0) && (agg.sum.i64 == 0));
+    ttree_destroy(&tree);
+    free(items);
+
+    /* The sum of the biggest int64 keys wraps around. */
+    ret = ttree_init(&tree, num_keys, true, __wide_cmpfunc,
+                     struct wide_item, key);
+    UTEST_ASSERT(ret >= 0);
+    if (packed) {
+        UTEST_ASSERT(ttree_pack_keys(&tree, sizeof(int64_t)) == 0);
+    }
+
+    usum = 0;
+    for (i = 0; i < 4; i++) {
+        wide[i].key = INT64_MAX - i;
+        usum += (uint64_t)wide[i].key;
+        UTEST_ASSERT(ttree_insert(&tree, &wide[i]) == 0);
+    }
+
+    UTEST_ASSERT(ttree_aggregate_range(&tree, NULL, NULL, TTREE_PRED_INT64,
+                                       &agg) == 0);
+    if ((agg.count != 4) || (agg.sum.u64 != usum) ||
+        (agg.min.i64 != INT64_MAX - 3) || (agg.max.i64 != INT64_MAX)) {
+        UTEST_FAILED("Aggregates of int64 keys are (%zu, %llu, %lld, %lld)",
+                     agg.count, (unsigned long long)agg.sum.u64,
+                     (long long)agg.min.i64, (long long)agg.max.i64);
+    }
+
+    ttree_destroy(&tree);
+    UTEST_PASSED();
+}
+
 DEFINE_UTESTS_LIST(tests) = {
     {
         "UT_LOOKUP",
@@ -113,6 +1152,129 @@ DEFINE_UTESTS_LIST(tests) = {
             UTEST_ARGS_LIST_END,
         },
     },
+    {
+        "UT_INLINE_ROOT",
+        "Grow and shrink a tree whose root is kept inline",
+        ut_inline_root,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_RELOCATE",
+        "Move an array of trees with registered cursors in memory",
+        ut_relocate,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "trees", UT_ARG_INT, "Number of trees in an array" },
+            { "total_items", UT_ARG_INT, "Maximum number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_PACKED_KEYS",
+        "Lookup in a tree keeping copies of keys in its nodes",
+        ut_packed_keys,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_ENCODED_KEYS",
+        "Lookup in a tree comparing keys encoded into strings of bytes",
+        ut_encoded_keys,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            {
+                "encoded_size", UT_ARG_INT,
+                "Number of bytes of encoded key(less than 4 for prefixes)",
+            },
+
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_KEY_COLUMNS",
+        "Lookup and prefix scans in a tree with composite keys",
+        ut_key_columns,
+        UTEST_ARGS_LIST {
+            { "tenants", UT_ARG_INT, "Number of different leading columns" },
+            { "rows", UT_ARG_INT, "Number of rows per leading column" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_RANK_FN",
+        "Lookup with user function searching inside nodes",
+        ut_rank_fn,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "packed", UT_ARG_INT, "Keep copies of keys in nodes(0 or 1)" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_HEAT",
+        "Find the hottest key ranges by sampled lookups",
+        ut_heat,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "rate", UT_ARG_INT, "One of how many lookups is sampled" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_ESTIMATE_RANGE",
+        "Estimate number of items in ranges of keys",
+        ut_estimate_range,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "counts", UT_ARG_INT, "Count items of subtrees(0 or 1)" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_SAMPLE",
+        "Pick random items uniformly",
+        ut_sample,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            { "counts", UT_ARG_INT, "Count items of subtrees(0 or 1)" },
+            { "num", UT_ARG_INT, "Number of items to pick" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_SCAN_FILTERED",
+        "Scan ranges with predicates evaluated by node slices",
+        ut_scan_filtered,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items in a tree" },
+            { "packed", UT_ARG_INT, "Keep copies of keys in nodes(0 or 1)" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_AGGREGATE",
+        "Count, sum, minimum and maximum of keys of ranges",
+        ut_aggregate,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items in a tree" },
+            { "packed", UT_ARG_INT, "Keep copies of keys in nodes(0 or 1)" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
     UTESTS_LIST_END,
 };
 
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+#include "ttree_pool.h"
+
+struct item {
+    int key;
+};
+
+struct worker {
+    TtreePool *pool;
+    int num_trees;
+    int num_items;
+    bool ok;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+/*
+ * Fill many small trees with different number of keys per
+ * node sharing the same pool, remove a half of items and check
+ * that the rest of them are still there.
+ */
+static bool fill_trees(TtreePool *pool, int num_trees, int num_items,
+                       unsigned int seed)
+{
+    Ttree *trees;
+    struct item *items;
+    int i, j, k;
+    bool ok = true;
+
+    trees = malloc(sizeof(*trees) * num_trees);
+    items = malloc(sizeof(*items) * num_trees * num_items);
+    if (!trees || !items) {
+        return false;
+    }
+    for (i = 0; i < num_trees; i++) {
+        ttree_init(&trees[i], 2 + (i % 31), true, __cmpfunc,
+                   struct item, key);
+        if (ttree_set_pool(&trees[i], pool) < 0) {
+            ok = false;
+        }
+        for (j = 0; j < num_items; j++) {
+            k = (j * 7 + seed) % num_items;
+            items[i * num_items + j].key = k;
+            ttree_insert(&trees[i], &items[i * num_items + j]);
+        }
+    }
+    for (i = 0; i < num_trees; i++) {
+        for (k = 0; k < num_items; k += 2) {
+            if (!ttree_delete(&trees[i], &k)) {
+                ok = false;
+            }
+        }
+        for (k = 1; k < num_items; k += 2) {
+            struct item *it = ttree_lookup(&trees[i], &k, NULL);
+
+            if (!it || (it->key != k)) {
+                ok = false;
+            }
+        }
+    }
+    for (i = 0; i < num_trees; i++) {
+        ttree_destroy(&trees[i]);
+    }
+
+    free(trees);
+    free(items);
+    return ok;
+}
+
+UTEST_FUNCTION(ut_pool_shared, args)
+{
+    TtreePool pool;
+    Ttree tree;
+    struct item item;
+    int num_trees, num_items;
+
+    num_trees = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    UTEST_ASSERT(ttree_pool_init(&pool) == 0);
+    UTEST_ASSERT(fill_trees(&pool, num_trees, num_items, 1));
+
+    /* Free chunks must be given back to the OS after caches are flushed */
+    ttree_pool_flush_cache(&pool);
+    if (pool.mem_released != pool.mem_mapped) {
+        UTEST_FAILED("%zd bytes of %zd are released",
+                     pool.mem_released, pool.mem_mapped);
+    }
+
+    /* Released chunks are reused */
+    UTEST_ASSERT(fill_trees(&pool, num_trees, num_items, 3));
+
+    /* The pool can't be changed while a tree has nodes */
+    ttree_init(&tree, 8, true, __cmpfunc, struct item, key);
+    item.key = 0;
+    UTEST_ASSERT(ttree_insert(&tree, &item) == 0);
+    UTEST_ASSERT(ttree_set_pool(&tree, &pool) < 0);
+    ttree_destroy(&tree);
+    ttree_pool_destroy(&pool);
+    UTEST_PASSED();
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+
+    w->ok = fill_trees(w->pool, w->num_trees, w->num_items,
+                       (unsigned int)(uintptr_t)w);
+    return NULL;
+}
+
+UTEST_FUNCTION(ut_pool_threads, args)
+{
+    TtreePool pool;
+    pthread_t *tids;
+    struct worker *workers;
+    int num_threads, i;
+
+    num_threads = utest_get_arg(args, 0, INT);
+    UTEST_ASSERT(num_threads > 0);
+    UTEST_ASSERT(ttree_pool_init(&pool) == 0);
+    tids = malloc(sizeof(*tids) * num_threads);
+    workers = malloc(sizeof(*workers) * num_threads);
+    UTEST_ASSERT((tids != NULL) && (workers != NULL));
+    for (i = 0; i < num_threads; i++) {
+        workers[i].pool = &pool;
+        workers[i].num_trees = utest_get_arg(args, 1, INT);
+        workers[i].num_items = utest_get_arg(args, 2, INT);
+        UTEST_ASSERT(pthread_create(&tids[i], NULL,
+                                    worker_fn, &workers[i]) == 0);
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+        UTEST_ASSERT(workers[i].ok);
+    }
+
+    /* Caches of exited threads are flushed, all chunks are free */
+    UTEST_ASSERT(pool.caches == NULL);
+    UTEST_ASSERT(pool.mem_released == pool.mem_mapped);
+    ttree_pool_destroy(&pool);
+    free(tids);
+    free(workers);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_POOL_SHARED",
+        "Allocate nodes of many trees from the same pool",
+        ut_pool_shared,
+        UTEST_ARGS_LIST {
+            { "trees", UT_ARG_INT, "Number of trees" },
+            { "items", UT_ARG_INT, "Number of items per tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_POOL_THREADS",
+        "Share the pool between threads",
+        ut_pool_threads,
+        UTEST_ARGS_LIST {
+            { "threads", UT_ARG_INT, "Number of threads" },
+            { "trees", UT_ARG_INT, "Number of trees per thread" },
+            { "items", UT_ARG_INT, "Number of items per tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+#include "ttree_sketch.h"
+
+struct item {
+    int key;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+static int __cmpdouble(const void *v1, const void *v2)
+{
+    double d1 = *(const double *)v1, d2 = *(const double *)v2;
+
+    return (d1 > d2) - (d1 < d2);
+}
+
+static double int_value(void *key)
+{
+    return *(int *)key;
+}
+
+/* Check that approximate quantile is close enough to the exact one. */
+static bool quantile_matches(double approx, double exact, double rel_err)
+{
+    return fabs(approx - exact) <= rel_err * fabs(exact) + 1e-12;
+}
+
+UTEST_FUNCTION(ut_sketch, args)
+{
+    TtreeSketch sketch, half;
+    double *values, rel_err, q, approx;
+    int num_values, i;
+
+    num_values = utest_get_arg(args, 0, INT);
+    rel_err = utest_get_arg(args, 1, INT) / 1000.0;
+    UTEST_ASSERT(ttree_sketch_init(&sketch, 0) < 0);
+    UTEST_ASSERT(ttree_sketch_init(&sketch, rel_err) == 0);
+    UTEST_ASSERT(ttree_sketch_init(&half, rel_err) == 0);
+    UTEST_ASSERT(isnan(ttree_sketch_quantile(&sketch, 0.5)));
+    values = malloc(sizeof(*values) * num_values);
+    UTEST_ASSERT(values != NULL);
+
+    /* Values of very different magnitudes and both signs. */
+    for (i = 0; i < num_values; i++) {
+        values[i] = exp((random() % 4000) / 100.0 - 20);
+        if (random() & 1) {
+            values[i] = -values[i];
+        }
+        if (!(random() % 50)) {
+            values[i] = 0;
+        }
+
+        ttree_sketch_add((i & 1) ? &half : &sketch, values[i]);
+    }
+
+    /* Merged halves are the same as a sketch of all values. */
+    UTEST_ASSERT(ttree_sketch_merge(&sketch, &half) == 0);
+    UTEST_ASSERT(sketch.total == num_values);
+    qsort(values, num_values, sizeof(*values), __cmpdouble);
+    for (q = 0; q <= 1; q += 0.01) {
+        i = (int)(q * (num_values - 1));
+        approx = ttree_sketch_quantile(&sketch, q);
+        if (!quantile_matches(approx, values[i], rel_err)) {
+            UTEST_FAILED("Quantile %.2f is %g, but %g is expected",
+                         q, approx, values[i]);
+        }
+    }
+
+    /* Removed values aren't counted anymore. */
+    for (i = 0; i < num_values / 2; i++) {
+        ttree_sketch_remove(&sketch, values[i]);
+    }
+
+    approx = ttree_sketch_quantile(&sketch, 0);
+    if (!quantile_matches(approx, values[num_values / 2], rel_err)) {
+        UTEST_FAILED("Minimum is %g, but %g is expected",
+                     approx, values[num_values / 2]);
+    }
+
+    ttree_sketch_destroy(&half);
+    UTEST_ASSERT(ttree_sketch_init(&half, rel_err / 2) == 0);
+    UTEST_ASSERT(ttree_sketch_merge(&sketch, &half) < 0);
+    ttree_sketch_clear(&sketch);
+    UTEST_ASSERT(isnan(ttree_sketch_quantile(&sketch, 0.5)));
+    ttree_sketch_destroy(&sketch);
+    ttree_sketch_destroy(&half);
+    free(values);
+    UTEST_PASSED();
+}
+
+UTEST_FUNCTION(ut_quantiles, args)
+{
+    Ttree tree;
+    TtreeSketch sketch;
+    struct item *items, *item;
+    int num_keys, num_items, ret, i, tmp, num;
+    double q, approx;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    UTEST_ASSERT(ttree_sketch_init(&sketch, 0.01) == 0);
+    UTEST_ASSERT(ttree_rank(&tree, &num_items) < 0);
+    UTEST_ASSERT(ttree_select(&tree, 0) == NULL);
+    UTEST_ASSERT(ttree_track_quantiles(&tree, &sketch, NULL) < 0);
+    UTEST_ASSERT(ttree_track_quantiles(&tree, &sketch, int_value) == 0);
+    UTEST_ASSERT(ttree_count_subtrees(&tree, true) == 0);
+    UTEST_ASSERT(isnan(ttree_quantile(&tree, 0.5)));
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+
+    /* Keys are 1..num_items inserted in random order. */
+    for (i = 0; i < num_items; i++) {
+        items[i].key = i + 1;
+    }
+    for (i = num_items - 1; i > 0; i--) {
+        ret = random() % (i + 1);
+        tmp = items[i].key;
+        items[i].key = items[ret].key;
+        items[ret].key = tmp;
+    }
+    for (i = 0; i < num_items; i++) {
+        UTEST_ASSERT(ttree_insert(&tree, &items[i]) == 0);
+    }
+
+    UTEST_ASSERT(ttree_track_quantiles(&tree, NULL, NULL) < 0);
+
+    /* Delete items with odd keys. */
+    for (i = 1; i <= num_items; i += 2) {
+        UTEST_ASSERT(ttree_delete(&tree, &i) != NULL);
+    }
+
+    num = num_items / 2;
+    UTEST_ASSERT(ttree_num_items(&tree) == num);
+    UTEST_ASSERT(sketch.total == num);
+    for (i = 0; i < num; i++) {
+        item = ttree_select(&tree, i);
+        UTEST_ASSERT(item != NULL);
+        if (item->key != 2 * (i + 1)) {
+            UTEST_FAILED("Item of rank %d has key %d, but %d is expected",
+                         i, item->key, 2 * (i + 1));
+        }
+
+        tmp = item->key;
+        UTEST_ASSERT(ttree_rank(&tree, &tmp) == i);
+        tmp--;
+        UTEST_ASSERT(ttree_rank(&tree, &tmp) == i);
+    }
+
+    UTEST_ASSERT(ttree_select(&tree, num) == NULL);
+    tmp = num_items + 1;
+    UTEST_ASSERT(ttree_rank(&tree, &tmp) == num);
+    for (q = 0; q <= 1; q += 0.05) {
+        if (!num) {
+            break;
+        }
+
+        item = ttree_select(&tree, q * (num - 1));
+        approx = ttree_quantile(&tree, q);
+        if (!quantile_matches(approx, item->key, 0.01)) {
+            UTEST_FAILED("Quantile %.2f is %g, but %d is expected",
+                         q, approx, item->key);
+        }
+    }
+
+    ttree_destroy(&tree);
+    ttree_sketch_destroy(&sketch);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_SKETCH",
+        "Approximate quantiles of values of different magnitudes",
+        ut_sketch,
+        UTEST_ARGS_LIST {
+            { "num_values", UT_ARG_INT, "Number of counted values" },
+            { "rel_err", UT_ARG_INT, "Relative error of quantiles(in 0.1%)" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    {
+        "UT_QUANTILES",
+        "Exact ranks and approximate quantiles of keys of a tree",
+        ut_quantiles,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "total_items", UT_ARG_INT, "Number of items in a tree" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "utest.h"
+#include "test_utils.h"
+#include "ttree.h"
+#include "ttree_snapshot.h"
+
+struct item {
+    int key;
+    int len;
+};
+
+static int __cmpfunc(void *key1, void *key2)
+{
+    return (*(int *)key1 - *(int *)key2);
+}
+
+/*
+ * An item is encoded as its key followed by "len" bytes
+ * filled by the lowest byte of the key.
+ */
+static ssize_t encode_item(void *item, void *buf, size_t size, void *arg)
+{
+    struct item *it = item;
+    size_t len = sizeof(it->key) + it->len;
+
+    if (arg) {
+        return TSNAP_BUF_SIZE;
+    }
+    if (len <= size) {
+        memcpy(buf, &it->key, sizeof(it->key));
+        memset((char *)buf + sizeof(it->key), it->key & 0xff, it->len);
+    }
+
+    return len;
+}
+
+/* If "arg" isn't NULL, all items get the same key. */
+static void *decode_item(const void *buf, size_t size, void *arg)
+{
+    const unsigned char *p = buf;
+    struct item *item;
+    size_t i;
+
+    item = malloc(sizeof(*item));
+    if (!item) {
+        return NULL;
+    }
+
+    memcpy(&item->key, p, sizeof(item->key));
+    item->len = size - sizeof(item->key);
+    for (i = sizeof(item->key); i < size; i++) {
+        if (p[i] != (item->key & 0xff)) {
+            free(item);
+            return NULL;
+        }
+    }
+    if (arg) {
+        item->key = 0;
+    }
+
+    return item;
+}
+
+static void free_item(void *item, void *arg)
+{
+    free(item);
+}
+
+static void free_items(Ttree *tree)
+{
+    TtreeCursor cursor;
+
+    ttree_cursor_open(&cursor, tree);
+    if (ttree_cursor_first(&cursor) == TCSR_OK) {
+        do {
+            free(ttree_item_from_cursor(&cursor));
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+    }
+
+    ttree_destroy(tree);
+}
+
+UTEST_FUNCTION(ut_snapshot, args)
+{
+    Ttree tree, loaded;
+    TtreeCursor c1, c2;
+    struct item *items, *it1, *it2;
+    int num_keys, num_items, flags, ret, i;
+    FILE *file;
+    int fd;
+
+    num_keys = utest_get_arg(args, 0, INT);
+    num_items = utest_get_arg(args, 1, INT);
+    flags = utest_get_arg(args, 2, INT);
+    ret = ttree_init(&tree, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    ret = ttree_init(&loaded, num_keys, true, __cmpfunc, struct item, key);
+    UTEST_ASSERT(ret >= 0);
+    file = tmpfile();
+    UTEST_ASSERT(file != NULL);
+    fd = fileno(file);
+
+    /* Records of different sizes fill many buffers, duplicates are lost. */
+    items = malloc(sizeof(*items) * num_items);
+    UTEST_ASSERT(items != NULL);
+    for (i = 0; i < num_items; i++) {
+        items[i].key = (int)random();
+        items[i].len = random() % 500;
+        ttree_insert(&tree, &items[i]);
+    }
+
+    num_items = ttree_num_items(&tree);
+    ret = ttree_snapshot_save(&tree, fd, flags, encode_item, NULL);
+    if (ret != num_items) {
+        UTEST_FAILED("Saved %d items of %d [ERR=%d]", ret, num_items, errno);
+    }
+
+    ret = ttree_snapshot_load(&loaded, fd, flags, decode_item, free_item,
+                              NULL);
+    if (ret != num_items) {
+        UTEST_FAILED("Loaded %d items of %d [ERR=%d]", ret, num_items, errno);
+    }
+
+    ttree_cursor_open(&c1, &tree);
+    ttree_cursor_open(&c2, &loaded);
+    ttree_cursor_first(&c1);
+    ttree_cursor_first(&c2);
+    for (i = 0; i < num_items; i++) {
+        it1 = ttree_item_from_cursor(&c1);
+        it2 = ttree_item_from_cursor(&c2);
+        if ((it1->key != it2->key) || (it1->len != it2->len)) {
+            UTEST_FAILED("Item %d is (%d, %d) but (%d, %d) was saved", i,
+                         it2->key, it2->len, it1->key, it1->len);
+        }
+
+        ttree_cursor_next(&c1);
+        ttree_cursor_next(&c2);
+    }
+
+    /* Only empty trees are loaded, items must fit into a buffer. */
+    if (num_items) {
+        ret = ttree_snapshot_load(&loaded, fd, flags, decode_item, free_item,
+                                  NULL);
+        UTEST_ASSERT((ret < 0) && (errno == EBUSY));
+        ret = ttree_snapshot_save(&tree, fd, flags, encode_item, &tree);
+        UTEST_ASSERT((ret < 0) && (errno == E2BIG));
+    }
+
+    /*
+     * Items with duplicated keys aren't inserted, the items loaded
+     * before stay in the tree.
+     */
+    free_items(&loaded);
+    if (num_items > 1) {
+        ret = ttree_snapshot_load(&loaded, fd, flags, decode_item,
+                                  free_item, &loaded);
+        UTEST_ASSERT((ret < 0) && (errno == EEXIST));
+        UTEST_ASSERT(ttree_num_items(&loaded) == 1);
+        free_items(&loaded);
+    }
+
+    /* A file without valid header isn't a snapshot. */
+    UTEST_ASSERT(pwrite(fd, "garbage", 7, 0) == 7);
+    ret = ttree_snapshot_load(&loaded, fd, flags, decode_item, free_item,
+                              NULL);
+    UTEST_ASSERT((ret < 0) && (errno == EINVAL));
+
+    fclose(file);
+    ttree_destroy(&tree);
+    free(items);
+    UTEST_PASSED();
+}
+
+DEFINE_UTESTS_LIST(tests) = {
+    {
+        "UT_SNAPSHOT",
+        "Save items of a tree to a snapshot and load them back",
+        ut_snapshot,
+        UTEST_ARGS_LIST {
+            { "keys", UT_ARG_INT, "Number of keys per T*-tree node" },
+            { "items", UT_ARG_INT, "Number of items in a tree" },
+            { "flags", UT_ARG_INT, "Snapshot flags(TSNAP_*)" },
+            UTEST_ARGS_LIST_END,
+        },
+    },
+    UTESTS_LIST_END,
+};
+
+int main(int argc, char *argv[])
+{
+    utest_main(tests, argc, argv);
+    return 0;
+}
@@ -7,6 +7,7 @@ enum balance_type {
     TREE_BALANCED,
     TREE_LEFT_HEAVY,
     TREE_RIGHT_HEAVY,
+    TREE_WRONG_BFC,
 };
 
 struct balance_info {
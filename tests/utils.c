@@ -4,16 +4,17 @@
 #include "ttree.h"
 #include "test_utils.h"
 
-static int __check_tree_balance(TtreeNode *tnode, struct balance_info *binfo)
+static int __check_tree_balance(Ttree *ttree, TtreeNode *tnode,
+                                struct balance_info *binfo)
 {
-    int r, l, diff;
+    int r, l, diff, max_diff;
 
     if (!tnode || (binfo->balance != TREE_BALANCED)) {
         return 0;
     }
 
-    l = __check_tree_balance(tnode->left, binfo);
-    r = __check_tree_balance(tnode->right, binfo);
+    l = __check_tree_balance(ttree, tnode->left, binfo);
+    r = __check_tree_balance(ttree, tnode->right, binfo);
     if (tnode->left) {
         l++;
     }
@@ -21,16 +22,25 @@ static int __check_tree_balance(TtreeNode *tnode, struct balance_info *binfo)
         r++;
     }
 
+    /*
+     * Children of half-leafs must be leafs, so only internal
+     * nodes may be overweighted by more than 1.
+     */
+    max_diff = ((l > 0) && (r > 0)) ? ttree->max_imbalance : 1;
     diff = r - l;
     if (diff && (binfo->balance == TREE_BALANCED)) {
         binfo->tnode = tnode;
-        if (diff > 1) {
+        if (diff > max_diff) {
             binfo->balance = TREE_RIGHT_HEAVY;
         }
-        else if (diff < -1) {
+        else if (diff < -max_diff) {
             binfo->balance = TREE_LEFT_HEAVY;
         }
     }
+    if ((tnode->bfc != diff) && (binfo->balance == TREE_BALANCED)) {
+        binfo->tnode = tnode;
+        binfo->balance = TREE_WRONG_BFC;
+    }
 
     return ((r > l) ? r : l);
 }
@@ -39,7 +49,7 @@ void check_tree_balance(Ttree *ttree, struct balance_info *binfo)
 {
     binfo->tnode = NULL;
     binfo->balance = TREE_BALANCED;
-    __check_tree_balance(ttree->root, binfo);
+    __check_tree_balance(ttree, ttree->root, binfo);
 }
 
 char *balance_name(enum balance_type type)
@@ -49,6 +59,8 @@ char *balance_name(enum balance_type type)
             return "Left-heavy";
         case TREE_RIGHT_HEAVY:
             return "Right-heavy";
+        case TREE_WRONG_BFC:
+            return "Wrong balance factor";
     }
 
     return "Balanced";
@@ -35,11 +35,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <errno.h>
+#include <math.h>
 #include <sys/types.h>
 
 #include "ttree.h"
+#include "ttree_pool.h"
+#include "ttree_sketch.h"
 
 #ifndef DEBUG_TTREE
 #define SET_ERRNO(err) errno = (err)
@@ -55,16 +59,49 @@
     } while (0)
 #endif /* DEBUG_TTREE */
 
-/* Index number of first key in a T*-tree node when a node has only one key. */
+/* Index number of the only key in a node with given number of key rooms. */
+#define capacity_first_idx(capacity)            \
+    (((capacity) >> 1) - 1)
+
+/* Index number of first key in a new T*-tree node. */
 #define first_tnode_idx(ttree)                  \
-    (((ttree)->keys_per_tnode >> 1) - 1)
+    capacity_first_idx((ttree)->min_keys_per_tnode)
 
 /*
  * Minimum allowed number of used rooms in a T*-tree node.
  * By default it's a quoter of total number of key rooms in a node.
  */
-#define min_tnode_entries(ttree)                                \
-    ((ttree)->keys_per_tnode - ((ttree)->keys_per_tnode >> 2))
+#define min_tnode_entries(tnode)                                \
+    ((tnode)->capacity - ((tnode)->capacity >> 2))
+
+/* The biggest capacity a T*-tree node may have at its place in a tree. */
+#define tnode_max_capacity(ttree, tnode)                                \
+    (is_internal_node(tnode) ?                                          \
+     (ttree)->internal_keys_per_tnode : (ttree)->keys_per_tnode)
+
+/* Minimum allowed number of used rooms in internal T*-tree node. */
+#define min_internal_tnode_entries(ttree)                               \
+    ((ttree)->internal_keys_per_tnode -                                 \
+     ((ttree)->internal_keys_per_tnode >> 2))
+
+/* True if T*-tree node may be grown instead of adding new node. */
+#define tnode_can_grow(ttree, tnode)                            \
+    ((tnode)->capacity < tnode_max_capacity(ttree, tnode))
+
+/* Next capacity a growing T*-tree node gets. */
+#define tnode_next_capacity(ttree, tnode)                               \
+    (((tnode)->capacity << 1) < tnode_max_capacity(ttree, tnode) ?      \
+     ((tnode)->capacity << 1) : tnode_max_capacity(ttree, tnode))
+
+/* True if internal T*-tree node holds more keys than it's allowed to. */
+#define tnode_is_overfull(ttree, tnode)                                 \
+    (is_internal_node(tnode) &&                                         \
+     (tnode_num_keys(tnode) > (ttree)->internal_keys_per_tnode))
+
+/* True if T*-tree node is sparse enough to make its capacity smaller. */
+#define tnode_can_shrink(ttree, tnode)                                  \
+    ((((tnode)->capacity >> 1) >= (ttree)->min_keys_per_tnode) &&       \
+     (tnode_num_keys(tnode) <= ((tnode)->capacity >> 2)))
 
 /*
  * T*-tree has three types of node:
@@ -79,13 +116,20 @@
 #define is_half_leaf(tnode)                                             \
     ((!(tnode)->left || !(tnode)->right) && !((tnode)->left && (tnode)->right))
 
-/* Translate node side to balance factor */
+/* Translate node side to balance factor(root has no side, so it's 0) */
 #define side2bfc(side)                          \
-    __balance_factors[side]
+    __balance_factors[(side) + 1]
 #define get_bfc_delta(node)                     \
     (side2bfc(tnode_get_side(node)))
-#define subtree_is_unbalanced(node)             \
-    (((node)->bfc < -1) || ((node)->bfc > 1))
+/*
+ * A half-leaf is merged with its child when it becomes sparse, so
+ * the child must be a leaf whatever imbalance the tree allows. Thus
+ * only internal nodes may be overweighted by more than 1. When such
+ * node loses a leaf child, it becomes a half-leaf and is rotated.
+ */
+#define subtree_is_unbalanced(ttree, node)                              \
+    ((abs((node)->bfc) > (ttree)->max_imbalance) ||                     \
+     ((abs((node)->bfc) > 1) && !is_internal_node(node)))
 #define opposite_side(side)                     \
     (!(side))
 #define left_heavy(node)                        \
@@ -93,25 +137,480 @@
 #define right_heavy(node)                       \
     ((node)->bfc > 0)
 
+/*
+ * The maximum height of T*-tree. A tree of this height balanced with
+ * the maximum allowed imbalance has more nodes than may be addressed.
+ */
+#define TTREE_MAX_HEIGHT 128
+
+/*
+ * Ranges spanning up to this number of nodes are counted exactly by
+ * ttree_estimate_range: the walk costs about as much as the estimation.
+ */
+#define TTREE_ESTIMATE_WALK_NODES 32
+
+/* Get interval's end point by its start point(i.e. by item's key) */
+#define ttree_key2end(ttree, key)                                       \
+    ((void *)((char *)ttree_key2item(ttree, key) + (ttree)->end_offs))
+
+/*
+ * True if T*-tree nodes hold some data describing their subtrees
+ * that has to be recalculated when the tree is changed.
+ */
+#define ttree_is_augmented(ttree)                               \
+    ((ttree)->is_interval_tree || (ttree)->counts_subtrees)
+
+/* True if items of cold T*-tree nodes may be written to a file. */
+#define ttree_is_tiered(ttree)                  \
+    ((ttree)->spill_fn != NULL)
+
+/*
+ * True if accesses to T*-tree nodes are tracked for LRU eviction
+ * or spilling.
+ */
+#define ttree_tracks_access(ttree)                                      \
+    (((ttree)->mem_budget && ((ttree)->evict_policy == TTREE_EVICT_LRU)) || \
+     ttree_is_tiered(ttree))
+
+/* The maximum heat of T*-tree node(heat is a 14 bit field). */
+#define TNODE_HEAT_MAX ((1 << 14) - 1)
+
+/*
+ * A key of a spilled item is replaced by item's offset in the spill
+ * file tagged by the lowest bit. Keys of items in memory are even.
+ */
+#define spilled_key(offs)                       \
+    ((void *)(((uintptr_t)(offs) << 1) | 1))
+#define key_is_spilled(key)                     \
+    ((uintptr_t)(key) & 1)
+#define spilled_key_offs(key)                   \
+    ((off_t)((uintptr_t)(key) >> 1))
+
+#define ttree_item_size(ttree, item)                            \
+    ((ttree)->item_size ? (ttree)->item_size(item) : 0)
+
+#define tnode_is_inline(ttree, tnode)           \
+    ((tnode) == &(ttree)->inline_root)
+
+#define ttree_has_packed_keys(ttree)            \
+    ((ttree)->packed_key_size != 0)
+
+/* True if T*-tree nodes keep keys encoded into binary comparable strings. */
+#define ttree_encodes_keys(ttree)                       \
+    ((ttree)->key_encode || (ttree)->key_columns)
+
+/*
+ * True if keys are searched inside T*-tree nodes by user function.
+ * Encoded prefixes of keys are not enough to find a key's position.
+ */
+#define ttree_ranks_keys(ttree)                                         \
+    ((ttree)->rank_fn &&                                                \
+     (!ttree_encodes_keys(ttree) || (ttree)->encoded_keys_exact))
+
+/* The key lookups compare with: its copy if the tree has packed keys. */
+#define tnode_search_key(ttree, tnode, idx)                             \
+    ((ttree_has_packed_keys(ttree) && !ttree_encodes_keys(ttree)) ?     \
+     tnode_packed_key(ttree, tnode, idx) : tnode_key(tnode, idx))
+
 struct tnode_lookup {
     void *key;
+    void *enc; /* Encoded key or NULL if keys aren't encoded */
     int low_bound;
     int high_bound;
 };
 
-static int __balance_factors[] = { -1, 1 };
+static int __balance_factors[] = { 0, -1, 1 };
+
+/*
+ * Encode first "num_cols" columns of composite key into a binary
+ * comparable string. Integers are stored in big-endian order with
+ * flipped sign bit, strings are padded by zeros. All bytes of
+ * a descending column are inverted.
+ */
+static size_t encode_key_columns(Ttree *ttree, void *key, int num_cols,
+                                 unsigned char *buf)
+{
+    const struct ttree_key_column *col;
+    unsigned char *start = buf;
+    uint64_t val;
+    size_t i;
+
+    for (col = ttree->key_columns; num_cols--; col++) {
+        unsigned char *src = (unsigned char *)key + col->offs;
+
+        if (col->type == TTREE_COL_STRING) {
+            for (i = 0; (i < col->size) && src[i]; i++) {
+                buf[i] = src[i];
+            }
+
+            memset(buf + i, 0, col->size - i);
+        }
+        else {
+            switch (col->size) {
+                case 1: val = *(uint8_t *)src; break;
+                case 2: val = *(uint16_t *)src; break;
+                case 4: val = *(uint32_t *)src; break;
+                default: val = *(uint64_t *)src; break;
+            }
+            if (col->type == TTREE_COL_INT) {
+                val ^= (uint64_t)1 << (col->size * 8 - 1);
+            }
+            for (i = 0; i < col->size; i++) {
+                buf[i] = val >> ((col->size - i - 1) * 8);
+            }
+        }
+        if (col->descending) {
+            for (i = 0; i < col->size; i++) {
+                buf[i] = ~buf[i];
+            }
+        }
+
+        buf += col->size;
+    }
+
+    return buf - start;
+}
+
+static __inline void ttree_encode_key(Ttree *ttree, void *key, void *buf)
+{
+    if (ttree->key_columns) {
+        encode_key_columns(ttree, key, ttree->num_key_columns, buf);
+    }
+    else {
+        ttree->key_encode(key, buf);
+    }
+}
+
+static __inline void tnode_set_key(Ttree *ttree, TtreeNode *tnode,
+                                   int idx, void *key)
+{
+    tnode->keys[idx] = key;
+    if (ttree_encodes_keys(ttree)) {
+        ttree_encode_key(ttree, key, tnode_packed_key(ttree, tnode, idx));
+    }
+    else if (ttree_has_packed_keys(ttree)) {
+        memcpy(tnode_packed_key(ttree, tnode, idx), key,
+               ttree->packed_key_size);
+    }
+}
+
+/*
+ * Compare the search key with a key of T*-tree node. Encoded keys
+ * are compared first, so cmp_func isn't called unless they are equal
+ * and don't determine the order completely.
+ */
+static __inline int tnode_cmp_key(Ttree *ttree, struct tnode_lookup *tnl,
+                                  TtreeNode *tnode, int idx)
+{
+    int ret;
+
+    if (tnl->enc) {
+        ret = memcmp(tnl->enc, tnode_packed_key(ttree, tnode, idx),
+                     ttree->packed_key_size);
+        if (ret || ttree->encoded_keys_exact) {
+            return ret;
+        }
+    }
+
+    return ttree->cmp_func(tnl->key, tnode_search_key(ttree, tnode, idx));
+}
+
+/* Read spilled items of keys [idx, idx + num) of a node back to memory. */
+static void fault_keys(Ttree *ttree, TtreeNode *tnode, int idx, int num)
+{
+    void *item;
+    int i;
+
+    for (i = idx; i < idx + num; i++) {
+        if (!key_is_spilled(tnode->keys[i])) {
+            continue;
+        }
+
+        item = ttree->fault_fn(ttree->spill_fd,
+                               spilled_key_offs(tnode->keys[i]),
+                               ttree->spill_arg);
+        TTREE_ASSERT(item != NULL);
+        tnode->keys[i] = ttree_item2key(ttree, item);
+        ttree->mem_used += ttree_item_size(ttree, item);
+    }
+}
+
+static void fault_tnode(Ttree *ttree, TtreeNode *tnode)
+{
+    fault_keys(ttree, tnode, tnode->min_idx, tnode_num_keys(tnode));
+    tnode->spilled = 0;
+    tnode->accessed = 1;
+}
+
+#define tnode_fault_in(ttree, tnode)            \
+    do {                                        \
+        if (UNLIKELY((tnode)->spilled)) {       \
+            fault_tnode(ttree, tnode);          \
+        }                                       \
+    } while (0)
+
+/*
+ * Move "num" keys starting at index "src_idx" of node "src" to node "dst"
+ * starting at index "dst_idx". Nodes may be the same. Copies of keys are
+ * moved together with pointers to them. Spilled items are read back
+ * first, so they never leave their nodes.
+ */
+static __inline void tnode_move_keys(Ttree *ttree, TtreeNode *dst,
+                                     int dst_idx, TtreeNode *src,
+                                     int src_idx, int num)
+{
+    if (UNLIKELY(src->spilled)) {
+        fault_keys(ttree, src, src_idx, num);
+    }
+    memmove(dst->keys + dst_idx, src->keys + src_idx, sizeof(void *) * num);
+    if (ttree_has_packed_keys(ttree)) {
+        memmove(tnode_packed_key(ttree, dst, dst_idx),
+                tnode_packed_key(ttree, src, src_idx),
+                ttree->packed_key_size * num);
+    }
+}
+
+static __inline void __cursor_follow_keys(TtreeCursor *cursor,
+                                          TtreeNode *src, int lo, int hi,
+                                          TtreeNode *dst, int dst_idx)
+{
+    if ((cursor->state == CURSOR_OPENED) && (cursor->tnode == src) &&
+        (cursor->idx >= lo) && (cursor->idx <= hi)) {
+        cursor->tnode = dst;
+        cursor->idx = dst_idx + (cursor->idx - lo);
+    }
+}
+
+/*
+ * Keys [lo, hi] of T*-tree node "src" were moved to the node "dst"
+ * starting from index "dst_idx". Each registered cursor pointing to one
+ * of them should follow its key. The same is true for the cursor
+ * an operation was started with (it may be NULL) even if it is not
+ * registered in the tree.
+ */
+static void cursors_follow_keys(Ttree *ttree, TtreeCursor *cursor,
+                                TtreeNode *src, int lo, int hi,
+                                TtreeNode *dst, int dst_idx)
+{
+    TtreeCursor *c;
+
+    for (c = ttree->cursors; c; c = c->next_cursor) {
+        __cursor_follow_keys(c, src, lo, hi, dst, dst_idx);
+        if (c == cursor) {
+            cursor = NULL;
+        }
+    }
+    if (cursor) {
+        __cursor_follow_keys(cursor, src, lo, hi, dst, dst_idx);
+    }
+}
+
+/*
+ * The key at index "idx" of T*-tree node "tnode" doesn't exist
+ * anymore and there is no any key following it. All cursors pointed
+ * to it become closed.
+ */
+static void cursors_close_at(Ttree *ttree, TtreeCursor *cursor,
+                             TtreeNode *tnode, int idx)
+{
+    TtreeCursor *c;
+
+    for (c = ttree->cursors; c; c = c->next_cursor) {
+        if ((c->state == CURSOR_OPENED) &&
+            (c->tnode == tnode) && (c->idx == idx)) {
+            c->state = CURSOR_CLOSED;
+        }
+        if (c == cursor) {
+            cursor = NULL;
+        }
+    }
+    if (cursor && (cursor->tnode == tnode) && (cursor->idx == idx)) {
+        cursor->state = CURSOR_CLOSED;
+    }
+}
+
+/*
+ * Pending cursors refer to positions between keys rather than
+ * to keys themselves. Such positions are not tracked, so any
+ * registered pending cursor except the given one is closed
+ * before a tree is modified.
+ */
+static void cursors_close_pending(Ttree *ttree, TtreeCursor *cursor)
+{
+    TtreeCursor *c;
+
+    for (c = ttree->cursors; c; c = c->next_cursor) {
+        if ((c != cursor) && (c->state == CURSOR_PENDING)) {
+            c->state = CURSOR_CLOSED;
+        }
+    }
+}
+
+static bool cursor_is_registered(Ttree *ttree, TtreeCursor *cursor)
+{
+    TtreeCursor *c;
+
+    for (c = ttree->cursors; c; c = c->next_cursor) {
+        if (c == cursor) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+#define tnode_subtree_items(tnode)                      \
+    ((tnode) ? (tnode)->subtree_items : 0)
+
+/*
+ * True if "end" is greater than "max_end". Intervals ending at the same
+ * point are ordered by their addresses, so the maximum end point of
+ * a subtree is always found in the same item regardless of how items
+ * are spread between nodes. Otherwise a node above rotated or changed
+ * subtree may keep a pointer to an item that isn't the maximum anymore
+ * and is then deleted.
+ */
+static __inline bool end_is_greater(Ttree *ttree, void *end, void *max_end)
+{
+    int ret;
+
+    if (!max_end) {
+        return true;
+    }
+
+    ret = ttree->cmp_func(end, max_end);
+    return (ret > 0) || (!ret && ((uintptr_t)end > (uintptr_t)max_end));
+}
+
+/*
+ * Recalculate augmented data of T*-tree node(the maximum end point of
+ * intervals stored in node's subtree or the number of its items) using
+ * node's keys and the data of its childs. Returns true if the data
+ * was changed.
+ */
+static bool tnode_augment(Ttree *ttree, TtreeNode *tnode)
+{
+    void *max_end = NULL, *end;
+    size_t num;
+    int i;
+
+    if (!tnode) {
+        return false;
+    }
+    if (ttree->counts_subtrees) {
+        num = tnode_num_keys(tnode) + tnode_subtree_items(tnode->left) +
+            tnode_subtree_items(tnode->right);
+        if (num == tnode->subtree_items) {
+            return false;
+        }
+
+        tnode->subtree_items = num;
+        return true;
+    }
+
+    tnode_for_each_index(tnode, i) {
+        end = ttree_key2end(ttree, tnode->keys[i]);
+        if (end_is_greater(ttree, end, max_end)) {
+            max_end = end;
+        }
+    }
+    for (i = TNODE_LEFT; i <= TNODE_RIGHT; i++) {
+        end = tnode->sides[i] ? tnode->sides[i]->max_end : NULL;
+        if (end && end_is_greater(ttree, end, max_end)) {
+            max_end = end;
+        }
+    }
+    if (max_end == tnode->max_end) {
+        return false;
+    }
+
+    tnode->max_end = max_end;
+    return true;
+}
+
+/*
+ * Recalculate augmented data of the node whose keys or childs were
+ * changed and of all its ancestors affected by the change.
+ * Rotations assume that augmented data is valid in the whole
+ * tree, so it has to be called before the tree is rebalanced.
+ */
+static __inline void tnode_augment_upwards(Ttree *ttree, TtreeNode *tnode)
+{
+    if (UNLIKELY(ttree_is_augmented(ttree))) {
+        while (tnode && tnode_augment(ttree, tnode)) {
+            tnode = tnode->parent;
+        }
+    }
+}
 
-static TtreeNode *allocate_ttree_node(Ttree *ttree)
+static TtreeNode *allocate_ttree_node(Ttree *ttree, int capacity)
 {
-    TtreeNode *tnode = malloc(tnode_size(ttree));
+    TtreeNode *tnode;
+
+    if (ttree->pool) {
+        tnode = ttree_pool_alloc(ttree->pool,
+                                 tnode_size_by_capacity(ttree, capacity));
+    }
+    else {
+        tnode = malloc(tnode_size_by_capacity(ttree, capacity));
+    }
 
     if (tnode) {
         memset(tnode, 0, sizeof(*tnode) - TNODE_ITEMS_MIN * sizeof(uintptr_t));
+        tnode->capacity = capacity;
+        ttree->mem_used += tnode_size_by_capacity(ttree, capacity);
+    }
+
+    return tnode;
+}
+
+/*
+ * The first node of a tree inlining its root is placed inside the tree
+ * structure if it's big enough and has no room for copies of keys.
+ */
+static TtreeNode *allocate_root_tnode(Ttree *ttree)
+{
+    TtreeNode *tnode = &ttree->inline_root;
+
+    if (!ttree->inlines_root ||
+        (ttree->min_keys_per_tnode > TTREE_INLINE_NUMKEYS) ||
+        ttree_has_packed_keys(ttree)) {
+        return allocate_ttree_node(ttree, ttree->min_keys_per_tnode);
     }
 
+    memset(tnode, 0, sizeof(*tnode) - TNODE_ITEMS_MIN * sizeof(uintptr_t));
+    tnode->capacity = ttree->min_keys_per_tnode;
     return tnode;
 }
 
+static void free_ttree_node(Ttree *ttree, TtreeNode *tnode)
+{
+    /*
+     * Only leafs are removed from the tree, their successors stay, so
+     * LRU eviction goes on from the following node. Restarting from
+     * the leftmost node would find it unaccessed after the previous
+     * round and evict it even if it's the hottest one.
+     */
+    if (ttree->evict_hand == tnode) {
+        ttree->evict_hand = tnode->successor;
+    }
+    if (ttree->spill_hand == tnode) {
+        ttree->spill_hand = NULL;
+    }
+    if (tnode_is_inline(ttree, tnode)) {
+        return;
+    }
+
+    ttree->mem_used -= tnode_size_by_capacity(ttree, tnode->capacity);
+    if (ttree->pool) {
+        ttree_pool_free(ttree->pool, tnode,
+                        tnode_size_by_capacity(ttree, tnode->capacity));
+    }
+    else {
+        free(tnode);
+    }
+}
+
 /*
  * T*-tree node contains keys in a sorted order. Thus binary search
  * is used for internal lookup.
@@ -123,10 +622,29 @@ static void *lookup_inside_tnode(Ttree *ttree, TtreeNode *tnode,
 
     floor = tnl->low_bound;
     ceil = tnl->high_bound;
-    TTREE_ASSERT((floor >= 0) && (ceil < ttree->keys_per_tnode));
+    TTREE_ASSERT((floor >= 0) && (ceil < tnode->capacity));
+    if (ttree_ranks_keys(ttree)) {
+        /*
+         * The user function finds the position of the key among all
+         * keys of the window, so only one comparison is left to check
+         * whether the key at the position is equal to the search key.
+         */
+        mid = floor + ttree->rank_fn(tnl->enc ? tnl->enc : tnl->key,
+                                     ttree_has_packed_keys(ttree) ?
+                                     tnode_packed_key(ttree, tnode, floor) :
+                                     (void *)(tnode->keys + floor),
+                                     ceil - floor + 1);
+        if ((mid <= ceil) && !tnode_cmp_key(ttree, tnl, tnode, mid)) {
+            *out_idx = mid;
+            return ttree_key2item(ttree, tnode->keys[mid]);
+        }
+
+        *out_idx = mid;
+        return NULL;
+    }
     while (floor <= ceil) {
         mid = (floor + ceil) >> 1;
-        if ((cmp_res = ttree->cmp_func(tnl->key, tnode->keys[mid])) < 0)
+        if ((cmp_res = tnode_cmp_key(ttree, tnl, tnode, mid)) < 0)
             ceil = mid - 1;
         else if (cmp_res > 0)
             floor = mid + 1;
@@ -144,44 +662,53 @@ static void *lookup_inside_tnode(Ttree *ttree, TtreeNode *tnode,
     return NULL;
 }
 
-static __inline void increase_tnode_window(Ttree *ttree,
-                                           TtreeNode *tnode, int *idx)
+static __inline void increase_tnode_window(Ttree *ttree, TtreeNode *tnode,
+                                           int *idx, TtreeCursor *cursor)
 {
-    register int i;
-
     /*
      * If the right side of an array has more free rooms than the left one,
      * the window will grow to the right. Otherwise it'll grow to the left.
      */
-    if ((ttree->keys_per_tnode - 1 - tnode->max_idx) > tnode->min_idx) {
-        for (i = ++tnode->max_idx; i > *idx - 1; i--)
-            tnode->keys[i] = tnode->keys[i - 1];
+    if ((tnode->capacity - 1 - tnode->max_idx) > tnode->min_idx) {
+        cursors_follow_keys(ttree, cursor, tnode, *idx, tnode->max_idx,
+                            tnode, *idx + 1);
+        tnode_move_keys(ttree, tnode, *idx + 1, tnode, *idx,
+                        tnode->max_idx - *idx + 1);
+        tnode->max_idx++;
     }
     else {
+        cursors_follow_keys(ttree, cursor, tnode, tnode->min_idx, *idx - 1,
+                            tnode, tnode->min_idx - 1);
+        tnode_move_keys(ttree, tnode, tnode->min_idx - 1, tnode,
+                        tnode->min_idx, *idx - tnode->min_idx);
+        tnode->min_idx--;
         *idx -= 1;
-        for (i = --tnode->min_idx; i < *idx; i++) {
-            tnode->keys[i] = tnode->keys[i + 1];
-        }
     }
 }
 
-static __inline void decrease_tnode_window(Ttree *ttree,
-                                         TtreeNode *tnode, int *idx)
+/*
+ * Remove a key at index "idx" from T*-tree node. Cursors pointed
+ * to the removed key are moved to the key following it. If the removed
+ * key was the maximum one, they'll be out of node's window.
+ */
+static __inline void decrease_tnode_window(Ttree *ttree, TtreeNode *tnode,
+                                           int idx, TtreeCursor *cursor)
 {
-    register int i;
-
     /* Shrink the window to the longer side by given index. */
-    if ((ttree->keys_per_tnode - 1 - tnode->max_idx) <= tnode->min_idx) {
+    if ((tnode->capacity - 1 - tnode->max_idx) <= tnode->min_idx) {
+        cursors_follow_keys(ttree, cursor, tnode, idx + 1, tnode->max_idx,
+                            tnode, idx);
+        tnode_move_keys(ttree, tnode, idx, tnode, idx + 1,
+                        tnode->max_idx - idx);
         tnode->max_idx--;
-        for (i = *idx; i <= tnode->max_idx; i++)
-            tnode->keys[i] = tnode->keys[i + 1];
     }
     else {
+        cursors_follow_keys(ttree, cursor, tnode, idx, idx, tnode, idx + 1);
+        cursors_follow_keys(ttree, cursor, tnode, tnode->min_idx, idx - 1,
+                            tnode, tnode->min_idx + 1);
+        tnode_move_keys(ttree, tnode, tnode->min_idx + 1, tnode,
+                        tnode->min_idx, idx - tnode->min_idx);
         tnode->min_idx++;
-        for (i = *idx; i >= tnode->min_idx; i--)
-            tnode->keys[i] = tnode->keys[i - 1];
-
-        *idx = *idx + 1;
     }
 }
 
@@ -236,35 +763,37 @@ static void __rotate_single(TtreeNode **target, int side)
  *       /  \          /  \
  *     x3   x2        x1  x3
  */
-static void rotate_single(TtreeNode **target, int side)
+static int rotate_single(TtreeNode **target, int side)
 {
     TtreeNode *n;
+    int sign = (side == TNODE_RIGHT) ? 1 : -1;
+    int pbfc = sign * (*target)->bfc;
+    int sbfc = sign * (*target)->sides[side]->bfc;
+    int inner, outer, old_height, new_height;
 
     __rotate_single(target, side);
     n = (*target)->sides[opposite_side(side)];
 
     /*
      * Recalculate balance factors of nodes after rotation.
-     * Let X was a root node of rotated subtree and Y was its
-     * child. After single rotation Y is new root of subtree and X is its child.
-     * Y node may become either balanced or overweighted to the
-     * same side it was but 1 level less.
-     * X node scales at 1 level down and possibly it has new child, so
-     * its balance should be recalculated too. If it still internal node and
-     * its new parent was not overwaighted to the opposite to X side,
-     * X is overweighted to the opposite to its new parent side,
-     * otherwise it's balanced. If X is either half-leaf or leaf,
-     * balance racalculation is obvious.
+     * Let X was a root node of rotated subtree and Y was its child.
+     * Balance factors are taken as if it was a left rotation(they are
+     * mirrored for the right one) and heights of subtrees are counted
+     * from the height of X's subtree that stays with X(x1). Y's inner
+     * subtree(x3) becomes X's child instead of Y, and X becomes Y's
+     * child. Unlike the AVL specific rules, it works for any balance
+     * factors of X and Y.
      */
-    if (is_internal_node(n)) {
-        n->bfc = (n->parent->bfc != side2bfc(side)) ? side2bfc(side) : 0;
-    }
-    else {
-        n->bfc = !!(n->right) - !!(n->left);
-    }
-
-    (*target)->bfc += side2bfc(opposite_side(side));
-    TTREE_ASSERT((abs(n->bfc < 2) && (abs((*target)->bfc) < 2)));
+    outer = pbfc - 1 + ((sbfc < 0) ? sbfc : 0);
+    inner = outer - sbfc;
+    n->bfc = sign * inner;
+    (*target)->bfc = sign * (outer - 1 - ((inner > 0) ? inner : 0));
+
+    /* Return the change of the height of the subtree. */
+    old_height = ((pbfc > 0) ? pbfc : 0) + 1;
+    new_height = ((inner > 0) ? inner : 0) + 1;
+    new_height = ((new_height > outer) ? new_height : outer) + 1;
+    return new_height - old_height;
 }
 
 /*
@@ -287,54 +816,52 @@ static void rotate_single(TtreeNode **target, int side)
  *     /  \
  *    x3  x4
  */
-static void rotate_double(TtreeNode **target, int side)
+static int rotate_double(TtreeNode **target, int side)
 {
-    int opside = opposite_side(side);
     TtreeNode *n = (*target)->sides[side];
-
-    __rotate_single(&n, opside);
+    int delta;
 
     /*
-     * Balance recalculation is very similar to recalculation after
-     * simple single rotation.
+     * The first rotation may change the height of the child,
+     * so balance of the root is fixed before the second one.
      */
-    if (is_internal_node(n->sides[side])) {
-        n->sides[side]->bfc = (n->bfc == side2bfc(opside)) ? side2bfc(side) : 0;
-    }
-    else {
-        n->sides[side]->bfc =
-            !!(n->sides[side]->right) - !!(n->sides[side]->left);
-    }
+    delta = rotate_single(&n, opposite_side(side));
+    (*target)->bfc += side2bfc(side) * delta;
+    return delta + rotate_single(target, side);
+}
 
-    TTREE_ASSERT(abs(n->sides[side]->bfc) < 2);
-    n = n->parent;
-    __rotate_single(target, side);
-    if (is_internal_node(n)) {
-        n->bfc = ((*target)->bfc == side2bfc(side)) ? side2bfc(opside) : 0;
-    }
-    else {
-        n->bfc = !!(n->right) - !!(n->left);
-    }
+/*
+ * Get the change of the height of a node when the height of its child
+ * at side "side" is changed by "delta". "bfc" is node's balance factor
+ * before the change.
+ */
+static __inline int tnode_height_delta(int bfc, int side, int delta)
+{
+    /* How much the child at the other side is higher than this one */
+    int lower = -side2bfc(side) * bfc;
 
-    /*
-     * new root node of subtree is always ideally balanced
-     * after double rotation.
-     */
-    TTREE_ASSERT(abs(n->bfc) < 2);
-    (*target)->bfc = 0;
+    return ((delta > lower) ? delta : lower) - ((lower > 0) ? lower : 0);
 }
 
-static void rebalance(Ttree *ttree, TtreeNode **node, TtreeCursor *cursor)
+/*
+ * Rotate unbalanced subtree. Returns the change of its height.
+ */
+static int rebalance(Ttree *ttree, TtreeNode **node, TtreeCursor *cursor)
 {
-    int lh = left_heavy(*node);
-    int sum = abs((*node)->bfc + (*node)->sides[opposite_side(lh)]->bfc);
+    int side = left_heavy(*node) ? TNODE_LEFT : TNODE_RIGHT;
+    int delta, d, i;
 
-    if (sum >= 2) {
-        rotate_single(node, opposite_side(lh));
+    /*
+     * If the heavy child is balanced or overweighted to the same side,
+     * a single rotation is enough.
+     */
+    ttree->num_rotations++;
+    if ((*node)->sides[side]->bfc * (*node)->bfc >= 0) {
+        delta = rotate_single(node, side);
         goto out;
     }
 
-    rotate_double(node, opposite_side(lh));
+    delta = rotate_double(node, side);
 
     /*
      * T-tree rotation rules difference from AVL rules in only one aspect.
@@ -343,15 +870,24 @@ static void rebalance(Ttree *ttree, TtreeNode **node, TtreeCursor *cursor)
      * If the new root node contains only one item, N - 1 items should
      * be moved into it from one of its childs.
      * (N is a number of items in selected child node).
+     * The new root was a leaf only if its childs have no inner childs,
+     * otherwise the moved items would be out of order.
      */
     if ((tnode_num_keys(*node) == 1) &&
+        !(*node)->left->right && !(*node)->right->left &&
         is_half_leaf((*node)->left) && is_half_leaf((*node)->right)) {
         TtreeNode *n;
-        int offs, nkeys;
+        int offs, nkeys, lo, cap = (*node)->capacity;
+        int max_keys = (cap < ttree->internal_keys_per_tnode) ?
+            cap : ttree->internal_keys_per_tnode;
 
         /*
          * If right child contains more items than left, they will be moved
          * from the right child. Otherwise from the left one.
+         * If nodes have different capacities, the new root may
+         * be unable to hold all of them, so only a part is moved.
+         * The new root is an internal node, so it mustn't get more
+         * keys than internal nodes are allowed to have.
          */
         if (tnode_num_keys((*node)->right) >= tnode_num_keys((*node)->left)) {
             /*
@@ -359,24 +895,16 @@ static void rebalance(Ttree *ttree, TtreeNode **node, TtreeCursor *cursor)
              * and inserted after parent's first item.
              */
             n = (*node)->right;
-            nkeys = tnode_num_keys(n);
-            (*node)->keys[0] = (*node)->keys[(*node)->min_idx];
+            nkeys = (tnode_num_keys(n) < max_keys) ?
+                tnode_num_keys(n) : max_keys;
+            cursors_follow_keys(ttree, cursor, *node, (*node)->min_idx,
+                                (*node)->min_idx, *node, 0);
+            tnode_move_keys(ttree, *node, 0, *node, (*node)->min_idx, 1);
             offs = 1;
             (*node)->min_idx = 0;
             (*node)->max_idx = nkeys - 1;
-            if (!cursor) {
-                goto no_cursor;
-            }
-            else if (cursor->tnode == n) {
-                if (cursor->idx < n->max_idx) {
-                    cursor->tnode = *node;
-                    cursor->idx = (*node)->min_idx +
-                        (cursor->idx - n->min_idx + 1);
-                }
-                else {
-                    cursor->idx = first_tnode_idx(ttree);
-                }
-            }
+            lo = n->min_idx;
+            n->min_idx += nkeys - 1;
         }
         else {
             /*
@@ -385,38 +913,68 @@ static void rebalance(Ttree *ttree, TtreeNode **node, TtreeCursor *cursor)
              * will be copied and inserted before parent's single item.
              */
             n = (*node)->left;
-            nkeys = tnode_num_keys(n);
-            (*node)->keys[ttree->keys_per_tnode - 1] =
-                (*node)->keys[(*node)->min_idx];
-            (*node)->min_idx = offs = ttree->keys_per_tnode - nkeys;
-            (*node)->max_idx = ttree->keys_per_tnode - 1;
-            if (!cursor) {
-                goto no_cursor;
-            }
-            else if (cursor->tnode == n) {
-                if (cursor->idx > n->min_idx) {
-                    cursor->tnode = *node;
-                    cursor->idx = (*node)->min_idx + (cursor->idx - n->min_idx);
-                }
-                else {
-                    cursor->idx = first_tnode_idx(ttree);
-                }
-            }
-
-            n->max_idx = n->min_idx++;
+            nkeys = (tnode_num_keys(n) < max_keys) ?
+                tnode_num_keys(n) : max_keys;
+            cursors_follow_keys(ttree, cursor, *node, (*node)->min_idx,
+                                (*node)->min_idx, *node, cap - 1);
+            tnode_move_keys(ttree, *node, cap - 1, *node,
+                            (*node)->min_idx, 1);
+            (*node)->min_idx = offs = cap - nkeys;
+            (*node)->max_idx = cap - 1;
+            lo = n->max_idx - nkeys + 2;
+            n->max_idx -= nkeys - 1;
         }
 
-no_cursor:
-        memcpy((*node)->keys + offs,
-               n->keys + n->min_idx, sizeof(void *) * (nkeys - 1));
-        n->keys[first_tnode_idx(ttree)] = n->keys[n->max_idx];
-        n->min_idx = n->max_idx = first_tnode_idx(ttree);
+        cursors_follow_keys(ttree, cursor, n, lo, lo + nkeys - 2,
+                            *node, offs);
+        tnode_move_keys(ttree, *node, offs, n, lo, nkeys - 1);
+        (*node)->accessed |= n->accessed;
+        if (tnode_num_keys(n) == 1) {
+            int first = capacity_first_idx(n->capacity);
+
+            cursors_follow_keys(ttree, cursor, n, n->min_idx, n->min_idx,
+                                n, first);
+            tnode_move_keys(ttree, n, first, n, n->min_idx, 1);
+            n->min_idx = n->max_idx = first;
+        }
     }
 
 out:
+    /*
+     * If the tree allows imbalance bigger than 1, a node moved down
+     * may become a half-leaf while it's overweighted by more than 1.
+     * Such nodes are rebalanced too, it makes them lower, so the new
+     * root may have to be rebalanced again.
+     */
+    for (i = TNODE_LEFT; i <= TNODE_RIGHT; i++) {
+        TtreeNode *n = (*node)->sides[i];
+
+        if (n && subtree_is_unbalanced(ttree, n)) {
+            d = rebalance(ttree, &n, cursor);
+            delta += tnode_height_delta((*node)->bfc, i, d);
+            (*node)->bfc += side2bfc(i) * d;
+        }
+    }
+
+    /*
+     * Rotations and keys moving don't change the set of items in
+     * the subtree, so only nodes of the subtree should be fixed.
+     * The data of the subtree root depends only on that set
+     * (see end_is_greater), so ancestors keep valid data.
+     */
+    if (ttree_is_augmented(ttree)) {
+        tnode_augment(ttree, (*node)->left);
+        tnode_augment(ttree, (*node)->right);
+        tnode_augment(ttree, *node);
+    }
     if (ttree->root->parent) {
         ttree->root = *node;
     }
+    if (subtree_is_unbalanced(ttree, *node)) {
+        delta += rebalance(ttree, node, cursor);
+    }
+
+    return delta;
 }
 
 static __inline void __add_successor(TtreeNode *n)
@@ -487,79 +1045,60 @@ static __inline void __remove_successor(TtreeNode *n)
     }
 }
 
-static void fixup_after_insertion(Ttree *ttree, TtreeNode *n,
-                                  TtreeCursor *cursor)
+/*
+ * Fix balance of ancestors of node "n" after the height of its
+ * subtree was changed by "delta".
+ */
+static void fixup_heights(Ttree *ttree, TtreeNode *n, int delta,
+                          TtreeCursor *cursor)
 {
-    int bfc_delta = get_bfc_delta(n);
-    TtreeNode *node = n;
-
-    __add_successor(n);
-    /* check tree for balance after new node was added. */
-    while ((node = node->parent)) {
-        node->bfc += bfc_delta;
-        /*
-         * if node becomes balanced, tree balance is ok,
-         * so process may be stopped here
-         */
-        if (!node->bfc) {
-            return;
-        }
-        if (subtree_is_unbalanced(node)) {
+    TtreeNode *node;
+    int side, d;
+
+    while (delta && (node = n->parent)) {
+        side = tnode_get_side(n);
+        d = tnode_height_delta(node->bfc, side, delta);
+        node->bfc += side2bfc(side) * delta;
+        if (subtree_is_unbalanced(ttree, node)) {
             /*
              * Because of nature of T-tree rebalancing, just inserted item
              * may change its position in its node and even the node itself.
              * Thus if T-tree cursor was specified we have to take care of it.
              */
-            rebalance(ttree, &node, cursor);
-
-            /*
-             * single or double rotation tree becomes balanced
-             * and we can stop here.
-             */
-            return;
+            d += rebalance(ttree, &node, cursor);
         }
 
-        bfc_delta = get_bfc_delta(node);
+        /*
+         * If node's height is not changed, tree balance is ok,
+         * so process may be stopped here.
+         */
+        delta = d;
+        n = node;
     }
 }
 
+static void fixup_after_insertion(Ttree *ttree, TtreeNode *n,
+                                  TtreeCursor *cursor)
+{
+    __add_successor(n);
+
+    /*
+     * After insertion single or double rotation restores the height
+     * of the subtree, so at most one rotation is done.
+     */
+    fixup_heights(ttree, n, 1, cursor);
+}
+
 static void fixup_after_deletion(Ttree *ttree, TtreeNode *n,
                                  TtreeCursor *cursor)
 {
-    TtreeNode *node = n->parent;
-    int bfc_delta = get_bfc_delta(n);
-
     __remove_successor(n);
 
     /*
      * Unlike balance fixing after insertion,
      * deletion may require several rotations.
      */
-    while (node) {
-        node->bfc -= bfc_delta;
-        /*
-         * If node's balance factor was 0 and becomes 1 or -1, we can stop.
-         */
-        if (!(node->bfc + bfc_delta))
-            break;
-
-        bfc_delta = get_bfc_delta(node);
-        if (subtree_is_unbalanced(node)) {
-            TtreeNode *tmp = node;
-
-            rebalance(ttree, &tmp, cursor);
-            /*
-             * If after rotation subtree height is not changed,
-             * proccess should be continued.
-             */
-            if (tmp->bfc)
-                break;
-
-            node = tmp;
-        }
-
-        node = node->parent;
-    }
+    fixup_heights(ttree, n, -1, cursor);
 }
 
 int __ttree_init(Ttree *ttree, int num_keys, bool is_unique,
@@ -567,6 +1106,8 @@ int __ttree_init(Ttree *ttree, int num_keys, bool is_unique,
 {
     TTREE_CT_ASSERT((TTREE_DEFAULT_NUMKEYS >= TNODE_ITEMS_MIN) &&
                     (TTREE_DEFAULT_NUMKEYS <= TNODE_ITEMS_MAX));
+    TTREE_CT_ASSERT((TTREE_DEFAULT_IMBALANCE >= 1) &&
+                    (TTREE_DEFAULT_IMBALANCE <= TTREE_MAX_IMBALANCE));
 
     if ((num_keys < TNODE_ITEMS_MIN) ||
         (num_keys > TNODE_ITEMS_MAX) || !ttree || !cmpf) {
@@ -576,28 +1117,122 @@ int __ttree_init(Ttree *ttree, int num_keys, bool is_unique,
 
     ttree->root = NULL;
     ttree->keys_per_tnode = num_keys;
+    ttree->min_keys_per_tnode = num_keys;
+    ttree->internal_keys_per_tnode = num_keys;
+    ttree->max_imbalance = TTREE_DEFAULT_IMBALANCE;
+    ttree->num_rotations = 0;
     ttree->cmp_func = cmpf;
     ttree->key_offs = key_offs;
     ttree->keys_are_unique = is_unique;
+    ttree->cursors = NULL;
+    ttree->end_offs = 0;
+    ttree->is_interval_tree = false;
+    ttree->counts_subtrees = false;
+    ttree->inlines_root = false;
+    ttree->mem_used = 0;
+    ttree->mem_budget = 0;
+    ttree->num_items = 0;
+    ttree->max_items = 0;
+    ttree->evict_side = TNODE_LEFT;
+    ttree->evict_policy = TTREE_EVICT_LEFT_EDGE;
+    ttree->item_size = NULL;
+    ttree->evict_fn = NULL;
+    ttree->evict_arg = NULL;
+    ttree->evict_hand = NULL;
+    ttree->pool = NULL;
+    ttree->packed_key_size = 0;
+    ttree->key_encode = NULL;
+    ttree->encoded_keys_exact = false;
+    ttree->key_columns = NULL;
+    ttree->num_key_columns = 0;
+    ttree->rank_fn = NULL;
+    ttree->spill_fd = -1;
+    ttree->spill_end = 0;
+    ttree->spill_fn = NULL;
+    ttree->fault_fn = NULL;
+    ttree->spill_arg = NULL;
+    ttree->spill_hand = NULL;
+    ttree->heat_sample_rate = 0;
+    ttree->heat_tick = 0;
+    ttree->heat_saturated = false;
+    ttree->sketch = NULL;
+    ttree->key_value = NULL;
+
+    return 0;
+}
 
+int __ttree_init_intervals(Ttree *ttree, int num_keys, bool is_unique,
+                           ttree_cmp_func_fn cmpf, size_t key_offs,
+                           size_t end_offs)
+{
+    if (__ttree_init(ttree, num_keys, is_unique, cmpf, key_offs) < 0) {
+        return -1;
+    }
+
+    ttree->end_offs = end_offs;
+    ttree->is_interval_tree = true;
     return 0;
 }
 
 void ttree_destroy(Ttree *ttree)
 {
     TtreeNode *tnode, *next;
+    TtreeCursor *c;
 
+    for (c = ttree->cursors; c; c = c->next_cursor) {
+        c->state = CURSOR_CLOSED;
+    }
+
+    ttree->cursors = NULL;
     if (!ttree->root)
         return;
     for (tnode = next = ttree_node_leftmost(ttree->root); tnode; tnode = next) {
         next = tnode->successor;
-        free(tnode);
+        free_ttree_node(ttree, tnode);
     }
 
     ttree->root = NULL;
+    ttree->mem_used = 0;
+    ttree->num_items = 0;
+    ttree->evict_hand = NULL;
 }
 
-void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
+/* Get a pointer to a node at the new place of a relocated tree. */
+static __inline TtreeNode *relocated_tnode(Ttree *ttree, const Ttree *old,
+                                           TtreeNode *tnode)
+{
+    return (tnode == &old->inline_root) ? &ttree->inline_root : tnode;
+}
+
+void ttree_relocate(Ttree *ttree, const Ttree *old)
+{
+    TtreeCursor *c;
+    int i;
+
+    ttree->root = relocated_tnode(ttree, old, ttree->root);
+    ttree->evict_hand = relocated_tnode(ttree, old, ttree->evict_hand);
+    ttree->spill_hand = relocated_tnode(ttree, old, ttree->spill_hand);
+    if (ttree->root == &ttree->inline_root) {
+        for (i = TNODE_LEFT; i <= TNODE_RIGHT; i++) {
+            if (ttree->root->sides[i]) {
+                ttree->root->sides[i]->parent = ttree->root;
+            }
+        }
+    }
+    for (c = ttree->cursors; c; c = c->next_cursor) {
+        c->ttree = ttree;
+        c->tnode = relocated_tnode(ttree, old, c->tnode);
+    }
+}
+
+/*
+ * Find the position of the search key: the node and the index of
+ * the key or the place it would be inserted to. The position is put
+ * to "pos" as if it was a cursor opened by the lookup, but it is
+ * neither registered nor has spilled items read back.
+ */
+static void *ttree_search(Ttree *ttree, struct tnode_lookup *tnl,
+                          TtreeCursor *pos)
 {
     TtreeNode *n, *marked_tn, *target;
     int side = TNODE_BOUND, cmp_res, idx;
@@ -627,7 +1262,7 @@ void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
     }
     while (n) {
         target = n;
-        cmp_res = ttree->cmp_func(key, tnode_key_min(n));
+        cmp_res = tnode_cmp_key(ttree, tnl, n, n->min_idx);
         if (cmp_res < 0)
             side = TNODE_LEFT;
         else if (cmp_res > 0) {
@@ -645,7 +1280,7 @@ void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
         n = n->sides[side];
     }
     if (marked_tn) {
-        int c = ttree->cmp_func(key, tnode_key_max(marked_tn));
+        int c = tnode_cmp_key(ttree, tnl, marked_tn, marked_tn->max_idx);
 
         if (c <= 0) {
             side = TNODE_BOUND;
@@ -656,12 +1291,9 @@ void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
                 st = CURSOR_OPENED;
             }
             else { /* make internal binary search */
-                struct tnode_lookup tnl;
-
-                tnl.key = key;
-                tnl.low_bound = target->min_idx + 1;
-                tnl.high_bound = target->max_idx - 1;
-                item = lookup_inside_tnode(ttree, target, &tnl, &idx);
+                tnl->low_bound = target->min_idx + 1;
+                tnl->high_bound = target->max_idx - 1;
+                item = lookup_inside_tnode(ttree, target, tnl, &idx);
                 st = (item != NULL) ? CURSOR_OPENED : CURSOR_PENDING;
             }
 
@@ -683,16 +1315,95 @@ void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
     }
 
 out:
+    pos->ttree = ttree;
+    pos->tnode = target;
+    pos->side = side;
+    pos->idx = idx;
+    pos->state = st;
+    return item;
+}
+
+static void *__ttree_lookup(Ttree *ttree, struct tnode_lookup *tnl,
+                            TtreeCursor *cursor)
+{
+    TtreeCursor pos;
+    TtreeNode *target;
+    void *item;
+
+    item = ttree_search(ttree, tnl, &pos);
+    target = pos.tnode;
+    if (item && target->spilled) {
+        fault_tnode(ttree, target);
+        item = ttree_key2item(ttree, target->keys[pos.idx]);
+    }
+    if (item && ttree_tracks_access(ttree)) {
+        target->accessed = 1;
+    }
+    if (UNLIKELY(ttree->heat_sample_rate) && target &&
+        (++ttree->heat_tick >= ttree->heat_sample_rate)) {
+        ttree->heat_tick = 0;
+    ttree->heat_saturated = false;
+
+        /*
+         * Halving heat of all nodes takes a walk over the tree,
+         * so it's left to ttree_hot_ranges.
+         */
+        if (target->heat == TNODE_HEAT_MAX) {
+            ttree->heat_saturated = true;
+        }
+        else {
+            target->heat++;
+        }
+    }
     if (cursor) {
         ttree_cursor_open_on_node(cursor, ttree, target, TNODE_SEEK_START);
-        cursor->side = side;
-        cursor->idx = idx;
-        cursor->state = st;
+        cursor->side = pos.side;
+        cursor->idx = pos.idx;
+        cursor->state = pos.state;
     }
 
     return item;
 }
 
+/* Compare two keys the way lookups compare them. */
+static int ttree_cmp_keys(Ttree *ttree, void *key1, void *key2)
+{
+    char enc1[TTREE_ENCODED_KEY_MAX], enc2[TTREE_ENCODED_KEY_MAX];
+    int ret;
+
+    if (ttree_encodes_keys(ttree)) {
+        ttree_encode_key(ttree, key1, enc1);
+        ttree_encode_key(ttree, key2, enc2);
+        ret = memcmp(enc1, enc2, ttree->packed_key_size);
+        if (ret || ttree->encoded_keys_exact) {
+            return ret;
+        }
+    }
+
+    return ttree->cmp_func(key1, key2);
+}
+
+/* Prepare the search key. "enc" is a buffer for the encoded key. */
+static __inline void init_tnode_lookup(Ttree *ttree, struct tnode_lookup *tnl,
+                                       void *key, char *enc)
+{
+    tnl->key = key;
+    tnl->enc = NULL;
+    if (ttree_encodes_keys(ttree)) {
+        ttree_encode_key(ttree, key, enc);
+        tnl->enc = enc;
+    }
+}
+
+void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
+{
+    struct tnode_lookup tnl;
+    char enc[TTREE_ENCODED_KEY_MAX];
+
+    init_tnode_lookup(ttree, &tnl, key, enc);
+    return __ttree_lookup(ttree, &tnl, cursor);
+}
+
 int ttree_insert(Ttree *ttree, void *item)
 {
     TtreeCursor cursor;
@@ -703,6 +1414,7 @@ int ttree_insert(Ttree *ttree, void *item)
      */
     if (ttree_lookup(ttree, ttree_item2key(ttree, item), &cursor)
         && ttree->keys_are_unique) {
+        SET_ERRNO(EEXIST);
         return -1;
     }
 
@@ -710,89 +1422,391 @@ int ttree_insert(Ttree *ttree, void *item)
     return 0;
 }
 
-void ttree_insert_at_cursor(TtreeCursor *cursor, void *item)
+/*
+ * Create new leaf node containing the only key "key" at index "idx"
+ * and attach it to "parent" node from the side "side".
+ */
+static TtreeNode *attach_new_tnode(Ttree *ttree, TtreeNode *parent,
+                                   int side, int idx, void *key)
+{
+    TtreeNode *n = allocate_ttree_node(ttree, ttree->min_keys_per_tnode);
+
+    tnode_set_key(ttree, n, idx, key);
+    n->min_idx = n->max_idx = idx;
+    n->parent = parent;
+    parent->sides[side] = n;
+    tnode_set_side(n, side);
+    return n;
+}
+
+/* Get the smallest capacity of a node that can hold "nkeys" keys. */
+static int capacity_for_keys(Ttree *ttree, int nkeys)
+{
+    int capacity = ttree->min_keys_per_tnode;
+
+    while (capacity < nkeys) {
+        capacity <<= 1;
+    }
+
+    return (capacity < ttree->keys_per_tnode) ?
+        capacity : ttree->keys_per_tnode;
+}
+
+/* Find a node whose successor is the given one. */
+static TtreeNode *tnode_predecessor(TtreeNode *tnode)
+{
+    TtreeNode *n;
+
+    if (tnode->left) {
+        return ttree_node_glb(tnode);
+    }
+    for (n = tnode; n->parent && (tnode_get_side(n) == TNODE_LEFT);
+         n = n->parent);
+
+    return n->parent;
+}
+
+/*
+ * Move T*-tree node to new memory having "capacity" key rooms. All links
+ * to the node from its parent, childs, predecessor and cursors are fixed.
+ * Keys are placed in the middle of new node's array. Besides cursors
+ * pointing to the node's keys, the cursor (it may be NULL) pointing to
+ * a position in the node is fixed too.
+ */
+static TtreeNode *resize_tnode(Ttree *ttree, TtreeNode *tnode,
+                               int capacity, TtreeCursor *cursor)
+{
+    TtreeNode *n, *pred;
+    int nkeys = tnode_num_keys(tnode), offs;
+
+    TTREE_ASSERT(nkeys <= capacity);
+    n = allocate_ttree_node(ttree, capacity);
+    memcpy(n, tnode, sizeof(*n) - TNODE_ITEMS_MIN * sizeof(uintptr_t));
+    n->capacity = capacity;
+    offs = (capacity - nkeys) >> 1;
+    tnode_move_keys(ttree, n, offs, tnode, tnode->min_idx, nkeys);
+    n->min_idx = offs;
+    n->max_idx = offs + nkeys - 1;
+    cursors_follow_keys(ttree, cursor, tnode, tnode->min_idx,
+                        tnode->max_idx, n, offs);
+    if (cursor && (cursor->tnode == tnode)) {
+        if ((cursor->state == CURSOR_PENDING) &&
+            (cursor->side == TNODE_BOUND)) {
+            cursor->idx += offs - tnode->min_idx;
+        }
+
+        cursor->tnode = n;
+    }
+
+    pred = tnode_predecessor(tnode);
+    if (pred) {
+        pred->successor = n;
+    }
+    if (tnode->parent) {
+        tnode->parent->sides[tnode_get_side(tnode)] = n;
+    }
+    else {
+        ttree->root = n;
+    }
+    if (tnode->left) {
+        tnode->left->parent = n;
+    }
+    if (tnode->right) {
+        tnode->right->parent = n;
+    }
+    if (ttree->evict_hand == tnode) {
+        ttree->evict_hand = n;
+    }
+    if (ttree->spill_hand == tnode) {
+        ttree->spill_hand = n;
+    }
+
+    free_ttree_node(ttree, tnode);
+    return n;
+}
+
+/*
+ * Remove the max key of a full T*-tree node and put it into node's
+ * successor. If the successor has no free rooms, the key is put into
+ * a new node that is returned. The caller has to fix the tree balance
+ * after the new node is attached.
+ */
+static TtreeNode *move_max_key_down(Ttree *ttree, TtreeNode *n,
+                                    TtreeCursor *cursor)
+{
+    void *tmp;
+    int idx = first_tnode_idx(ttree);
+    TtreeNode *succ = n->successor, *at_node = NULL;
+
+    tnode_fault_in(ttree, n);
+    tmp = n->keys[n->max_idx];
+    if (!n->successor || !n->right) {
+        /*
+         * If current node hasn't successor and right child
+         * New node have to be created. It'll become the right child
+         * of the current node.
+         */
+        at_node = attach_new_tnode(ttree, n, TNODE_RIGHT, idx, tmp);
+    }
+    else if (tnode_is_full(ttree, n->successor)) {
+        /*
+         * If successor hasn't any free rooms, new value is inserted
+         * into newly created node that becomes left child of
+         * the current node's successor.
+         */
+        at_node = attach_new_tnode(ttree, n->successor,
+                                   TNODE_LEFT, idx, tmp);
+    }
+    else {
+        /*
+         * If we're here, then successor has free rooms and key
+         * will be inserted to one of them.
+         */
+        idx = succ->min_idx;
+        increase_tnode_window(ttree, succ, &idx, cursor);
+        tnode_move_keys(ttree, succ, idx, n, n->max_idx, 1);
+        cursors_follow_keys(ttree, cursor, n, n->max_idx, n->max_idx,
+                            succ, idx);
+        tnode_augment_upwards(ttree, succ);
+    }
+    if (at_node) {
+        cursors_follow_keys(ttree, cursor, n, n->max_idx, n->max_idx,
+                            at_node, idx);
+    }
+
+    n->max_idx--;
+    return at_node;
+}
+
+/*
+ * Internal node became bigger than internal nodes of the tree are
+ * allowed to be, while it was a leaf, is made smaller. Its biggest
+ * keys are moved down until it stops being internal or the rest of
+ * its keys fits an internal node.
+ */
+static void compact_internal_tnode(Ttree *ttree, TtreeNode *n,
+                                   TtreeCursor *cursor)
+{
+    TtreeNode *at_node;
+
+    while (tnode_is_overfull(ttree, n)) {
+        at_node = move_max_key_down(ttree, n, cursor);
+        tnode_augment_upwards(ttree, n);
+        if (at_node) {
+            tnode_augment_upwards(ttree, at_node);
+            fixup_after_insertion(ttree, at_node, cursor);
+        }
+    }
+    if (is_internal_node(n) && (n->capacity > ttree->internal_keys_per_tnode)) {
+        resize_tnode(ttree, n, ttree->internal_keys_per_tnode, cursor);
+    }
+}
+
+static void __ttree_insert_at_cursor(TtreeCursor *cursor, void *item)
 {
     Ttree *ttree = cursor->ttree;
     TtreeNode *at_node, *n;
-    TtreeCursor tmp_cursor;
     void *key;
 
     TTREE_ASSERT(cursor->ttree != NULL);
     //TTREE_ASSERT(cursor->state == CURSOR_PENDING);
     key = ttree_item2key(ttree, item);
-    n = at_node = cursor->tnode;
+    cursors_close_pending(ttree, cursor);
+
+    /*
+     * If the tree allows duplicates, the cursor may point to an item
+     * with the same key. Anyway it's just a position where new key
+     * is inserted to, so it must not follow keys moved by insertion.
+     */
+    cursor->state = CURSOR_PENDING;
     if (!ttree->root) { /* The root node has to be created. */
-        at_node = allocate_ttree_node(ttree);
-        at_node->keys[first_tnode_idx(ttree)] = key;
+        at_node = allocate_root_tnode(ttree);
+        tnode_set_key(ttree, at_node, first_tnode_idx(ttree), key);
         at_node->min_idx = at_node->max_idx = first_tnode_idx(ttree);
         ttree->root = at_node;
         tnode_set_side(at_node, TNODE_ROOT);
+        if (UNLIKELY(ttree_is_augmented(ttree))) {
+            tnode_augment(ttree, at_node);
+        }
+
         ttree_cursor_open_on_node(cursor, ttree, at_node, TNODE_SEEK_START);
         return;
     }
+    if ((cursor->side == TNODE_BOUND) &&
+        tnode_is_full(ttree, cursor->tnode) &&
+        tnode_can_grow(ttree, cursor->tnode)) {
+        /* Full node is grown instead of adding new one. */
+        resize_tnode(ttree, cursor->tnode,
+                     tnode_next_capacity(ttree, cursor->tnode), cursor);
+    }
+    else if (tnode_is_inline(ttree, ttree->root) &&
+             ((cursor->side != TNODE_BOUND) ||
+              tnode_is_full(ttree, ttree->root))) {
+        /* The tree is growing, so its root is moved to the heap. */
+        resize_tnode(ttree, ttree->root, ttree->root->capacity, cursor);
+    }
+
+    n = at_node = cursor->tnode;
     if (cursor->side == TNODE_BOUND) {
         if (tnode_is_full(ttree, n)) {
             /*
              * If node is full its max item should be removed and
-             * new key should be inserted into it. Removed key becomes
-             * new insert value that should be put in successor node.
+             * new key should be inserted into it. Removed key is
+             * put in successor node first.
              */
-            void *tmp = n->keys[n->max_idx--];
+            at_node = move_max_key_down(ttree, n, cursor);
+            increase_tnode_window(ttree, n, &cursor->idx, cursor);
+            tnode_set_key(ttree, n, cursor->idx, key);
+            cursor->state = CURSOR_OPENED;
+            tnode_augment_upwards(ttree, n);
+            if (at_node) {
+                tnode_augment_upwards(ttree, at_node);
+                fixup_after_insertion(ttree, at_node, cursor);
+            }
+        }
+        else {
+            increase_tnode_window(ttree, n, &cursor->idx, cursor);
+            tnode_set_key(ttree, n, cursor->idx, key);
+            cursor->state = CURSOR_OPENED;
+            tnode_augment_upwards(ttree, n);
+        }
 
-            increase_tnode_window(ttree, n, &cursor->idx);
-            n->keys[cursor->idx] = key;
-            key = tmp;
+        compact_internal_tnode(ttree, n, cursor);
+        return;
+    }
 
-            ttree_cursor_copy(&tmp_cursor, cursor);
-            cursor = &tmp_cursor;
+    n = attach_new_tnode(ttree, at_node, cursor->side, cursor->idx, key);
+    cursor->tnode = n;
+    cursor->side = TNODE_BOUND;
+    cursor->state = CURSOR_OPENED;
+    tnode_augment_upwards(ttree, n);
+    fixup_after_insertion(ttree, n, cursor);
+}
 
-            /*
-             * If current node hasn't successor and right child
-             * New node have to be created. It'll become the right child
-             * of the current node.
-             */
-            if (!n->successor || !n->right) {
-                cursor->side = TNODE_RIGHT;
-                cursor->idx = first_tnode_idx(ttree);
-                goto create_new_node;
-            }
+/*
+ * Choose a T*-tree node an item will be evicted from. LRU policy
+ * walks through the nodes in sorted order starting from the node
+ * checked last time, clearing access marks, until a node that wasn't
+ * accessed since previous check is found. If all nodes were accessed,
+ * the walk comes back to the first node, which is cold now, but it was
+ * accessed as recently as the others. In this case the node the new
+ * item was inserted to (if any) is chosen, so the working set isn't
+ * pushed out by new items.
+ */
+static TtreeNode *evict_victim_tnode(Ttree *ttree, TtreeCursor *cursor)
+{
+    TtreeNode *tnode, *first;
 
-            at_node = n->successor;
-            /*
-             * If successor hasn't any free rooms, new value is inserted
-             * into newly created node that becomes left child of the current
-             * node's successor.
-             */
-            if (tnode_is_full(ttree, at_node)) {
-                cursor->side = TNODE_LEFT;
-                cursor->idx = first_tnode_idx(ttree);
-                goto create_new_node;
-            }
+    if (ttree->evict_policy == TTREE_EVICT_LEFT_EDGE) {
+        return ttree_node_leftmost(ttree->root);
+    }
 
-            /*
-             * If we're here, then successor has free rooms and key
-             * will be inserted to one of them.
-             */
-            cursor->idx = at_node->min_idx;
-            cursor->tnode = at_node;
+    tnode = first = ttree->evict_hand ?
+        ttree->evict_hand : ttree_node_leftmost(ttree->root);
+    while (tnode->accessed) {
+        tnode->accessed = 0;
+        tnode = tnode->successor ?
+            tnode->successor : ttree_node_leftmost(ttree->root);
+        if ((tnode == first) && cursor &&
+            (cursor->state == CURSOR_OPENED)) {
+            tnode = cursor->tnode;
+            break;
         }
+    }
 
-        increase_tnode_window(ttree, at_node, &cursor->idx);
-        at_node->keys[cursor->idx] = key;
-        cursor->state = CURSOR_OPENED;
+    ttree->evict_hand = tnode;
+    return tnode;
+}
+
+#define ttree_over_capacity(ttree)                                       \
+    ((ttree)->max_items && ((ttree)->num_items > (ttree)->max_items))
+
+#define ttree_over_budget(ttree)                                         \
+    (((ttree)->mem_budget && ((ttree)->mem_used > (ttree)->mem_budget)) || \
+     ttree_over_capacity(ttree))
+
+/*
+ * Remove items from the tree until it fits its memory budget and
+ * capacity. The cursor (it may be NULL) is kept pointing to the same
+ * item while other items are evicted.
+ */
+static void enforce_budget(Ttree *ttree, TtreeCursor *cursor)
+{
+    TtreeCursor victim;
+    bool tmp_registered = false;
+    void *item;
+
+    if (!ttree_over_budget(ttree)) {
         return;
     }
+    if (cursor && !cursor_is_registered(ttree, cursor)) {
+        ttree_cursor_register(cursor);
+        tmp_registered = true;
+    }
 
-create_new_node:
-    n = allocate_ttree_node(ttree);
-    n->keys[cursor->idx] = key;
-    n->min_idx = n->max_idx = cursor->idx;
-    n->parent = at_node;
-    at_node->sides[cursor->side] = n;
-    tnode_set_side(n, cursor->side);
-    cursor->tnode = n;
-    cursor->state = CURSOR_OPENED;
-    fixup_after_insertion(ttree, n, cursor);
+    memset(&victim, 0, sizeof(victim));
+    while (ttree->root && ttree_over_budget(ttree)) {
+        if (ttree_over_capacity(ttree)) {
+            ttree_cursor_open_on_node(&victim, ttree,
+                                      __tnode_sidemost(ttree->root,
+                                                       ttree->evict_side),
+                                      (ttree->evict_side == TNODE_LEFT) ?
+                                      TNODE_SEEK_START : TNODE_SEEK_END);
+        }
+        else {
+            ttree_cursor_open_on_node(&victim, ttree,
+                                      evict_victim_tnode(ttree, cursor),
+                                      TNODE_SEEK_START);
+        }
+
+        item = ttree_delete_at_cursor(&victim);
+        if (ttree->evict_fn) {
+            ttree->evict_fn(item, ttree->evict_arg);
+        }
+    }
+    if (tmp_registered) {
+        ttree_cursor_unregister(cursor);
+    }
+}
+
+void ttree_insert_at_cursor(TtreeCursor *cursor, void *item)
+{
+    Ttree *ttree = cursor->ttree;
+
+    __ttree_insert_at_cursor(cursor, item);
+    ttree->mem_used += ttree_item_size(ttree, item);
+    ttree->num_items++;
+    if (ttree->sketch) {
+        ttree_sketch_add(ttree->sketch,
+                         ttree->key_value(ttree_item2key(ttree, item)));
+    }
+    if (ttree_tracks_access(ttree)) {
+        cursor->tnode->accessed = 1;
+    }
+
+    enforce_budget(ttree, cursor);
+}
+
+/*
+ * Halve the capacity of a node became sparse after deletion, so
+ * the memory used by a tree follows the density of its keys.
+ * An internal node is shrunk to the size of internal nodes
+ * as soon as its keys fit it.
+ */
+static __inline void shrink_tnode(Ttree *ttree, TtreeNode *tnode,
+                                  TtreeCursor *cursor)
+{
+    if (tnode_is_inline(ttree, tnode)) {
+        return;
+    }
+    if (is_internal_node(tnode) &&
+        (tnode->capacity > ttree->internal_keys_per_tnode) &&
+        (tnode_num_keys(tnode) <= ttree->internal_keys_per_tnode)) {
+        resize_tnode(ttree, tnode, ttree->internal_keys_per_tnode, cursor);
+    }
+    else if (tnode_can_shrink(ttree, tnode)) {
+        resize_tnode(ttree, tnode, tnode->capacity >> 1, cursor);
+    }
 }
 
 void *ttree_delete(Ttree *ttree, void *key)
@@ -812,25 +1826,56 @@ void *ttree_delete(Ttree *ttree, void *key)
 void *ttree_delete_at_cursor(TtreeCursor *cursor)
 {
     Ttree *ttree = cursor->ttree;
-    TtreeNode *tnode, *n;
+    TtreeNode *tnode, *n, *orig;
     void *ret;
 
     TTREE_ASSERT(cursor->ttree != NULL);
     TTREE_ASSERT(cursor->state == CURSOR_OPENED);
-    tnode = cursor->tnode;
+    cursors_close_pending(ttree, cursor);
+    orig = tnode = cursor->tnode;
     ret = ttree_key2item(ttree, tnode->keys[cursor->idx]);
-    decrease_tnode_window(ttree, tnode, &cursor->idx);
-    cursor->state = CURSOR_CLOSED;
-    if (UNLIKELY(cursor->idx > tnode->max_idx)) {
-        cursor->idx = tnode->max_idx;
+    ttree->mem_used -= ttree_item_size(ttree, ret);
+    ttree->num_items--;
+    if (ttree->sketch) {
+        ttree_sketch_remove(ttree->sketch,
+                            ttree->key_value(ttree_item2key(ttree, ret)));
+    }
+
+    /*
+     * Whatever side the window is shrunk from, after the key is removed
+     * the cursor refers to the key following the removed one. If
+     * the removed key was the maximum one, the cursor moves to the
+     * minimum key of node's successor. If there is no successor, the
+     * removed item was the last one in the tree and the cursor is closed.
+     */
+    decrease_tnode_window(ttree, tnode, cursor->idx, cursor);
+    if (tnode->successor) {
+        cursors_follow_keys(ttree, cursor, tnode, tnode->max_idx + 1,
+                            tnode->max_idx + 1, tnode->successor,
+                            tnode->successor->min_idx);
+        if (cursor->tnode == tnode->successor) {
+            tnode_fault_in(ttree, tnode->successor);
+        }
+    }
+    else {
+        cursors_close_at(ttree, cursor, tnode, tnode->max_idx + 1);
     }
 
     /*
      * If after a key was removed, T*-tree node contains more than
      * minimum allowed number of items, the proccess is completed.
      */
-    if (tnode_num_keys(tnode) > min_tnode_entries(ttree)) {
-        return ret;
+    if (tnode_num_keys(tnode) > min_tnode_entries(tnode)) {
+        goto out;
+    }
+    if (is_internal_node(tnode) &&
+        (tnode->capacity > ttree->internal_keys_per_tnode) &&
+        (tnode_num_keys(tnode) > min_internal_tnode_entries(ttree))) {
+        /*
+         * Internal node that is bigger than internal nodes should be
+         * doesn't take keys from its successor, it's shrunk instead.
+         */
+        goto out;
     }
     if (is_internal_node(tnode)) {
         int idx;
@@ -841,20 +1886,21 @@ void *ttree_delete_at_cursor(TtreeCursor *cursor)
          */
         n = tnode->successor;
         idx = tnode->max_idx + 1;
-        increase_tnode_window(ttree, tnode, &idx);
-        tnode->keys[idx] = n->keys[n->min_idx++];
-        if (UNLIKELY(cursor->idx > tnode->max_idx)) {
-            cursor->idx = tnode->max_idx;
-        }
-        if (!tnode_is_empty(n) && is_leaf_node(n)) {
-            return ret;
+        increase_tnode_window(ttree, tnode, &idx, cursor);
+        cursors_follow_keys(ttree, cursor, n, n->min_idx, n->min_idx,
+                            tnode, idx);
+        tnode_move_keys(ttree, tnode, idx, n, n->min_idx, 1);
+        n->min_idx++;
+        tnode->accessed |= n->accessed;
+        tnode = n;
+        if (!tnode_is_empty(tnode) && is_leaf_node(tnode)) {
+            goto out;
         }
 
         /*
          * If we're here, then successor is either a half-leaf
          * or an empty leaf.
          */
-        tnode = n;
     }
     if (!is_leaf_node(tnode)) {
         int items, diff;
@@ -867,7 +1913,20 @@ void *ttree_delete_at_cursor(TtreeCursor *cursor)
          * the proccess is completed.
          */
         if (items > (ttree->keys_per_tnode - tnode_num_keys(tnode))) {
-            return ret;
+            goto out;
+        }
+        if (items > (tnode->capacity - tnode_num_keys(tnode))) {
+            /* Half-leaf has to grow to hold all keys of the leaf. */
+            n = resize_tnode(ttree, tnode,
+                             capacity_for_keys(ttree, items +
+                                               tnode_num_keys(tnode)),
+                             cursor);
+            if (orig == tnode) {
+                orig = n;
+            }
+
+            tnode = n;
+            n = tnode->left ? tnode->left : tnode->right;
         }
 
         if (tnode_get_side(n) == TNODE_RIGHT) {
@@ -875,86 +1934,1613 @@ void *ttree_delete_at_cursor(TtreeCursor *cursor)
              * Merge current node with its right leaf. Items from the leaf
              * are placed after the maximum item in a node.
              */
-            diff = (ttree->keys_per_tnode - tnode->max_idx - items) - 1;
+            diff = (tnode->capacity - tnode->max_idx - items) - 1;
             if (diff < 0) {
-                memcpy(tnode->keys + tnode->min_idx + diff,
-                       tnode->keys + tnode->min_idx, sizeof(void *) *
-                       tnode_num_keys(tnode));
+                cursors_follow_keys(ttree, cursor, tnode, tnode->min_idx,
+                                    tnode->max_idx, tnode,
+                                    tnode->min_idx + diff);
+                tnode_move_keys(ttree, tnode, tnode->min_idx + diff, tnode,
+                                tnode->min_idx, tnode_num_keys(tnode));
                 tnode->min_idx += diff;
                 tnode->max_idx += diff;
-                if (cursor->tnode == tnode) {
-                    cursor->idx += diff;
-                }
             }
-            memcpy(tnode->keys + tnode->max_idx + 1, n->keys + n->min_idx,
-                   sizeof(void *) * items);
+
+            cursors_follow_keys(ttree, cursor, n, n->min_idx, n->max_idx,
+                                tnode, tnode->max_idx + 1);
+            tnode_move_keys(ttree, tnode, tnode->max_idx + 1, n, n->min_idx,
+                            items);
             tnode->max_idx += items;
         }
         else {
             /*
              * Merge current node with its left leaf. Items the leaf
              * are placed before the minimum item in a node.
+             * If all items of the node under LRU eviction hand were
+             * evicted, the items of the leaf were already passed by
+             * the hand, so it moves to the following node.
              */
+            if ((ttree->evict_hand == tnode) && tnode_is_empty(tnode)) {
+                ttree->evict_hand = tnode->successor;
+            }
+
             diff = tnode->min_idx - items;
             if (diff < 0) {
-                register int i;
-
-                for (i = tnode->max_idx; i >= tnode->min_idx; i--) {
-                    tnode->keys[i - diff] = tnode->keys[i];
-                }
+                cursors_follow_keys(ttree, cursor, tnode, tnode->min_idx,
+                                    tnode->max_idx, tnode,
+                                    tnode->min_idx - diff);
+                tnode_move_keys(ttree, tnode, tnode->min_idx - diff, tnode,
+                                tnode->min_idx, tnode_num_keys(tnode));
 
                 tnode->min_idx -= diff;
                 tnode->max_idx -= diff;
-                if (cursor->tnode == tnode) {
-                    cursor->idx -= diff;
-                }
             }
 
-            memcpy(tnode->keys + tnode->min_idx - items, n->keys + n->min_idx,
-                   sizeof(void *) * items);
+            cursors_follow_keys(ttree, cursor, n, n->min_idx, n->max_idx,
+                                tnode, tnode->min_idx - items);
+            tnode_move_keys(ttree, tnode, tnode->min_idx - items, n,
+                            n->min_idx, items);
             tnode->min_idx -= items;
         }
 
+        tnode->accessed |= n->accessed;
+        tnode->heat = (tnode->heat + n->heat > TNODE_HEAT_MAX) ?
+            TNODE_HEAT_MAX : tnode->heat + n->heat;
         n->min_idx = 1;
         n->max_idx = 0;
         tnode = n;
     }
     if (!tnode_is_empty(tnode)) {
-        return ret;
+        goto out;
     }
 
-    /* if we're here, then current node will be removed from the tree. */
+    /*
+     * If we're here, then current node will be removed from the tree.
+     * An empty node can't hold the cursor, so it doesn't have to be
+     * fixed here, but the rotations made during rebalancing may move
+     * keys between nodes.
+     */
     n = tnode->parent;
     if (!n) {
         ttree->root = NULL;
-        free(tnode);
+        free_ttree_node(ttree, tnode);
         return ret;
     }
 
-    n->sides[tnode_get_side(tnode)] = NULL;
-    fixup_after_deletion(ttree, tnode, NULL);
-    free(tnode);
-    return ret;
+    n->sides[tnode_get_side(tnode)] = NULL;
+    tnode_augment_upwards(ttree, n);
+    if (orig != tnode) {
+        tnode_augment_upwards(ttree, orig);
+    }
+
+    fixup_after_deletion(ttree, tnode, cursor);
+    free_ttree_node(ttree, tnode);
+    if (orig != tnode) {
+        shrink_tnode(ttree, orig, cursor);
+    }
+
+    return ret;
+
+out:
+    tnode_augment_upwards(ttree, tnode);
+    if (orig != tnode) {
+        tnode_augment_upwards(ttree, orig);
+        shrink_tnode(ttree, orig, cursor);
+    }
+
+    shrink_tnode(ttree, tnode, cursor);
+    return ret;
+}
+
+int ttree_replace(Ttree *ttree, void *key, void *new_item)
+{
+    TtreeCursor cursor;
+    void *old_item;
+
+    old_item = ttree_lookup(ttree, key, &cursor);
+    if (!old_item)
+        return -1;
+
+    tnode_set_key(ttree, cursor.tnode, cursor.idx,
+                  ttree_item2key(ttree, new_item));
+    tnode_augment_upwards(ttree, cursor.tnode);
+    ttree->mem_used -= ttree_item_size(ttree, old_item);
+    ttree->mem_used += ttree_item_size(ttree, new_item);
+    enforce_budget(ttree, NULL);
+    return 0;
+}
+
+int ttree_set_budget(Ttree *ttree, size_t budget,
+                     enum ttree_evict_policy policy, ttree_item_size_fn sizef,
+                     ttree_evict_fn evictf, void *arg)
+{
+    TtreeNode *tnode;
+    int i;
+
+    if ((policy != TTREE_EVICT_LEFT_EDGE) && (policy != TTREE_EVICT_LRU)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    ttree->mem_budget = budget;
+    ttree->evict_policy = policy;
+    ttree->item_size = sizef;
+    ttree->evict_fn = evictf;
+    ttree->evict_arg = arg;
+    ttree->evict_hand = NULL;
+
+    /*
+     * Sizes of items that are already in the tree are
+     * unknown until item size function is specified.
+     */
+    ttree->mem_used = 0;
+    for (tnode = ttree_node_leftmost(ttree->root); tnode;
+         tnode = tnode->successor) {
+        if (!tnode_is_inline(ttree, tnode)) {
+            ttree->mem_used += tnode_size_by_capacity(ttree, tnode->capacity);
+        }
+
+        tnode->accessed = 0;
+        if (sizef) {
+            tnode_for_each_index(tnode, i) {
+                if (key_is_spilled(tnode->keys[i])) {
+                    continue;
+                }
+
+                ttree->mem_used +=
+                    sizef(ttree_key2item(ttree, tnode->keys[i]));
+            }
+        }
+    }
+
+    enforce_budget(ttree, NULL);
+    return 0;
+}
+
+int ttree_set_capacity(Ttree *ttree, size_t max_items, int side,
+                       ttree_evict_fn evictf, void *arg)
+{
+    if ((side != TNODE_LEFT) && (side != TNODE_RIGHT)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    ttree->max_items = max_items;
+    ttree->evict_side = side;
+    ttree->evict_fn = evictf;
+    ttree->evict_arg = arg;
+    enforce_budget(ttree, NULL);
+    return 0;
+}
+
+int ttree_insert_bounded(Ttree *ttree, void *item, void **dropped)
+{
+    TtreeCursor victim;
+    TtreeNode *edge;
+    void *key = ttree_item2key(ttree, item);
+    int side = ttree->evict_side, cmp, ret;
+
+    *dropped = NULL;
+    if (!ttree->max_items || (ttree->num_items < ttree->max_items)) {
+        return ttree_insert(ttree, item);
+    }
+
+    /*
+     * The tree is full, so the item must be better than the one
+     * at the edge to stay. Otherwise it's rejected right away.
+     */
+    edge = __tnode_sidemost(ttree->root, side);
+    tnode_fault_in(ttree, edge);
+    cmp = ttree_cmp_keys(ttree, key,
+                         edge->keys[(side == TNODE_LEFT) ?
+                                    edge->min_idx : edge->max_idx]);
+    if (!cmp && ttree->keys_are_unique) {
+        SET_ERRNO(EEXIST);
+        return -1;
+    }
+    if ((side == TNODE_LEFT) ? (cmp <= 0) : (cmp >= 0)) {
+        *dropped = item;
+        return 0;
+    }
+
+    /*
+     * A duplicate is found before the edge item is removed, so
+     * the edge item and cursors on it aren't touched then.
+     */
+    if (ttree->keys_are_unique && ttree_lookup(ttree, key, NULL)) {
+        SET_ERRNO(EEXIST);
+        return -1;
+    }
+
+    /*
+     * Removing the edge item usually just shrinks the window of
+     * the edge node, so the insertion takes one more lookup only.
+     */
+    ttree_cursor_open_on_node(&victim, ttree, edge,
+                              (side == TNODE_LEFT) ?
+                              TNODE_SEEK_START : TNODE_SEEK_END);
+    *dropped = ttree_delete_at_cursor(&victim);
+    ret = ttree_insert(ttree, item);
+    TTREE_ASSERT(ret == 0);
+    return ret;
+}
+
+int ttree_set_node_growth(Ttree *ttree, int min_keys)
+{
+    if ((min_keys < TNODE_ITEMS_MIN) ||
+        (min_keys > ttree->internal_keys_per_tnode)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->min_keys_per_tnode = min_keys;
+    return 0;
+}
+
+int ttree_set_internal_node_size(Ttree *ttree, int num_keys)
+{
+    if ((num_keys < ttree->min_keys_per_tnode) ||
+        (num_keys > ttree->keys_per_tnode)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->internal_keys_per_tnode = num_keys;
+    return 0;
+}
+
+int ttree_set_balance(Ttree *ttree, int max_imbalance)
+{
+    if ((max_imbalance < 1) || (max_imbalance > TTREE_MAX_IMBALANCE)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->max_imbalance = max_imbalance;
+    return 0;
+}
+
+int ttree_pack_keys(Ttree *ttree, size_t key_size)
+{
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->packed_key_size = key_size;
+    ttree->key_encode = NULL;
+    ttree->key_columns = NULL;
+    return 0;
+}
+
+int ttree_encode_keys(Ttree *ttree, ttree_key_encode_fn encf,
+                      size_t key_size, bool exact)
+{
+    if (encf && (!key_size || (key_size > TTREE_ENCODED_KEY_MAX))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->key_encode = encf;
+    ttree->key_columns = NULL;
+    ttree->packed_key_size = encf ? key_size : 0;
+    ttree->encoded_keys_exact = exact;
+    return 0;
+}
+
+int ttree_set_key_columns(Ttree *ttree, const struct ttree_key_column *cols,
+                          int num_cols)
+{
+    size_t size = 0;
+    int i;
+
+    if (!cols || (num_cols <= 0)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    for (i = 0; i < num_cols; i++) {
+        if ((cols[i].type != TTREE_COL_STRING) &&
+            (cols[i].size != 1) && (cols[i].size != 2) &&
+            (cols[i].size != 4) && (cols[i].size != 8)) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+
+        size += cols[i].size;
+    }
+    if (!size || (size > TTREE_ENCODED_KEY_MAX)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->key_columns = cols;
+    ttree->num_key_columns = num_cols;
+    ttree->key_encode = NULL;
+    ttree->packed_key_size = size;
+    ttree->encoded_keys_exact = true;
+    return 0;
+}
+
+int ttree_scan_prefix(Ttree *ttree, void *key, int num_cols,
+                      ttree_item_fn fn, void *arg)
+{
+    struct tnode_lookup tnl;
+    TtreeCursor cursor;
+    unsigned char enc[TTREE_ENCODED_KEY_MAX];
+    size_t prefix_size;
+    int found = 0;
+
+    if (!ttree->key_columns || (num_cols <= 0) ||
+        (num_cols > ttree->num_key_columns)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    /*
+     * The smallest key having given leading columns has all other
+     * columns encoded by zeros. The scan starts from the position
+     * of the key and stops at the first key with different prefix.
+     */
+    prefix_size = encode_key_columns(ttree, key, num_cols, enc);
+    memset(enc + prefix_size, 0, ttree->packed_key_size - prefix_size);
+    tnl.key = NULL;
+    tnl.enc = enc;
+    if (!ttree->root) {
+        return 0;
+    }
+
+    __ttree_lookup(ttree, &tnl, &cursor);
+    if (cursor.state == CURSOR_PENDING) {
+        /* A position after node's max key is the successor's min key. */
+        if ((cursor.side == TNODE_BOUND) &&
+            (cursor.idx > cursor.tnode->max_idx)) {
+            cursor.idx = cursor.tnode->max_idx;
+            cursor.state = CURSOR_OPENED;
+        }
+        if (ttree_cursor_next(&cursor) != TCSR_OK) {
+            return 0;
+        }
+    }
+
+    do {
+        if (memcmp(tnode_packed_key(ttree, cursor.tnode, cursor.idx),
+                   enc, prefix_size)) {
+            break;
+        }
+
+        found++;
+        if (fn && fn(ttree_item_from_cursor(&cursor), arg)) {
+            break;
+        }
+    } while (ttree_cursor_next(&cursor) == TCSR_OK);
+
+    return found;
+}
+
+int ttree_set_rank_fn(Ttree *ttree, ttree_rank_fn rankf)
+{
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->rank_fn = rankf;
+    return 0;
+}
+
+/*
+ * Items may be spilled only if lookups never touch them: keys must be
+ * compared with their copies kept inside nodes.
+ */
+static bool spill_is_possible(Ttree *ttree)
+{
+    return (ttree_has_packed_keys(ttree) &&
+            (!ttree_encodes_keys(ttree) || ttree->encoded_keys_exact) &&
+            !ttree->is_interval_tree && !(ttree->key_offs & 1));
+}
+
+int ttree_set_spill(Ttree *ttree, int fd, ttree_spill_fn spillf,
+                    ttree_fault_fn faultf, void *arg)
+{
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (spillf && ((fd < 0) || !faultf || !spill_is_possible(ttree))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    ttree->spill_fd = spillf ? fd : -1;
+    ttree->spill_end = 0;
+    ttree->spill_fn = spillf;
+    ttree->fault_fn = faultf;
+    ttree->spill_arg = arg;
+    ttree->spill_hand = NULL;
+    return 0;
+}
+
+static bool tnode_has_cursors(Ttree *ttree, TtreeNode *tnode)
+{
+    TtreeCursor *c;
+
+    for (c = ttree->cursors; c; c = c->next_cursor) {
+        if (c->tnode == tnode) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Write items of a node to the spill file.
+ * Returns the number of spilled items or -1 on error.
+ */
+static int spill_tnode(Ttree *ttree, TtreeNode *tnode)
+{
+    void *item;
+    size_t size;
+    ssize_t ret;
+    int i, num = 0;
+
+    tnode_for_each_index(tnode, i) {
+        if (key_is_spilled(tnode->keys[i])) {
+            continue;
+        }
+
+        item = ttree_key2item(ttree, tnode->keys[i]);
+        size = ttree_item_size(ttree, item);
+        ret = ttree->spill_fn(item, ttree->spill_fd, ttree->spill_end,
+                              ttree->spill_arg);
+        if (ret < 0) {
+            return -1;
+        }
+
+        tnode->keys[i] = spilled_key(ttree->spill_end);
+        tnode->spilled = 1;
+        ttree->spill_end += ret;
+        ttree->mem_used -= size;
+        num++;
+    }
+
+    return num;
+}
+
+int ttree_spill_cold(Ttree *ttree, int num_nodes)
+{
+    TtreeNode *tnode, *start;
+    int ret, num_items = 0, laps = 0;
+
+    if (!ttree_is_tiered(ttree) || !spill_is_possible(ttree)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree->root) {
+        return 0;
+    }
+
+    /*
+     * Access marks are cleared during the first round, so
+     * the walk stops after two rounds at most.
+     */
+    start = tnode = ttree->spill_hand ? ttree->spill_hand :
+        ttree_node_leftmost(ttree->root);
+    while (num_nodes > 0) {
+        if (tnode->accessed) {
+            tnode->accessed = 0;
+        }
+        else if (!tnode_has_cursors(ttree, tnode)) {
+            ret = spill_tnode(ttree, tnode);
+            if (ret < 0) {
+                ttree->spill_hand = tnode;
+                return -1;
+            }
+            if (ret) {
+                num_items += ret;
+                num_nodes--;
+            }
+        }
+
+        tnode = tnode->successor ? tnode->successor :
+            ttree_node_leftmost(ttree->root);
+        if ((tnode == start) && (++laps == 2)) {
+            break;
+        }
+    }
+
+    ttree->spill_hand = tnode;
+    return num_items;
+}
+
+int ttree_track_heat(Ttree *ttree, int sample_rate)
+{
+    TtreeNode *tnode;
+
+    if (sample_rate < 0) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!sample_rate) {
+        for (tnode = ttree_node_leftmost(ttree->root); tnode;
+             tnode = tnode->successor) {
+            tnode->heat = 0;
+        }
+    }
+
+    ttree->heat_sample_rate = sample_rate;
+    ttree->heat_tick = 0;
+    ttree->heat_saturated = false;
+    ttree->heat_saturated = false;
+    return 0;
+}
+
+void ttree_decay_heat(Ttree *ttree)
+{
+    TtreeNode *tnode;
+
+    for (tnode = ttree_node_leftmost(ttree->root); tnode;
+         tnode = tnode->successor) {
+        tnode->heat >>= 1;
+    }
+
+    ttree->heat_saturated = false;
+}
+
+int ttree_hot_ranges(Ttree *ttree, struct ttree_heat_range *ranges,
+                     int num_ranges)
+{
+    TtreeNode *tnode, **hot;
+    int num = 0, i;
+
+    if (num_ranges <= 0) {
+        return 0;
+    }
+    if (ttree->heat_saturated) {
+        ttree_decay_heat(ttree);
+    }
+
+    hot = malloc(sizeof(*hot) * num_ranges);
+    if (!hot) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    /*
+     * Nodes are inserted into the sorted array of the hottest
+     * ones found so far. It's cheap when few ranges are requested.
+     */
+    for (tnode = ttree_node_leftmost(ttree->root); tnode;
+         tnode = tnode->successor) {
+        if (!tnode->heat ||
+            ((num == num_ranges) && (hot[num - 1]->heat >= tnode->heat))) {
+            continue;
+        }
+        if (num < num_ranges) {
+            num++;
+        }
+        for (i = num - 1; (i > 0) && (hot[i - 1]->heat < tnode->heat); i--) {
+            hot[i] = hot[i - 1];
+        }
+
+        hot[i] = tnode;
+    }
+    for (i = 0; i < num; i++) {
+        tnode_fault_in(ttree, hot[i]);
+        ranges[i].first = ttree_key2item(ttree, tnode_key_min(hot[i]));
+        ranges[i].last = ttree_key2item(ttree, tnode_key_max(hot[i]));
+        ranges[i].heat = hot[i]->heat;
+    }
+
+    free(hot);
+    return num;
+}
+
+int ttree_set_pool(Ttree *ttree, struct ttree_pool *pool)
+{
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->pool = pool;
+    return 0;
+}
+
+static int __ttree_overlaps(Ttree *ttree, TtreeNode *tnode, void *lo,
+                            void *hi, ttree_item_fn fn, void *arg, int *found)
+{
+    int i;
+
+    /* Skip subtrees where all intervals end before the lower bound. */
+    if (!tnode || (ttree->cmp_func(tnode->max_end, lo) < 0)) {
+        return 0;
+    }
+    if (__ttree_overlaps(ttree, tnode->left, lo, hi, fn, arg, found)) {
+        return 1;
+    }
+
+    tnode_for_each_index(tnode, i) {
+        /*
+         * Intervals are sorted by their start points, so if current
+         * one starts after the upper bound, the rest of node and its right
+         * subtree may be skipped.
+         */
+        if (ttree->cmp_func(tnode->keys[i], hi) > 0) {
+            return 0;
+        }
+        if (ttree->cmp_func(ttree_key2end(ttree, tnode->keys[i]), lo) >= 0) {
+            (*found)++;
+            if (fn && fn(ttree_key2item(ttree, tnode->keys[i]), arg)) {
+                return 1;
+            }
+        }
+    }
+
+    return __ttree_overlaps(ttree, tnode->right, lo, hi, fn, arg, found);
+}
+
+int ttree_overlaps(Ttree *ttree, void *lo, void *hi,
+                   ttree_item_fn fn, void *arg)
+{
+    int found = 0;
+
+    if (!ttree->is_interval_tree) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    __ttree_overlaps(ttree, ttree->root, lo, hi, fn, arg, &found);
+    return found;
+}
+
+int ttree_set_inline_root(Ttree *ttree, bool enable)
+{
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+
+    ttree->inlines_root = enable;
+    return 0;
+}
+
+int ttree_count_subtrees(Ttree *ttree, bool enable)
+{
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (enable && ttree->is_interval_tree) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    ttree->counts_subtrees = enable;
+    return 0;
+}
+
+/*
+ * Estimate the numbers of nodes in subtrees of heights up to "height"
+ * by geometric means of the minimum(the most unbalanced tree, Fibonacci
+ * tree for AVL) and the maximum(full tree) ones. The estimation for
+ * height i is put to nodes[i].
+ */
+static void estimate_subtree_nodes(Ttree *ttree, int height, double *nodes)
+{
+    double min_nodes[TTREE_MAX_HEIGHT + 1], max_nodes = 0;
+    int i, lower;
+
+    TTREE_ASSERT(height <= TTREE_MAX_HEIGHT);
+    min_nodes[0] = nodes[0] = 0;
+    for (i = 1; i <= height; i++) {
+        lower = i - 1 - ttree->max_imbalance;
+        min_nodes[i] = min_nodes[i - 1] + 1 +
+            ((lower > 0) ? min_nodes[lower] : 0);
+        max_nodes = 2 * max_nodes + 1;
+        nodes[i] = sqrt(min_nodes[i] * max_nodes);
+    }
+}
+
+/*
+ * Height of the child of a node having height "height". The child
+ * is one level lower if it's on the heavier side of the node and
+ * it's lower by the node's overweight otherwise.
+ */
+static __inline int tnode_child_height(TtreeNode *tnode, int side,
+                                       int height)
+{
+    int lighter = (side == TNODE_LEFT) ? tnode->bfc : -tnode->bfc;
+
+    if (!tnode->sides[side]) {
+        return 0;
+    }
+
+    return height - 1 - ((lighter > 0) ? lighter : 0);
+}
+
+/* Get the number of items of node preceding a position in it. */
+static int items_before_in_tnode(TtreeCursor *pos)
+{
+    if (pos->side == TNODE_LEFT) {
+        return 0;
+    }
+    if (pos->side == TNODE_RIGHT) {
+        return tnode_num_keys(pos->tnode);
+    }
+
+    return pos->idx - pos->tnode->min_idx;
+}
+
+/*
+ * Get the number of items preceding a position found by ttree_search
+ * in a tree counting items of subtrees. Each time the path from the
+ * root to the position goes to the right, the node and its left
+ * subtree are skipped.
+ */
+static size_t items_before(TtreeCursor *pos)
+{
+    TtreeNode *n = pos->tnode;
+    size_t items = items_before_in_tnode(pos);
+
+    items += tnode_subtree_items(n->left);
+    for (; n->parent; n = n->parent) {
+        if (tnode_get_side(n) == TNODE_RIGHT) {
+            items += tnode_subtree_items(n->parent->left) +
+                tnode_num_keys(n->parent);
+        }
+    }
+
+    return items;
+}
+
+/* Get the height of a tree by walking down its heavier sides. */
+static int ttree_height(Ttree *ttree)
+{
+    TtreeNode *n;
+    int height = 0;
+
+    for (n = ttree->root; n;
+         n = n->sides[(n->bfc > 0) ? TNODE_RIGHT : TNODE_LEFT]) {
+        height++;
+    }
+
+    return height;
+}
+
+/*
+ * Estimate the number of items preceding a position in a tree that
+ * doesn't count items of subtrees. The path is walked like in
+ * items_before, but the size of a skipped subtree is estimated by
+ * its height: "nodes" is the table built by estimate_subtree_nodes
+ * and "fill" is the mean number of items per node.
+ */
+static double estimate_items_before(TtreeCursor *pos, int height,
+                                    const double *nodes, double fill)
+{
+    TtreeNode *path[TTREE_MAX_HEIGHT], *n;
+    int heights[TTREE_MAX_HEIGHT], depth = 0, i;
+    double items = items_before_in_tnode(pos);
+
+    n = pos->tnode;
+    do {
+        TTREE_ASSERT(depth < TTREE_MAX_HEIGHT);
+        path[depth++] = n;
+    } while ((n = n->parent));
+
+    heights[depth - 1] = height;
+    for (i = depth - 2; i >= 0; i--) {
+        heights[i] = tnode_child_height(path[i + 1],
+                                        tnode_get_side(path[i]),
+                                        heights[i + 1]);
+    }
+
+    n = path[0];
+    items += fill * nodes[tnode_child_height(n, TNODE_LEFT, heights[0])];
+    for (i = 0; i < depth - 1; i++) {
+        if (tnode_get_side(path[i]) == TNODE_RIGHT) {
+            n = path[i + 1];
+            items += tnode_num_keys(n) + fill *
+                nodes[tnode_child_height(n, TNODE_LEFT, heights[i + 1])];
+        }
+    }
+
+    return items;
+}
+
+size_t ttree_estimate_range(Ttree *ttree, void *lo, void *hi)
+{
+    struct tnode_lookup tnl;
+    char enc[TTREE_ENCODED_KEY_MAX];
+    TtreeCursor lo_pos, hi_pos, end;
+    TtreeNode *n;
+    double nodes[TTREE_MAX_HEIGHT + 1];
+    double lo_items, hi_items, fill, scale;
+    int i, height;
+
+    if (!ttree->root) {
+        return 0;
+    }
+
+    init_tnode_lookup(ttree, &tnl, lo, enc);
+    ttree_search(ttree, &tnl, &lo_pos);
+    init_tnode_lookup(ttree, &tnl, hi, enc);
+    hi_items = ttree_search(ttree, &tnl, &hi_pos) ? 1 : 0;
+
+    if (ttree->counts_subtrees) {
+        lo_items = items_before(&lo_pos);
+        hi_items += items_before(&hi_pos);
+        return (hi_items > lo_items) ? (size_t)(hi_items - lo_items) : 0;
+    }
+    else {
+        /*
+         * If bounds are close to each other, the items between
+         * them are counted exactly by a short walk.
+         */
+        lo_items = 0;
+        for (n = lo_pos.tnode, i = 0;
+             n && (i < TTREE_ESTIMATE_WALK_NODES); n = n->successor, i++) {
+            if (n == hi_pos.tnode) {
+                hi_items += (items_before_in_tnode(&hi_pos) + lo_items -
+                             items_before_in_tnode(&lo_pos));
+                return (hi_items > 0) ? (size_t)hi_items : 0;
+            }
+
+            lo_items += tnode_num_keys(n);
+        }
+    }
+
+    /*
+     * Positions of the bounds are estimated as parts of the whole tree,
+     * whose estimation is scaled to the known number of items.
+     */
+    height = ttree_height(ttree);
+    estimate_subtree_nodes(ttree, height, nodes);
+    fill = ttree->num_items / nodes[height];
+    end.tnode = ttree_node_rightmost(ttree->root);
+    end.side = TNODE_RIGHT;
+    scale = ttree->num_items / estimate_items_before(&end, height, nodes,
+                                                      fill);
+    lo_items = scale * estimate_items_before(&lo_pos, height, nodes, fill);
+    hi_items += scale * estimate_items_before(&hi_pos, height, nodes, fill);
+    if (hi_items > ttree->num_items) {
+        hi_items = ttree->num_items;
+    }
+
+    return (hi_items > lo_items) ? (size_t)(hi_items - lo_items + 0.5) : 0;
+}
+
+ssize_t ttree_rank(Ttree *ttree, void *key)
+{
+    struct tnode_lookup tnl;
+    char enc[TTREE_ENCODED_KEY_MAX];
+    TtreeCursor pos;
+
+    if (!ttree->counts_subtrees) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree->root) {
+        return 0;
+    }
+
+    init_tnode_lookup(ttree, &tnl, key, enc);
+    ttree_search(ttree, &tnl, &pos);
+    return (ssize_t)items_before(&pos);
+}
+
+void *ttree_select(Ttree *ttree, size_t rank)
+{
+    TtreeNode *n = ttree->root;
+    size_t left, num;
+
+    if (!ttree->counts_subtrees) {
+        SET_ERRNO(EINVAL);
+        return NULL;
+    }
+
+    while (n) {
+        left = tnode_subtree_items(n->left);
+        if (rank < left) {
+            n = n->left;
+            continue;
+        }
+
+        rank -= left;
+        num = tnode_num_keys(n);
+        if (rank < num) {
+            tnode_fault_in(ttree, n);
+            return ttree_key2item(ttree, n->keys[n->min_idx + rank]);
+        }
+
+        rank -= num;
+        n = n->right;
+    }
+
+    return NULL;
+}
+
+size_t ttree_num_items(Ttree *ttree)
+{
+    return ttree->num_items;
+}
+
+int ttree_track_quantiles(Ttree *ttree, struct ttree_sketch *sketch,
+                          ttree_key_value_fn valf)
+{
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (sketch && !valf) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    ttree->sketch = sketch;
+    ttree->key_value = sketch ? valf : NULL;
+    return 0;
+}
+
+double ttree_quantile(Ttree *ttree, double q)
+{
+    if (!ttree->sketch) {
+        return NAN;
+    }
+
+    return ttree_sketch_quantile(ttree->sketch, q);
+}
+
+/*
+ * A position of sampling: the rank of an item if the tree counts items
+ * of subtrees, an index in a node otherwise. The range ends before
+ * the item at the end position(end_tnode is NULL if the range lasts
+ * until the end of the tree).
+ */
+struct sample_pos {
+    TtreeNode *tnode;
+    int idx;
+    TtreeNode *end_tnode;
+    int end_idx;
+    size_t rank;
+    size_t end_rank;
+};
+
+/*
+ * Convert a position found by ttree_search to a node and an index of
+ * the first item following it. "after" is true if the found item
+ * itself precedes the position.
+ */
+static void range_pos_from_search(TtreeCursor *pos, bool after,
+                                   TtreeNode **tnode, int *idx)
+{
+    TtreeNode *n = pos->tnode;
+
+    *idx = n->min_idx + items_before_in_tnode(pos) + (after ? 1 : 0);
+    if (*idx > n->max_idx) {
+        n = n->successor;
+        *idx = n ? n->min_idx : 0;
+    }
+
+    *tnode = n;
 }
 
-int ttree_replace(Ttree *ttree, void *key, void *new_item)
+void ttree_range_open(TtreeRange *range, Ttree *ttree, void *lo, void *hi)
 {
-    TtreeCursor cursor;
+    struct tnode_lookup tnl;
+    char enc[TTREE_ENCODED_KEY_MAX];
+    TtreeCursor pos;
+    bool found;
+
+    memset(range, 0, sizeof(*range));
+    range->ttree = ttree;
+    if (!ttree->root || (lo && hi && (ttree_cmp_keys(ttree, lo, hi) > 0))) {
+        return;
+    }
+    if (lo) {
+        init_tnode_lookup(ttree, &tnl, lo, enc);
+        ttree_search(ttree, &tnl, &pos);
+        range_pos_from_search(&pos, false, &range->tnode, &range->idx);
+    }
+    else {
+        range->tnode = ttree_node_leftmost(ttree->root);
+        range->idx = range->tnode->min_idx;
+    }
+    if (hi) {
+        init_tnode_lookup(ttree, &tnl, hi, enc);
+        found = (ttree_search(ttree, &tnl, &pos) != NULL);
+        range_pos_from_search(&pos, found, &range->end_tnode,
+                              &range->end_idx);
+    }
+}
+
+/*
+ * Get the next slice of a range without faulting in its items.
+ */
+static TtreeNode *range_next_slice(TtreeRange *range, int *first, int *last)
+{
+    TtreeNode *tnode = range->tnode;
+
+    if (!tnode) {
+        return NULL;
+    }
+
+    *first = range->idx;
+    if (tnode == range->end_tnode) {
+        *last = range->end_idx - 1;
+        range->tnode = NULL;
+        return (*first <= *last) ? tnode : NULL;
+    }
+
+    *last = tnode->max_idx;
+    range->tnode = tnode->successor;
+    range->idx = range->tnode ? range->tnode->min_idx : 0;
+    return tnode;
+}
+
+TtreeNode *ttree_range_next(TtreeRange *range, int *first, int *last)
+{
+    TtreeNode *tnode = range_next_slice(range, first, last);
+
+    if (tnode) {
+        tnode_fault_in(range->ttree, tnode);
+    }
+
+    return tnode;
+}
+
+/*
+ * Copy "num" values of a field of "width" bytes. Widths of common
+ * types are constant for the compiler, so copies become plain moves.
+ */
+static __inline void copy_column_values(char *dst, char **srcs,
+                                        ptrdiff_t offs, size_t width, int num)
+{
+    int i;
+
+    switch (width) {
+        case 4:
+            for (i = 0; i < num; i++) {
+                memcpy(dst + 4 * i, srcs[i] + offs, 4);
+            }
+            break;
+        case 8:
+            for (i = 0; i < num; i++) {
+                memcpy(dst + 8 * i, srcs[i] + offs, 8);
+            }
+            break;
+        default:
+            for (i = 0; i < num; i++) {
+                memcpy(dst + width * i, srcs[i] + offs, width);
+            }
+    }
+}
+
+int ttree_range_fetch(TtreeRange *range, const struct ttree_column *cols,
+                      int num_cols, int max_rows)
+{
+    Ttree *ttree = range->ttree;
+    const struct ttree_column *col;
+    TtreeNode *tnode;
+    bool inline_keys, touch_items = false;
+    int first, last, num, c, rows = 0;
+    char *dst;
+
+    if ((max_rows < 0) || (num_cols < 0) || (num_cols && !cols)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    for (c = 0; c < num_cols; c++) {
+        if (!cols[c].width || !cols[c].buf) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+    }
+
+    /*
+     * Key columns are taken from copies of keys kept in nodes if they
+     * are raw keys of the same size.
+     */
+    inline_keys = ttree_keys_are_inline(ttree);
+    for (c = 0; c < num_cols; c++) {
+        if ((cols[c].offs != TTREE_COLUMN_KEY) || !inline_keys ||
+            (cols[c].width != ttree->packed_key_size)) {
+            touch_items = true;
+        }
+    }
+
+    while ((rows < max_rows) &&
+           (tnode = range_next_slice(range, &first, &last))) {
+        num = last - first + 1;
+        if (num > max_rows - rows) {
+            /* The rest of the slice goes to the next batch. */
+            num = max_rows - rows;
+            range->tnode = tnode;
+            range->idx = first + num;
+        }
+        if (touch_items) {
+            tnode_fault_in(ttree, tnode);
+        }
+
+        /*
+         * Pointers to keys of a slice are contiguous, and a field of
+         * an item is at a fixed offset from its key.
+         */
+        for (c = 0; c < num_cols; c++) {
+            col = &cols[c];
+            dst = (char *)col->buf + rows * col->width;
+            if (col->offs != TTREE_COLUMN_KEY) {
+                copy_column_values(dst, (char **)tnode->keys + first,
+                                   (ptrdiff_t)col->offs -
+                                   (ptrdiff_t)ttree->key_offs,
+                                   col->width, num);
+            }
+            else if (inline_keys && (col->width == ttree->packed_key_size)) {
+                memcpy(dst, tnode_packed_key(ttree, tnode, first),
+                       num * col->width);
+            }
+            else {
+                copy_column_values(dst, (char **)tnode->keys + first, 0,
+                                   col->width, num);
+            }
+        }
+
+        rows += num;
+    }
+
+    return rows;
+}
+
+/* Maximum number of keys predicates are evaluated for at once. */
+#define TTREE_PRED_BATCH 256
+
+#define pred_value_width(type)                                          \
+    ((((type) == TTREE_PRED_INT32) || ((type) == TTREE_PRED_UINT32)) ?  \
+     4 : 8)
+
+#define PRED_LOOP(vals, c, cmp, match, num)                             \
+    do {                                                                \
+        int __i;                                                        \
+                                                                        \
+        for (__i = 0; __i < (num); __i++) {                             \
+            (match)[__i] = ((vals)[__i] cmp (c));                       \
+        }                                                               \
+    } while (0)
+
+#define PRED_MATCH(ctype, member, pred, buf, match, num)                \
+    do {                                                                \
+        const ctype *__v = (const ctype *)(buf);                        \
+        ctype __c = (pred)->value.member;                               \
+                                                                        \
+        switch ((pred)->op) {                                           \
+            case TTREE_PRED_EQ:                                         \
+                PRED_LOOP(__v, __c, ==, match, num);                    \
+                break;                                                  \
+            case TTREE_PRED_NE:                                         \
+                PRED_LOOP(__v, __c, !=, match, num);                    \
+                break;                                                  \
+            case TTREE_PRED_LT:                                         \
+                PRED_LOOP(__v, __c, <, match, num);                     \
+                break;                                                  \
+            case TTREE_PRED_LE:                                         \
+                PRED_LOOP(__v, __c, <=, match, num);                    \
+                break;                                                  \
+            case TTREE_PRED_GT:                                         \
+                PRED_LOOP(__v, __c, >, match, num);                     \
+                break;                                                  \
+            default:                                                    \
+                PRED_LOOP(__v, __c, >=, match, num);                    \
+        }                                                               \
+    } while (0)
+
+/*
+ * Compare "num" gathered values of a field with the predicate's value.
+ * Each loop handles one type and comparison, so it has no branches.
+ */
+static void pred_match(const struct ttree_pred *pred, const void *vals,
+                       uint8_t *match, int num)
+{
+    switch (pred->type) {
+        case TTREE_PRED_INT32:
+            PRED_MATCH(int32_t, i32, pred, vals, match, num);
+            break;
+        case TTREE_PRED_UINT32:
+            PRED_MATCH(uint32_t, u32, pred, vals, match, num);
+            break;
+        case TTREE_PRED_INT64:
+            PRED_MATCH(int64_t, i64, pred, vals, match, num);
+            break;
+        case TTREE_PRED_UINT64:
+            PRED_MATCH(uint64_t, u64, pred, vals, match, num);
+            break;
+        default:
+            PRED_MATCH(double, d, pred, vals, match, num);
+    }
+}
+
+/*
+ * Evaluate a predicate for "num" keys of a node starting at "first".
+ * Returns true if items of the node were faulted in.
+ */
+static bool pred_eval(Ttree *ttree, const struct ttree_pred *pred,
+                      TtreeNode *tnode, int first, int num, uint8_t *match)
+{
+    uint64_t vals[TTREE_PRED_BATCH];
+    size_t width;
+    int i;
+
+    if (!pred) {
+        memset(match, 1, num);
+        return false;
+    }
+    if (pred->fn) {
+        tnode_fault_in(ttree, tnode);
+        for (i = 0; i < num; i++) {
+            match[i] = !!pred->fn(ttree_key2item(ttree,
+                                                 tnode->keys[first + i]),
+                                  pred->arg);
+        }
+
+        return true;
+    }
+
+    width = pred_value_width(pred->type);
+    if (pred->offs != TTREE_COLUMN_KEY) {
+        tnode_fault_in(ttree, tnode);
+        copy_column_values((char *)vals, (char **)tnode->keys + first,
+                           (ptrdiff_t)pred->offs - (ptrdiff_t)ttree->key_offs,
+                           width, num);
+    }
+    else if (ttree_keys_are_inline(ttree) &&
+             (ttree->packed_key_size == width)) {
+        memcpy(vals, tnode_packed_key(ttree, tnode, first), num * width);
+    }
+    else {
+        tnode_fault_in(ttree, tnode);
+        copy_column_values((char *)vals, (char **)tnode->keys + first, 0,
+                           width, num);
+    }
+
+    pred_match(pred, vals, match, num);
+    return (pred->offs != TTREE_COLUMN_KEY);
+}
+
+int ttree_scan_filtered(Ttree *ttree, void *lo, void *hi,
+                        const struct ttree_pred *pred,
+                        ttree_item_fn fn, void *arg)
+{
+    uint8_t match[TTREE_PRED_BATCH];
+    TtreeRange range;
+    TtreeNode *tnode;
+    int first, last, num, i, found = 0;
+    bool faulted;
+
+    if (pred && !pred->fn &&
+        (((unsigned)pred->type > TTREE_PRED_DOUBLE) ||
+         ((unsigned)pred->op > TTREE_PRED_GE))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    ttree_range_open(&range, ttree, lo, hi);
+    while ((tnode = range_next_slice(&range, &first, &last))) {
+        for (; first <= last; first += num) {
+            num = last - first + 1;
+            if (num > TTREE_PRED_BATCH) {
+                num = TTREE_PRED_BATCH;
+            }
+
+            faulted = pred_eval(ttree, pred, tnode, first, num, match);
+            for (i = 0; i < num; i++) {
+                if (!match[i]) {
+                    continue;
+                }
+                if (!faulted) {
+                    tnode_fault_in(ttree, tnode);
+                    faulted = true;
+                }
+
+                found++;
+                if (fn && fn(ttree_key2item(ttree, tnode->keys[first + i]),
+                             arg)) {
+                    return found;
+                }
+            }
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Reduce an array of "num" keys. Sum, minimum and maximum are kept in
+ * locals during the loop, so the compiler may vectorize it. Integer
+ * keys are summed as uint64_t, so the sum wraps around instead of
+ * overflowing, and it's added to the u64 field whatever the type is.
+ */
+#define AGG_REDUCE(ctype, acctype, member, summember, vals, num, agg)   \
+    do {                                                                \
+        const ctype *__v = (const ctype *)(vals);                       \
+        acctype __sum = 0;                                              \
+        ctype __min, __max;                                             \
+        int __i;                                                        \
+                                                                        \
+        if ((num) <= 0) {                                               \
+            break;                                                      \
+        }                                                               \
+                                                                        \
+        __min = __max = __v[0];                                         \
+        for (__i = 0; __i < (num); __i++) {                             \
+            __sum += (acctype)__v[__i];                                 \
+            __min = (__v[__i] < __min) ? __v[__i] : __min;              \
+            __max = (__v[__i] > __max) ? __v[__i] : __max;              \
+        }                                                               \
+        if (!(agg)->count || (__min < (agg)->min.member)) {             \
+            (agg)->min.member = __min;                                  \
+        }                                                               \
+        if (!(agg)->count || (__max > (agg)->max.member)) {             \
+            (agg)->max.member = __max;                                  \
+        }                                                               \
+                                                                        \
+        (agg)->sum.summember += __sum;                                  \
+        (agg)->count += (num);                                          \
+    } while (0)
 
-    if (!ttree_lookup(ttree, &cursor, key))
+static void aggregate_keys(enum ttree_pred_type type, const void *vals,
+                           int num, struct ttree_aggregate *agg)
+{
+    switch (type) {
+        case TTREE_PRED_INT32:
+            AGG_REDUCE(int32_t, uint64_t, i64, u64, vals, num, agg);
+            break;
+        case TTREE_PRED_UINT32:
+            AGG_REDUCE(uint32_t, uint64_t, u64, u64, vals, num, agg);
+            break;
+        case TTREE_PRED_INT64:
+            AGG_REDUCE(int64_t, uint64_t, i64, u64, vals, num, agg);
+            break;
+        case TTREE_PRED_UINT64:
+            AGG_REDUCE(uint64_t, uint64_t, u64, u64, vals, num, agg);
+            break;
+        default:
+            AGG_REDUCE(double, double, d, d, vals, num, agg);
+    }
+}
+
+int ttree_aggregate_range(Ttree *ttree, void *lo, void *hi,
+                          enum ttree_pred_type type,
+                          struct ttree_aggregate *agg)
+{
+    uint64_t vals[TTREE_PRED_BATCH];
+    TtreeRange range;
+    TtreeNode *tnode;
+    size_t width;
+    int first, last, num;
+
+    if ((unsigned)type > TTREE_PRED_DOUBLE) {
+        SET_ERRNO(EINVAL);
         return -1;
+    }
+
+    memset(agg, 0, sizeof(*agg));
+    width = pred_value_width(type);
+    ttree_range_open(&range, ttree, lo, hi);
+    while ((tnode = range_next_slice(&range, &first, &last))) {
+        if (ttree_keys_are_inline(ttree) &&
+            (ttree->packed_key_size == width)) {
+            aggregate_keys(type, tnode_packed_key(ttree, tnode, first),
+                           last - first + 1, agg);
+            continue;
+        }
+
+        tnode_fault_in(ttree, tnode);
+        for (; first <= last; first += num) {
+            num = last - first + 1;
+            if (num > TTREE_PRED_BATCH) {
+                num = TTREE_PRED_BATCH;
+            }
+
+            copy_column_values((char *)vals, (char **)tnode->keys + first,
+                               0, width, num);
+            aggregate_keys(type, vals, num, agg);
+        }
+    }
 
-    cursor.tnode->keys[cursor.idx] = ttree_item2key(ttree, new_item);
     return 0;
 }
 
+static void sample_pos_init(Ttree *ttree, void *lo, void *hi,
+                            struct sample_pos *sp)
+{
+    struct tnode_lookup tnl;
+    char enc[TTREE_ENCODED_KEY_MAX];
+    TtreeCursor pos;
+    bool found;
+
+    memset(sp, 0, sizeof(*sp));
+    if (lo) {
+        init_tnode_lookup(ttree, &tnl, lo, enc);
+        ttree_search(ttree, &tnl, &pos);
+        if (ttree->counts_subtrees) {
+            sp->rank = items_before(&pos);
+        }
+        else {
+            range_pos_from_search(&pos, false, &sp->tnode, &sp->idx);
+        }
+    }
+    else {
+        sp->tnode = ttree_node_leftmost(ttree->root);
+        sp->idx = sp->tnode->min_idx;
+    }
+    if (hi) {
+        init_tnode_lookup(ttree, &tnl, hi, enc);
+        found = (ttree_search(ttree, &tnl, &pos) != NULL);
+        if (ttree->counts_subtrees) {
+            sp->end_rank = items_before(&pos) + (found ? 1 : 0);
+        }
+        else {
+            range_pos_from_search(&pos, found, &sp->end_tnode,
+                                   &sp->end_idx);
+        }
+    }
+    else {
+        sp->end_rank = ttree->root->subtree_items;
+    }
+}
+
+static __inline bool sample_pos_valid(Ttree *ttree, struct sample_pos *sp)
+{
+    if (ttree->counts_subtrees) {
+        return (sp->rank < sp->end_rank);
+    }
+
+    return (sp->tnode &&
+            ((sp->tnode != sp->end_tnode) || (sp->idx < sp->end_idx)));
+}
+
+/* Skip "num" items of the range. Returns false if the range is over. */
+static bool sample_pos_skip(Ttree *ttree, struct sample_pos *sp, double num)
+{
+    int left;
+
+    if (ttree->counts_subtrees) {
+        if (num >= sp->end_rank - sp->rank) {
+            sp->rank = sp->end_rank;
+            return false;
+        }
+
+        sp->rank += (size_t)num;
+        return true;
+    }
+    while (sample_pos_valid(ttree, sp)) {
+        left = ((sp->tnode == sp->end_tnode) ? sp->end_idx :
+                (sp->tnode->max_idx + 1)) - sp->idx;
+        if (num < left) {
+            sp->idx += (int)num;
+            return true;
+        }
+        if (sp->tnode == sp->end_tnode) {
+            sp->tnode = NULL;
+            return false;
+        }
+
+        num -= left;
+        sp->tnode = sp->tnode->successor;
+        sp->idx = sp->tnode ? sp->tnode->min_idx : 0;
+    }
+
+    return false;
+}
+
+/*
+ * Get the item at the position. If the tree counts items of subtrees,
+ * its rank is returned instead, the item is found later.
+ */
+static void *sample_pos_item(Ttree *ttree, struct sample_pos *sp)
+{
+    if (ttree->counts_subtrees) {
+        return (void *)(uintptr_t)sp->rank;
+    }
+
+    tnode_fault_in(ttree, sp->tnode);
+    return ttree_key2item(ttree, sp->tnode->keys[sp->idx]);
+}
+
+/* Get a random number in (0, 1). */
+static __inline double random_unit(ttree_rand_fn rng, void *arg)
+{
+    return ((rng(arg) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+int ttree_sample_range(Ttree *ttree, void *lo, void *hi, int num,
+                       ttree_rand_fn rng, void *arg, void **out)
+{
+    struct sample_pos sp;
+    double w;
+    int i, picked = 0;
+
+    if ((num < 0) || !rng || (num && !out)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree->root || !num ||
+        (lo && hi && (ttree_cmp_keys(ttree, lo, hi) > 0))) {
+        return 0;
+    }
+
+    /*
+     * "Algorithm L" of reservoir sampling: the first items fill the
+     * reservoir, then the number of items to skip before the next item
+     * replacing a random one in the reservoir is drawn from geometric
+     * distribution, so skipped items are never visited.
+     */
+    sample_pos_init(ttree, lo, hi, &sp);
+    while ((picked < num) && sample_pos_valid(ttree, &sp)) {
+        out[picked++] = sample_pos_item(ttree, &sp);
+        sample_pos_skip(ttree, &sp, 1);
+    }
+    if (picked == num) {
+        w = exp(log(random_unit(rng, arg)) / num);
+        while (sample_pos_skip(ttree, &sp, floor(log(random_unit(rng, arg)) /
+                                                 log(1 - w)))) {
+            /*
+             * Reducing rng() modulo num would prefer the first slots
+             * unless num divides its range. The product may round up
+             * to num if the random number is very close to 1.
+             */
+            i = (int)(random_unit(rng, arg) * num);
+            out[(i < num) ? i : (num - 1)] = sample_pos_item(ttree, &sp);
+            sample_pos_skip(ttree, &sp, 1);
+            w *= exp(log(random_unit(rng, arg)) / num);
+        }
+    }
+    if (ttree->counts_subtrees) {
+        for (i = 0; i < picked; i++) {
+            out[i] = ttree_select(ttree, (uintptr_t)out[i]);
+        }
+    }
+
+    return picked;
+}
+
 int ttree_cursor_open_on_node(TtreeCursor *cursor, Ttree *tree,
                               TtreeNode *tnode, enum tnode_seek seek)
 {
+    TtreeCursor *next = NULL;
+
     TTREE_ASSERT(cursor != NULL);
     TTREE_ASSERT(tree != NULL);
 
+    /*
+     * A registered cursor keeps its link. Fields of other cursors
+     * may be uninitialized, so they aren't read.
+     */
+    if (UNLIKELY(tree->cursors != NULL) &&
+        cursor_is_registered(tree, cursor)) {
+        next = cursor->next_cursor;
+    }
+
     memset(cursor, 0, sizeof(*cursor));
+    cursor->next_cursor = next;
     cursor->ttree = tree;
     cursor->tnode = tnode;
 
@@ -977,6 +3563,7 @@ int ttree_cursor_open_on_node(TtreeCursor *cursor, Ttree *tree,
                 return -1;
         }
 
+        tnode_fault_in(tree, tnode);
         cursor->state = CURSOR_OPENED;
     }
     else {
@@ -995,6 +3582,53 @@ int ttree_cursor_open(TtreeCursor *cursor, Ttree *ttree)
                                      TNODE_SEEK_START);
 }
 
+TtreeCursor *ttree_cursor_copy(TtreeCursor *csr_dst,
+                               const TtreeCursor *csr_src)
+{
+    TtreeCursor *next = NULL;
+
+    if (csr_src->ttree && csr_src->ttree->cursors &&
+        cursor_is_registered(csr_src->ttree, csr_dst)) {
+        next = csr_dst->next_cursor;
+    }
+
+    memcpy(csr_dst, csr_src, sizeof(*csr_src));
+    csr_dst->next_cursor = next;
+    return csr_dst;
+}
+
+int ttree_cursor_register(TtreeCursor *cursor)
+{
+    Ttree *ttree = cursor->ttree;
+
+    TTREE_ASSERT(ttree != NULL);
+    if (cursor_is_registered(ttree, cursor)) {
+        SET_ERRNO(EEXIST);
+        return -1;
+    }
+
+    cursor->next_cursor = ttree->cursors;
+    ttree->cursors = cursor;
+    return 0;
+}
+
+int ttree_cursor_unregister(TtreeCursor *cursor)
+{
+    TtreeCursor **c;
+
+    TTREE_ASSERT(cursor->ttree != NULL);
+    for (c = &cursor->ttree->cursors; *c; c = &(*c)->next_cursor) {
+        if (*c == cursor) {
+            *c = cursor->next_cursor;
+            cursor->next_cursor = NULL;
+            return 0;
+        }
+    }
+
+    SET_ERRNO(ENOENT);
+    return -1;
+}
+
 int ttree_cursor_first(TtreeCursor *cursor)
 {
     TtreeNode *tnode;
@@ -1021,6 +3655,9 @@ int ttree_cursor_first(TtreeCursor *cursor)
         cursor->tnode = tnode;
         cursor->idx = tnode->min_idx;
     }
+    if (cursor->tnode) {
+        tnode_fault_in(cursor->ttree, cursor->tnode);
+    }
 
     return ret;
 }
@@ -1052,6 +3689,9 @@ int ttree_cursor_last(TtreeCursor *cursor)
         cursor->tnode = tnode;
         cursor->idx = tnode->max_idx;
     }
+    if (cursor->tnode) {
+        tnode_fault_in(cursor->ttree, cursor->tnode);
+    }
 
     return ret;
 }
@@ -1093,6 +3733,7 @@ int ttree_cursor_next(TtreeCursor *cursor)
         if (cursor->tnode->successor) {
             cursor->tnode = cursor->tnode->successor;
             cursor->idx = cursor->tnode->min_idx;
+            tnode_fault_in(cursor->ttree, cursor->tnode);
             return TCSR_OK;
         }
 
@@ -1155,6 +3796,7 @@ int ttree_cursor_prev(TtreeCursor *cursor)
 
         cursor->tnode = n;
         cursor->idx = cursor->tnode->max_idx;
+        tnode_fault_in(cursor->ttree, n);
         return TCSR_OK;
     }
 
@@ -115,15 +115,165 @@ typedef struct ttree_node {
         };
     };
 
+    uint16_t capacity; /**< Number of key rooms in node's array */
+
+    /**
+     * Non-zero if node's keys were accessed since the node was
+     * checked last time by approximate LRU eviction.
+     * @see ttree_set_budget
+     */
+    unsigned accessed :1;
+
+    /**
+     * Non-zero if some items of the node were written to a file.
+     * @see ttree_spill_cold
+     */
+    unsigned spilled  :1;
+
+    /**
+     * Number of sampled lookups that ended in the node.
+     * @see ttree_track_heat
+     */
+    unsigned heat     :14;
+
+    union {
+        /**
+         * The maximum end point of intervals stored in node's subtree.
+         * Used only in interval trees.
+         */
+        void *max_end;
+
+        /**
+         * Number of items stored in node's subtree.
+         * Used only if the tree counts items of subtrees.
+         * @see ttree_count_subtrees
+         */
+        size_t subtree_items;
+    };
+
     /**
      * First two items of T*-tree node keys array
      */
     void *keys[TNODE_ITEMS_MIN];
 } TtreeNode;
 
+/**
+ * @brief A range of keys held by a T*-tree node and its heat.
+ * @see ttree_hot_ranges
+ */
+struct ttree_heat_range {
+    void *first;       /**< An item with the smallest key of the range */
+    void *last;        /**< An item with the biggest key of the range */
+    unsigned int heat; /**< Number of sampled lookups that hit the range */
+};
+
 typedef int (*ttree_cmp_func_fn)(void *key1, void *key2);
 typedef void (*ttree_callback_fn)(TtreeNode *tnode, void *arg);
 
+/**
+ * Function called for each item found by a query.
+ * Non-zero return value stops the query.
+ */
+typedef int (*ttree_item_fn)(void *item, void *arg);
+
+/**
+ * Function returning the amount of memory(in bytes) used by an item.
+ */
+typedef size_t (*ttree_item_size_fn)(void *item);
+
+/**
+ * Function called for each item evicted from a tree.
+ */
+typedef void (*ttree_evict_fn)(void *item, void *arg);
+
+/**
+ * Function writing an item to file @a fd at offset @a offs. It may
+ * free the item when the item is written.
+ * Returns the number of bytes written or -1 on error.
+ * @see ttree_set_spill
+ */
+typedef ssize_t (*ttree_spill_fn)(void *item, int fd, off_t offs, void *arg);
+
+/**
+ * Function reading an item written by ttree_spill_fn from file @a fd
+ * at offset @a offs back to memory. It mustn't fail.
+ * @see ttree_set_spill
+ */
+typedef void *(*ttree_fault_fn)(int fd, off_t offs, void *arg);
+
+/**
+ * Function returning uniformly distributed 64 bit random numbers.
+ * @see ttree_sample_range
+ */
+typedef uint64_t (*ttree_rand_fn)(void *arg);
+
+/**
+ * Function returning a numeric value of a key counted by
+ * a quantile sketch.
+ * @see ttree_track_quantiles
+ */
+typedef double (*ttree_key_value_fn)(void *key);
+
+/**
+ * Function encoding a key into a string of bytes whose memcmp order is
+ * the order of keys. It writes exactly the number of bytes the encoder
+ * was set up with to @a buf.
+ */
+typedef void (*ttree_key_encode_fn)(void *key, void *buf);
+
+/**
+ * Function returning the number of keys less than @a key in a sorted
+ * array of @a num_keys keys. Keys are passed in the form T*-tree nodes
+ * keep them: an array of pointers to keys, a dense array of key copies
+ * or of encoded keys. The search key has the same form.
+ * @see ttree_set_rank_fn
+ */
+typedef int (*ttree_rank_fn)(void *key, void *keys, int num_keys);
+
+/**
+ * @brief Types of columns a composite T*-tree key may consist of.
+ * @see ttree_set_key_columns
+ */
+enum ttree_column_type {
+    TTREE_COL_INT = 0, /**< Signed integer of 1, 2, 4 or 8 bytes */
+    TTREE_COL_UINT,    /**< Unsigned integer of 1, 2, 4 or 8 bytes */
+    TTREE_COL_STRING,  /**< Fixed size array of chars, NUL padded */
+};
+
+/**
+ * @brief Description of a column of composite T*-tree key.
+ * @see ttree_key_column
+ */
+struct ttree_key_column {
+    size_t offs;                 /**< Offset of the column in a key */
+    size_t size;                 /**< Size of the column in bytes */
+    enum ttree_column_type type; /**< Type of the column */
+    bool descending;             /**< True if column is sorted descending */
+};
+
+/**
+ * @brief Describe a column of composite key.
+ * @param key_struct - Structure of the key.
+ * @param field      - Name of the column field in @a key_struct.
+ * @param type       - Type of the column(enum ttree_column_type).
+ * @param descending - True if the column is sorted in descending order.
+ */
+#define ttree_key_column(key_struct, field, type, descending)           \
+    { offsetof(key_struct, field), sizeof(((key_struct *)0)->field),    \
+      (type), (descending) }
+
+/**
+ * @brief Policies of items eviction from a T*-tree exceeded its memory budget.
+ * @see ttree_set_budget
+ */
+enum ttree_evict_policy {
+    TTREE_EVICT_LEFT_EDGE = 0, /**< Evict items with the smallest keys */
+    TTREE_EVICT_LRU,           /**< Approximate LRU of T*-tree nodes */
+};
+
+struct ttree_pool;
+struct ttree_sketch;
+
 /**
  * @brief T*-tree structure
  */
@@ -133,10 +283,157 @@ typedef struct ttree {
     size_t key_offs;            /**< Offset from item to its key(may be 0) */
     int keys_per_tnode;         /**< Number of keys per each T*-tree node */
 
+    /**
+     * Number of key rooms new T*-tree nodes are created with. Nodes grow
+     * up to keys_per_tnode rooms before new nodes are added.
+     * @see ttree_set_node_growth
+     */
+    int min_keys_per_tnode;
+
+    /**
+     * Number of key rooms in internal T*-tree nodes. Internal nodes
+     * are only passed through by lookups, so they may be smaller
+     * than leafs holding most of the keys.
+     * @see ttree_set_internal_node_size
+     */
+    int internal_keys_per_tnode;
+
+    /**
+     * Maximum difference of heights of subtrees of a node.
+     * @see ttree_set_balance
+     */
+    int max_imbalance;
+    unsigned long num_rotations; /**< Number of rotations done so far */
+
     /**
      * The field is true if keys in a tree supposed to be unique
      */
     bool keys_are_unique;
+
+    /**
+     * A list of cursors that are kept pointing to the same items
+     * while the tree is modified.
+     * @see ttree_cursor_register
+     */
+    struct ttree_cursor *cursors;
+
+    /**
+     * Offset from item to the end point of its interval.
+     * @see ttree_init_intervals
+     */
+    size_t end_offs;
+    bool is_interval_tree; /**< True if the tree stores intervals */
+
+    /**
+     * True if nodes know the number of items in their subtrees.
+     * @see ttree_count_subtrees
+     */
+    bool counts_subtrees;
+
+    /**
+     * Memory used by the tree: T*-tree nodes plus items if
+     * item_size function is specified.
+     * @see ttree_set_budget
+     */
+    size_t mem_used;
+    size_t mem_budget;                 /**< Memory limit(0 if unlimited) */
+    enum ttree_evict_policy evict_policy;
+    ttree_item_size_fn item_size;      /**< Item size function(may be NULL) */
+    ttree_evict_fn evict_fn;           /**< Eviction callback(may be NULL) */
+    void *evict_arg;                   /**< An argument passed to evict_fn */
+    TtreeNode *evict_hand;             /**< Next node checked by LRU eviction */
+    size_t num_items;                  /**< Number of items in the tree */
+
+    /**
+     * Maximum number of items(0 if unlimited). Items are evicted from
+     * the evict_side edge of the tree.
+     * @see ttree_set_capacity
+     */
+    size_t max_items;
+    int evict_side;
+
+    /**
+     * A file items of cold nodes are written to(-1 if items are
+     * kept in memory only).
+     * @see ttree_set_spill
+     */
+    int spill_fd;
+    off_t spill_end;                   /**< End of spilled items in the file */
+    ttree_spill_fn spill_fn;           /**< Function writing an item */
+    ttree_fault_fn fault_fn;           /**< Function reading an item */
+    void *spill_arg;                   /**< An argument passed to them */
+    TtreeNode *spill_hand;             /**< Next node checked by spilling */
+
+    /**
+     * Node heat is increased once per heat_sample_rate
+     * lookups(0 if heat isn't tracked).
+     * @see ttree_track_heat
+     */
+    int heat_sample_rate;
+    int heat_tick;                     /**< Lookups since the last sample */
+    bool heat_saturated;               /**< Some node got the maximum heat */
+
+    /**
+     * A sketch counting values of keys of inserted and deleted
+     * items(NULL if quantiles aren't tracked).
+     * @see ttree_track_quantiles
+     */
+    struct ttree_sketch *sketch;
+    ttree_key_value_fn key_value;      /**< Value of a key for the sketch */
+
+    /**
+     * A pool T*-tree nodes are allocated from(NULL if malloc is used).
+     * @see ttree_set_pool
+     */
+    struct ttree_pool *pool;
+
+    /**
+     * Size of key copies kept in T*-tree nodes next to the array of
+     * pointers to keys(0 if keys are reached through pointers only).
+     * @see ttree_pack_keys
+     */
+    size_t packed_key_size;
+
+    /**
+     * Encoder of keys into binary comparable strings kept instead of
+     * copies of keys(NULL if keys are compared by cmp_func only).
+     * @see ttree_encode_keys
+     */
+    ttree_key_encode_fn key_encode;
+
+    /**
+     * True if equal encoded keys mean equal keys. Otherwise encoded
+     * keys are prefixes and cmp_func resolves the ties.
+     */
+    bool encoded_keys_exact;
+
+    /**
+     * Columns of composite keys(NULL if keys aren't composite).
+     * @see ttree_set_key_columns
+     */
+    const struct ttree_key_column *key_columns;
+    int num_key_columns;
+
+    /**
+     * User function searching for a key inside a node(NULL if
+     * binary search with cmp_func is used).
+     * @see ttree_set_rank_fn
+     */
+    ttree_rank_fn rank_fn;
+
+    /**
+     * True if the root of a tree having only one node is kept inside
+     * the tree structure(inline_root).
+     * @see ttree_set_inline_root
+     */
+    bool inlines_root;
+
+    /**
+     * The root node of a tree having only one node if the tree inlines
+     * its root. The node is moved to the heap when the tree grows.
+     */
+    TtreeNode inline_root;
+    void *inline_keys[TTREE_INLINE_NUMKEYS - TNODE_ITEMS_MIN];
 } Ttree;
 
 typedef struct ttree_cursor {
@@ -145,16 +442,41 @@ typedef struct ttree_cursor {
     int idx;              /**< Particular index in a T*-tree node array */
     int side;             /**< T*-tree node side. Used when item is inserted. */
     enum ttree_cursor_state state;
+    struct ttree_cursor *next_cursor; /**< Next registered cursor */
 } TtreeCursor;
 
 /**
- * @brief Get size of T*-tree node in bytes.
+ * @brief A range of keys walked by slices of T*-tree nodes.
+ *
+ * A slice is a run of adjacent keys of one node, so pointers to keys
+ * of the slice(and their packed copies) are contiguous in memory.
+ * @see ttree_range_open
+ */
+typedef struct ttree_range {
+    Ttree *ttree;
+    TtreeNode *tnode;     /**< Node of the next slice(NULL at the end) */
+    int idx;              /**< Index of the first key of the next slice */
+    TtreeNode *end_tnode; /**< Node the range ends in(NULL if it doesn't) */
+    int end_idx;          /**< Index the range ends before in end_tnode */
+} TtreeRange;
+
+/**
+ * @brief Get size of T*-tree node with given number of key rooms in bytes.
+ * @param ttree    - A pointer to Ttree.
+ * @param capacity - Number of key rooms in a node.
+ * @return size of TtreeNode in bytes.
+ */
+#define tnode_size_by_capacity(ttree, capacity)                         \
+    (sizeof(TtreeNode) + ((capacity) - TNODE_ITEMS_MIN) * sizeof(uintptr_t) \
+     + (capacity) * (ttree)->packed_key_size)
+
+/**
+ * @brief Get size of the biggest T*-tree node in bytes.
  * @param ttree - a pointer to Ttree.
  * @return size of TtreeNode in a tree in bytes,
  */
 #define tnode_size(ttree)                                               \
-    (sizeof(TtreeNode) + (ttree->keys_per_tnode - \
-                          TNODE_ITEMS_MIN) * sizeof(uintptr_t))
+    tnode_size_by_capacity(ttree, (ttree)->keys_per_tnode)
 
 #define tnode_num_keys(tnode)                   \
     (((tnode)->max_idx - (tnode)->min_idx) + 1)
@@ -163,7 +485,7 @@ typedef struct ttree_cursor {
     (!tnode_num_keys(tnode))
 
 #define tnode_is_full(ttree, tnode)                     \
-    (tnode_num_keys(tnode) == (ttree)->keys_per_tnode)
+    (tnode_num_keys(tnode) == (tnode)->capacity)
 
 #define ttree_key2item(ttree, key)                  \
     ((void *)((char *)(key) - (ttree)->key_offs))
@@ -174,6 +496,22 @@ typedef struct ttree_cursor {
 #define tnode_key(tnode, idx)                   \
     ((tnode)->keys[(idx)])
 
+/**
+ * @brief Get a copy of a key kept in T*-tree node with packed keys.
+ *
+ * Copies of keys are placed in a dense array after the array of pointers
+ * to keys, so the node's keys may be scanned without touching the items.
+ *
+ * @param ttree - A pointer to Ttree.
+ * @param tnode - A pointer to T*-tree node.
+ * @param idx   - Index of the key in the node.
+ * @return A pointer to the copy of the key.
+ * @see ttree_pack_keys
+ */
+#define tnode_packed_key(ttree, tnode, idx)                             \
+    ((void *)((char *)((tnode)->keys + (tnode)->capacity) +             \
+              (idx) * (ttree)->packed_key_size))
+
 #define tnode_key_min(tnode) tnode_key(tnode, (tnode)->min_idx)
 
 #define tnode_key_max(tnode) tnode_key(tnode, (tnode)->max_idx)
@@ -209,6 +547,10 @@ static __inline int tnode_get_side(TtreeNode *tnode)
 
 /**
  * @brief Initialize new T*-tree.
+ * @warning The structure of a tree inlining its root or having
+ *          registered cursors must not be moved in memory while
+ *          the tree is not empty unless ttree_relocate is called
+ *          for its new copy.
  * @param ttree[out]  - A pointer to T*-tree structure for initialization
  * @param num_keys    - A number of keys per T*-tree node.
  * @param is_unique   - A boolean to determine whether keys must be unique.
@@ -236,13 +578,60 @@ static __inline int tnode_get_side(TtreeNode *tnode)
 int __ttree_init(Ttree *ttree, int num_keys, bool is_unique,
                  ttree_cmp_func_fn cmpf, size_t key_offs);
 
+/**
+ * @brief Initialize new interval T*-tree.
+ *
+ * Items of interval tree are intervals keyed by their start points.
+ * Each T*-tree node keeps the maximum end point of intervals
+ * in its subtree, so the tree may be queried for intervals
+ * overlapping given one in O(log(N) + K) time.
+ * Start and end points must be comparable by @a cmpf.
+ *
+ * @param ttree[out]  - A pointer to T*-tree structure for initialization
+ * @param num_keys    - A number of keys per T*-tree node.
+ * @param is_unique   - A boolean to determine whether keys must be unique.
+ * @param cmpf        - A pointer to user-defined comparison function
+ * @param data_struct - Structure containing an interval.
+ * @param start_field - Name of interval start field(the key) in @a data_struct.
+ * @param end_field   - Name of interval end field in @a data_struct.
+ * @return 0 on success, -1 on error.
+ * @see ttree_overlaps
+ */
+#define ttree_init_intervals(ttree, num_keys, is_unique, cmpf,         \
+                             data_struct, start_field, end_field)       \
+    __ttree_init_intervals(ttree, num_keys, is_unique, cmpf,           \
+                           offsetof(data_struct, start_field),          \
+                           offsetof(data_struct, end_field))
+
+int __ttree_init_intervals(Ttree *ttree, int num_keys, bool is_unique,
+                           ttree_cmp_func_fn cmpf, size_t key_offs,
+                           size_t end_offs);
+
 /**
  * @brief Destroy whole T*-tree
+ *
+ * All cursors registered in the tree become closed and unregistered.
+ *
  * @param ttree - A pointer to tree to destroy.
  * @see ttree_init
  */
 void ttree_destroy(Ttree *ttree);
 
+/**
+ * @brief Fix a T*-tree copied to another place in memory.
+ *
+ * The inline root and registered cursors refer to the tree
+ * structure itself, so a tree moved by memcpy, realloc or assignment
+ * has to be fixed before it is used at the new place. Only the address
+ * of the old copy is used, so it may be already freed. Unregistered
+ * cursors and ranges opened on the old copy become invalid.
+ *
+ * @param ttree - A pointer to the new copy of a tree.
+ * @param old   - The address the tree was located at.
+ * @see ttree_cursor_register
+ */
+void ttree_relocate(Ttree *ttree, const Ttree *old);
+
 /**
  * @fn void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor)
  * @brief Find an item by its key in a tree.
@@ -269,7 +658,8 @@ void *ttree_lookup(Ttree *ttree, void *key, TtreeCursor *cursor);
  *
  * @param ttree - A pointer to a tree.
  * @param item  - A pointer to item that will be inserted.
- * @return 0 if all is ok, negative value if item's key is duplicated.
+ * @return 0 if all is ok, negative value if item's key is duplicated
+ *         (errno is set to EEXIST then).
  */
 int ttree_insert(Ttree *ttree, void *item);
 
@@ -317,6 +707,12 @@ void ttree_insert_at_cursor(TtreeCursor *cursor, void *item);
  * contains target T*-tree node and precise place of item in that node, this information
  * may be used for deletion.
  *
+ * After the item is removed, the cursor points to the item following
+ * the removed one, even if keys were moved between nodes or the node
+ * itself was freed during deletion. So the cursor may be used for
+ * deleting items while iterating without any additional lookups.
+ * If the removed item was the last one, the cursor becomes closed.
+ *
  * @param ttree      - A pointer to a T*-tree item will be removed from.
  * @param tnode_meta - T*-tree node metainformation structure filled by ttree_lookup.
  * @return A pointer to removed item.
@@ -338,14 +734,743 @@ void *ttree_delete_at_cursor(TtreeCursor *cursor);
  */
 int ttree_replace(Ttree *ttree, void *key, void *new_item);
 
+/**
+ * @brief Find all intervals overlapping [@a lo, @a hi].
+ *
+ * Function @a fn is called for each found interval in order of
+ * their start points. A stabbing query may be done by passing
+ * the same point as @a lo and @a hi.
+ *
+ * @param ttree - A pointer to interval T*-tree.
+ * @param lo    - A pointer to the lower bound of searching interval.
+ * @param hi    - A pointer to the upper bound of searching interval.
+ * @param fn    - Function called for each found item(may be NULL).
+ * @param arg   - An argument passed to @a fn.
+ * @return Number of found intervals or -1 if @a ttree is not interval tree.
+ * @see ttree_init_intervals
+ */
+int ttree_overlaps(Ttree *ttree, void *lo, void *hi,
+                   ttree_item_fn fn, void *arg);
+
+/**
+ * @brief Limit the amount of memory used by a T*-tree.
+ *
+ * Memory used by a tree is a size of all its nodes plus sizes of all
+ * its items if @a sizef is specified. When the budget is exceeded after
+ * an item is inserted or replaced, items are removed from the tree
+ * according to the @a policy until the tree fits the budget again:
+ * TTREE_EVICT_LEFT_EDGE removes items with the smallest keys(the oldest
+ * ones if keys are timestamps or sequence numbers), TTREE_EVICT_LRU
+ * removes items from nodes that were not accessed by lookups and
+ * insertions since they were checked last time ("second chance" algorithm).
+ * If all nodes were accessed, items are removed from the node the new
+ * item was inserted to. Each removed item is passed to @a evictf.
+ *
+ * Note that recently inserted item may be evicted too. In this case
+ * a cursor it was inserted by is moved to the following item(or closed).
+ *
+ * @param ttree  - A pointer to a T*-tree.
+ * @param budget - Maximum amount of memory in bytes(0 removes the limit).
+ * @param policy - Eviction policy.
+ * @param sizef  - A function returning size of an item(may be NULL).
+ * @param evictf - A function called for each evicted item(may be NULL).
+ * @param arg    - An argument passed to @a evictf.
+ * @return 0 on success, -1 on error.
+ * @see ttree_mem_usage
+ */
+int ttree_set_budget(Ttree *ttree, size_t budget,
+                     enum ttree_evict_policy policy, ttree_item_size_fn sizef,
+                     ttree_evict_fn evictf, void *arg);
+
+/**
+ * @brief Get the amount of memory used by a T*-tree.
+ * @param ttree - A pointer to a T*-tree.
+ * @return Memory used by tree nodes and items in bytes.
+ * @see ttree_set_budget
+ */
+#define ttree_mem_usage(ttree) ((ttree)->mem_used)
+
+/**
+ * @brief Limit the number of items in a T*-tree.
+ *
+ * It makes the tree keep only @a max_items items with the biggest
+ * (@a side is TNODE_LEFT) or the smallest(@a side is TNODE_RIGHT)
+ * keys, e.g. top-K scores. When an insertion exceeds the capacity,
+ * the item at the @a side edge of the tree is removed and passed to
+ * @a evictf. Items that are already in the tree beyond the capacity
+ * are removed immediately.
+ *
+ * @param ttree     - A pointer to a T*-tree.
+ * @param max_items - Maximum number of items(0 removes the limit).
+ * @param side      - The edge items are evicted from.
+ * @param evictf    - A function called for each evicted item(may be NULL,
+ *                    it replaces the one set by ttree_set_budget).
+ * @param arg       - An argument passed to @a evictf.
+ * @return 0 on success, -1 on error.
+ * @see ttree_insert_bounded
+ */
+int ttree_set_capacity(Ttree *ttree, size_t max_items, int side,
+                       ttree_evict_fn evictf, void *arg);
+
+/**
+ * @brief Insert an item into a T*-tree of limited capacity.
+ *
+ * If the tree is full, an item that wouldn't stay in the tree is
+ * rejected by one comparison with the edge item, without a lookup.
+ * Otherwise the edge item is removed right before the insertion and
+ * returned instead of being passed to the eviction function.
+ *
+ * @param ttree   - A pointer to a T*-tree.
+ * @param item    - A pointer to the item.
+ * @param dropped - Set to the evicted item, to @a item if it was
+ *                  rejected or to NULL if no item was dropped.
+ * @return 0 on success, -1 if the key of @a item is already in
+ *         the tree that keeps keys unique(errno is EEXIST then, no
+ *         item is dropped and the tree isn't changed).
+ * @see ttree_set_capacity
+ */
+int ttree_insert_bounded(Ttree *ttree, void *item, void **dropped);
+
+/**
+ * @brief Let a T*-tree keep items of cold nodes in a file.
+ *
+ * Nodes stay in memory, so lookups search for keys as usual using
+ * copies of keys kept inside nodes, but items of nodes that weren't
+ * accessed for a while may be written to file @a fd by @a spillf
+ * (see ttree_spill_cold). A lookup or a cursor reaching such node
+ * reads its items back by @a faultf. Since keys are compared without
+ * touching items, the tree must have packed keys(ttree_pack_keys) or
+ * exactly encoded ones(ttree_encode_keys) and mustn't be an interval
+ * tree. The offset of a key inside an item must be even.
+ * Items are appended to the file, its space isn't reused.
+ *
+ * @param ttree  - A pointer to an empty T*-tree.
+ * @param fd     - A file descriptor opened for reading and writing.
+ * @param spillf - A function writing an item(NULL turns spilling off).
+ * @param faultf - A function reading an item back.
+ * @param arg    - An argument passed to @a spillf and @a faultf.
+ * @return 0 on success, -1 on error.
+ * @see ttree_spill_cold
+ */
+int ttree_set_spill(Ttree *ttree, int fd, ttree_spill_fn spillf,
+                    ttree_fault_fn faultf, void *arg);
+
+/**
+ * @brief Write items of cold T*-tree nodes to the spill file.
+ *
+ * Nodes are walked in sorted order starting from the node checked last
+ * time. Nodes accessed since previous check get their access marks
+ * cleared, the others have their items spilled("second chance"
+ * algorithm). Nodes registered cursors point to are skipped.
+ * Unregistered cursors must be reopened after items are spilled.
+ * Memory used by spilled items isn't counted by ttree_mem_usage.
+ *
+ * @param ttree     - A pointer to a T*-tree.
+ * @param num_nodes - Maximum number of nodes to spill.
+ * @return Number of spilled items or -1 on error.
+ * @see ttree_set_spill
+ */
+int ttree_spill_cold(Ttree *ttree, int num_nodes);
+
+/**
+ * @brief Keep the only node of a small T*-tree inside the tree structure.
+ *
+ * A tree having no more than TTREE_INLINE_NUMKEYS keys per node and
+ * no copies of keys in nodes doesn't allocate memory until it grows
+ * bigger than one node. The root then points into the tree structure,
+ * so the tree can't be moved by memcpy, realloc or assignment without
+ * ttree_relocate. Trees don't inline their roots by default.
+ *
+ * @param ttree  - A pointer to an empty T*-tree.
+ * @param enable - True if the root is kept inline.
+ * @return 0 on success, -1 on error.
+ * @see ttree_relocate
+ */
+int ttree_set_inline_root(Ttree *ttree, bool enable);
+
+/**
+ * @brief Let T*-tree nodes keep the number of items in their subtrees.
+ *
+ * The counts are updated on each insertion and deletion at the cost of
+ * a walk up to the root. They make ttree_estimate_range exact.
+ * Interval trees can't count items of subtrees.
+ *
+ * @param ttree  - A pointer to an empty T*-tree.
+ * @param enable - True if counts are kept.
+ * @return 0 on success, -1 on error.
+ * @see ttree_estimate_range
+ */
+int ttree_count_subtrees(Ttree *ttree, bool enable);
+
+/**
+ * @brief Estimate the number of items in a range of keys.
+ *
+ * Both bounds are looked up and the number of items preceding them
+ * is calculated by walking up to the root. If the tree counts items
+ * of subtrees, it costs as much as two lookups and the result is
+ * exact(unless keys equal to bounds are duplicated). Otherwise items
+ * of ranges spanning a few nodes are counted exactly. For other ranges
+ * sizes of subtrees are estimated by their heights, scaled so that
+ * the whole tree has ttree_num_items items, which costs a few more
+ * walks between the root and leafs, i.e. it's O(log(N)) still.
+ * There is no bound for the error of such estimation: subtrees of
+ * the same height may differ in size several times. In trees filled
+ * in random order it's usually a few percent of the number of items
+ * in the tree, but may be up to a fifth of it.
+ *
+ * @param ttree - A pointer to a T*-tree.
+ * @param lo    - The lowest key of the range.
+ * @param hi    - The highest key of the range.
+ * @return Approximate number of items with keys in [lo, hi].
+ * @see ttree_count_subtrees
+ */
+size_t ttree_estimate_range(Ttree *ttree, void *lo, void *hi);
+
+/**
+ * @brief Pick random items with keys in a range.
+ *
+ * Each subset of @a num items of the range is equally likely to be
+ * picked(sampling without replacement). If the tree counts items of
+ * subtrees, items are picked by their ranks in O(num * log(N)).
+ * Otherwise the range is walked node by node, skipping over nodes
+ * without touching their items("reservoir sampling" with random skips),
+ * so only nodes of the range are visited.
+ *
+ * @param ttree - A pointer to a T*-tree.
+ * @param lo    - The lowest key of the range(NULL if unbounded).
+ * @param hi    - The highest key of the range(NULL if unbounded).
+ * @param num   - Number of items to pick.
+ * @param rng   - A random numbers generator.
+ * @param arg   - An argument passed to @a rng.
+ * @param out   - An array of @a num items the picked ones are put to
+ *                in no particular order.
+ * @return Number of picked items(less than @a num if the range holds
+ *         fewer items) or -1 on error.
+ * @see ttree_count_subtrees
+ */
+int ttree_sample_range(Ttree *ttree, void *lo, void *hi, int num,
+                       ttree_rand_fn rng, void *arg, void **out);
+
+/**
+ * @brief Open a range of keys for walking it by node slices.
+ * @param range[out] - A pointer to the range.
+ * @param ttree      - A pointer to a T*-tree.
+ * @param lo         - The lowest key of the range(NULL if unbounded).
+ * @param hi         - The highest key of the range(NULL if unbounded).
+ * @see ttree_range_next
+ */
+void ttree_range_open(TtreeRange *range, Ttree *ttree, void *lo, void *hi);
+
+/**
+ * @brief Get the next slice of a range of keys.
+ *
+ * Slices are returned in the order of keys. Unlike a cursor, walking
+ * a range costs nothing per key: callers scan keys from @a first to
+ * @a last of the returned node themselves. Spilled items of the node
+ * are faulted in. The tree mustn't be modified while it's walked.
+ *
+ * @param range      - A pointer to the range.
+ * @param first[out] - Index of the first key of the slice.
+ * @param last[out]  - Index of the last key of the slice.
+ * @return The node of the slice or NULL if the range is over.
+ */
+TtreeNode *ttree_range_next(TtreeRange *range, int *first, int *last);
+
+/**
+ * Offset of a column holding keys of items.
+ * @see ttree_column
+ */
+#define TTREE_COLUMN_KEY ((size_t)-1)
+
+/**
+ * @brief A column of values of a field of items.
+ * @see ttree_range_fetch
+ */
+struct ttree_column {
+    size_t offs;  /**< Offset of the field in an item or TTREE_COLUMN_KEY */
+    size_t width; /**< Size of the field in bytes */
+    void *buf;    /**< Buffer for values of the field, row after row */
+};
+
+/**
+ * @brief Fetch the next batch of items of a range into columns.
+ *
+ * Values of fields of up to @a max_rows items are copied to column
+ * buffers, so the same row of each column belongs to the same item.
+ * Columns are filled slice by slice without per item calls. If nodes
+ * keep raw copies of keys and the key column is as wide as keys, it's
+ * copied from nodes by a slice at once, and items aren't touched
+ * unless other columns are fetched. Batches are fetched until 0 rows
+ * are returned.
+ *
+ * @param range    - A pointer to the range opened by ttree_range_open.
+ * @param cols     - An array of columns.
+ * @param num_cols - Number of columns.
+ * @param max_rows - Maximum number of rows fitting into column buffers.
+ * @return Number of fetched rows or -1 on error.
+ * @see ttree_keys_are_inline
+ */
+int ttree_range_fetch(TtreeRange *range, const struct ttree_column *cols,
+                      int num_cols, int max_rows);
+
+/**
+ * Types of fields compared by built-in predicates.
+ * @see ttree_pred
+ */
+enum ttree_pred_type {
+    TTREE_PRED_INT32 = 0,
+    TTREE_PRED_UINT32,
+    TTREE_PRED_INT64,
+    TTREE_PRED_UINT64,
+    TTREE_PRED_DOUBLE,
+};
+
+/**
+ * Comparisons of built-in predicates: "field op value".
+ * @see ttree_pred
+ */
+enum ttree_pred_op {
+    TTREE_PRED_EQ = 0,
+    TTREE_PRED_NE,
+    TTREE_PRED_LT,
+    TTREE_PRED_LE,
+    TTREE_PRED_GT,
+    TTREE_PRED_GE,
+};
+
+/**
+ * A value of one of ttree_pred_type types.
+ */
+union ttree_value {
+    int32_t i32;
+    uint32_t u32;
+    int64_t i64;
+    uint64_t u64;
+    double d;
+};
+
+/**
+ * @brief A predicate items of a scan are filtered by.
+ *
+ * If @a fn is set, it's called for each item and non-zero return
+ * value passes the item. Otherwise a field of type @a type at offset
+ * @a offs of each item(or the key if @a offs is TTREE_COLUMN_KEY)
+ * is compared with @a value.
+ *
+ * @see ttree_scan_filtered
+ */
+struct ttree_pred {
+    ttree_item_fn fn;           /**< Predicate function or NULL */
+    void *arg;                  /**< An argument passed to @a fn */
+    size_t offs;                /**< Offset of the compared field */
+    enum ttree_pred_type type;  /**< Type of the field */
+    enum ttree_pred_op op;      /**< Comparison */
+    union ttree_value value;    /**< The value the field is compared with */
+};
+
+/**
+ * @brief Pass items of a range matching a predicate to a function.
+ *
+ * The predicate is evaluated for a batch of keys of a node slice in
+ * a tight loop before matching items are passed to @a fn, so items
+ * filtered out cost neither calls of @a fn nor cursor moves. Fields
+ * compared by built-in predicates are gathered into an array and
+ * compared by a loop the compiler may vectorize. Items of nodes with
+ * raw copies of keys aren't touched by key predicates until they pass.
+ *
+ * @param ttree - A pointer to a T*-tree.
+ * @param lo    - The lowest key of the range(NULL if unbounded).
+ * @param hi    - The highest key of the range(NULL if unbounded).
+ * @param pred  - The predicate(NULL passes all items).
+ * @param fn    - Function called for each matching item in the order
+ *                of keys(it may be NULL). Non-zero return value stops
+ *                the scan.
+ * @param arg   - An argument passed to @a fn.
+ * @return Number of matching items passed to @a fn, -1 on error.
+ */
+int ttree_scan_filtered(Ttree *ttree, void *lo, void *hi,
+                        const struct ttree_pred *pred,
+                        ttree_item_fn fn, void *arg);
+
+/**
+ * @brief Aggregates of keys of a range.
+ *
+ * Sums, minimums and maximums of signed keys are kept in i64 fields,
+ * of unsigned keys in u64 fields and of double keys in d fields.
+ * Minimum and maximum are valid only if @a count isn't 0.
+ * Sums of integer keys wrap around modulo 2^64 on overflow, i.e.
+ * the sum is exact if it fits into the field, otherwise only its
+ * lowest 64 bits in two's complement are kept.
+ *
+ * @see ttree_aggregate_range
+ */
+struct ttree_aggregate {
+    size_t count;
+    union ttree_value sum;
+    union ttree_value min;
+    union ttree_value max;
+};
+
+/**
+ * @brief Count keys of a range and find their sum, minimum and maximum.
+ *
+ * Keys must be numbers of type @a type. If nodes keep raw copies of
+ * keys, each node's window of keys is reduced as an array by a loop
+ * without calls, which the compiler may vectorize, and only the two
+ * boundary nodes are reduced partially. Items aren't touched then.
+ * Otherwise keys are gathered from items into an array first.
+ *
+ * @param ttree    - A pointer to a T*-tree.
+ * @param lo       - The lowest key of the range(NULL if unbounded).
+ * @param hi       - The highest key of the range(NULL if unbounded).
+ * @param type     - Type of keys.
+ * @param agg[out] - A pointer to the aggregates.
+ * @return 0 on success, -1 on error.
+ * @see ttree_keys_are_inline
+ */
+int ttree_aggregate_range(Ttree *ttree, void *lo, void *hi,
+                          enum ttree_pred_type type,
+                          struct ttree_aggregate *agg);
+
+/**
+ * @brief Pick @a num random items of a T*-tree.
+ * @see ttree_sample_range
+ */
+#define ttree_sample(ttree, num, rng, arg, out)                 \
+    ttree_sample_range(ttree, NULL, NULL, num, rng, arg, out)
+
+/**
+ * @brief Get the number of items with keys less than a key.
+ *
+ * Position of @a key is found by a lookup and the items preceding it
+ * are counted on the way up to the root, so it takes O(log(N)).
+ *
+ * @param ttree - A pointer to a T*-tree counting items of subtrees.
+ * @param key   - The key.
+ * @return The rank of @a key or -1 on error.
+ * @see ttree_count_subtrees
+ */
+ssize_t ttree_rank(Ttree *ttree, void *key);
+
+/**
+ * @brief Find an item by the number of items preceding it.
+ *
+ * The exact quantile q of a tree is ttree_select(ttree,
+ * q * (ttree_num_items(ttree) - 1)).
+ *
+ * @param ttree - A pointer to a T*-tree counting items of subtrees.
+ * @param rank  - Number of items preceding the item(starting from 0).
+ * @return A pointer to the item or NULL if @a rank is out of range
+ *         or the tree doesn't count items of subtrees.
+ * @see ttree_count_subtrees
+ */
+void *ttree_select(Ttree *ttree, size_t rank);
+
+/**
+ * @brief Get the number of items in a T*-tree.
+ * @param ttree - A pointer to a T*-tree.
+ * @return Number of items.
+ */
+size_t ttree_num_items(Ttree *ttree);
+
+/**
+ * @brief Keep approximate quantiles of keys of a T*-tree.
+ *
+ * Value of the key of each inserted item is counted in @a sketch and
+ * value of the key of each deleted(or evicted) one is removed from it,
+ * so quantiles are got without touching T*-tree nodes. Trees may share
+ * a sketch, then it describes items of all of them. ttree_destroy
+ * doesn't update the sketch, use ttree_sketch_clear.
+ *
+ * @param ttree  - A pointer to an empty T*-tree.
+ * @param sketch - A pointer to an initialized sketch(NULL turns
+ *                 tracking off).
+ * @param valf   - Function returning values of keys.
+ * @return 0 on success, -1 on error.
+ * @see ttree_quantile
+ * @see ttree_sketch_init
+ */
+int ttree_track_quantiles(Ttree *ttree, struct ttree_sketch *sketch,
+                          ttree_key_value_fn valf);
+
+/**
+ * @brief Get an approximate quantile of values of keys of a T*-tree.
+ * @param ttree - A pointer to a T*-tree tracking quantiles.
+ * @param q     - The quantile in [0, 1](0.5 is the median).
+ * @return The value of the quantile or NaN if the tree is empty or
+ *         doesn't track quantiles.
+ * @see ttree_track_quantiles
+ * @see ttree_sketch_quantile
+ */
+double ttree_quantile(Ttree *ttree, double q);
+
+/**
+ * @brief Count lookups hitting each T*-tree node.
+ *
+ * Every @a sample_rate lookup(insertions and deletions look keys up
+ * too) increases the heat of the node it ended in, so counting costs
+ * a counter increment for the rest of them. When a node's heat gets
+ * the maximum value, it stops growing and heat of all nodes is halved
+ * by the next ttree_hot_ranges call, so old accesses weigh less than
+ * recent ones. Lookups never walk the whole tree to decay heat.
+ * Trees that are looked up a lot but rarely asked for hot ranges
+ * may be kept fresh by calling ttree_decay_heat periodically.
+ *
+ * @param ttree       - A pointer to a T*-tree.
+ * @param sample_rate - One of how many lookups is counted(0 turns
+ *                      counting off and clears heat of all nodes).
+ * @return 0 on success, -1 on error.
+ * @see ttree_hot_ranges
+ */
+int ttree_track_heat(Ttree *ttree, int sample_rate);
+
+/**
+ * @brief Halve heat of all T*-tree nodes.
+ * @param ttree - A pointer to a T*-tree.
+ * @see ttree_track_heat
+ */
+void ttree_decay_heat(Ttree *ttree);
+
+/**
+ * @brief Find the hottest ranges of keys of a T*-tree.
+ *
+ * Each range is a set of keys held by one node. Spilled items of
+ * reported nodes are read back to memory. If some node's heat got
+ * the maximum value, heat of all nodes is halved first.
+ *
+ * @param ttree      - A pointer to a T*-tree.
+ * @param ranges     - An array the ranges are put to, the hottest first.
+ * @param num_ranges - Size of @a ranges.
+ * @return Number of found ranges or -1 on error. Ranges that were
+ *         never hit aren't reported.
+ * @see ttree_track_heat
+ */
+int ttree_hot_ranges(Ttree *ttree, struct ttree_heat_range *ranges,
+                     int num_ranges);
+
+/**
+ * @brief Let T*-tree nodes grow as they are filled.
+ *
+ * New nodes are created with @a min_keys key rooms. When a node becomes
+ * full, its capacity is doubled until it reaches the number of keys per
+ * node the tree was initialized with, and only then new nodes are added.
+ * When a node becomes sparse after deletions, its capacity is halved.
+ * Thus the memory used by a tree follows the density of its keys.
+ *
+ * @param ttree    - A pointer to an empty T*-tree.
+ * @param min_keys - Number of key rooms in new nodes.
+ * @return 0 on success, -1 on error.
+ * @see ttree_init
+ */
+int ttree_set_node_growth(Ttree *ttree, int min_keys);
+
+/**
+ * @brief Set the number of key rooms in internal T*-tree nodes.
+ *
+ * By default all nodes have the same size. Making internal nodes
+ * smaller than leaf and half-leaf ones keeps the nodes a lookup
+ * passes through compact while leafs remain dense. When an internal
+ * node gets more keys than it can hold, the biggest of them are moved
+ * down to its successor. Nodes become internal or stop being internal
+ * because of rotations, so the size of a node is adjusted lazily:
+ * when a key is inserted into it or it becomes sparse.
+ *
+ * @param ttree    - A pointer to an empty T*-tree.
+ * @param num_keys - Number of key rooms in internal nodes. It must not
+ *                   be less than the number of keys in new nodes.
+ * @return 0 on success, -1 on error.
+ * @see ttree_init
+ * @see ttree_set_node_growth
+ */
+int ttree_set_internal_node_size(Ttree *ttree, int num_keys);
+
+/**
+ * @brief Set how strictly a T*-tree is balanced.
+ *
+ * By default(unless TTREE_DEFAULT_IMBALANCE is redefined) trees are
+ * AVL-balanced: heights of subtrees of any node differ no more than
+ * by 1. Allowing bigger difference makes the tree a bit higher: up to
+ * ~1.8 log2(N) nodes for 2(close to red-black trees) and ~2.2 log2(N)
+ * for 3 against ~1.44 log2(N) of AVL. But insertions and deletions
+ * cause fewer rotations and deletions stop climbing up to the root
+ * earlier. Ttree::num_rotations counts rotations, so
+ * the policies may be compared on the actual workload.
+ *
+ * @param ttree         - A pointer to an empty T*-tree.
+ * @param max_imbalance - Maximum difference of heights of subtrees of
+ *                        a node(1 to TTREE_MAX_IMBALANCE).
+ * @return 0 on success, -1 on error.
+ */
+int ttree_set_balance(Ttree *ttree, int max_imbalance);
+
+/**
+ * @brief Check if T*-tree nodes keep raw copies of keys.
+ *
+ * Copies of keys of adjacent indices of a node are contiguous, so
+ * a slice of a node is an array of keys.
+ *
+ * @param ttree - A pointer to a T*-tree.
+ * @see ttree_pack_keys
+ */
+#define ttree_keys_are_inline(ttree)                                    \
+    ((ttree)->packed_key_size && !(ttree)->key_encode &&                \
+     !(ttree)->key_columns)
+
+/**
+ * @brief Keep copies of keys inside T*-tree nodes.
+ *
+ * Each node gets a dense array of fixed size key copies parallel to its
+ * array of pointers to keys. Lookups compare the search key with the
+ * copies, so they don't touch items stored in a tree until the item is
+ * found. It's useful when keys are small and items are spread over
+ * memory. The key of an item mustn't be changed while the item is in
+ * a tree.
+ *
+ * @param ttree    - A pointer to an empty T*-tree.
+ * @param key_size - Size of a key in bytes(usually sizeof of the key type).
+ *                   0 turns copies of keys off.
+ * @return 0 on success, -1 on error.
+ * @see tnode_packed_key
+ */
+int ttree_pack_keys(Ttree *ttree, size_t key_size);
+
+/**
+ * @brief Compare T*-tree keys as binary comparable strings.
+ *
+ * Nodes keep keys encoded by @a encf instead of key copies. A search key
+ * is encoded once per lookup, then it's compared with node's keys by
+ * memcmp without calling cmp_func. If @a exact is false, encoded keys are
+ * just prefixes of keys(e.g. the first bytes of a string), so cmp_func
+ * is called for keys whose prefixes are equal.
+ *
+ * @param ttree    - A pointer to an empty T*-tree.
+ * @param encf     - A function encoding keys, NULL turns encoding off.
+ * @param key_size - Size of an encoded key in bytes. It mustn't be greater
+ *                   than TTREE_ENCODED_KEY_MAX.
+ * @param exact    - True if equal encoded keys are always equal keys.
+ * @return 0 on success, -1 on error.
+ * @see ttree_pack_keys
+ */
+int ttree_encode_keys(Ttree *ttree, ttree_key_encode_fn encf,
+                      size_t key_size, bool exact);
+
+/**
+ * @brief Describe T*-tree keys as tuples of columns.
+ *
+ * Keys are compared column by column in the given order, each column
+ * in its own direction. The tree encodes columns of a key into
+ * a binary comparable string and keeps it in nodes, so keys are
+ * compared by memcmp and the tree's cmp_func isn't called at all.
+ * Total size of columns mustn't be greater than TTREE_ENCODED_KEY_MAX.
+ *
+ * @param ttree    - A pointer to an empty T*-tree.
+ * @param cols     - An array of columns. It isn't copied, so it must be
+ *                   valid while the tree is used.
+ * @param num_cols - Number of columns in @a cols.
+ * @return 0 on success, -1 on error.
+ * @see ttree_scan_prefix
+ */
+int ttree_set_key_columns(Ttree *ttree, const struct ttree_key_column *cols,
+                          int num_cols);
+
+/**
+ * @brief Find all items whose keys start with the same columns as @a key.
+ *
+ * Items are passed to @a fn in the order of their keys. Only first
+ * @a num_cols columns of @a key are used, e.g. all rows of a tenant may
+ * be found in a tree keyed by (tenant, timestamp, id) tuples.
+ *
+ * @param ttree    - A pointer to a T*-tree with composite keys.
+ * @param key      - A key whose leading columns are searched.
+ * @param num_cols - Number of leading columns to match.
+ * @param fn       - Function called for each found item(it may be NULL).
+ *                   Non-zero return value stops the scan.
+ * @param arg      - An argument passed to @a fn.
+ * @return Number of items passed to @a fn, -1 on error.
+ * @see ttree_set_key_columns
+ */
+int ttree_scan_prefix(Ttree *ttree, void *key, int num_cols,
+                      ttree_item_fn fn, void *arg);
+
+/**
+ * @brief Search for keys inside T*-tree nodes by user function.
+ *
+ * Instead of binary search calling cmp_func for each probe, a lookup
+ * passes the whole window of keys of the node the key belongs to
+ * to @a rankf. The function may compare the key with all of them at
+ * once, e.g. by SIMD instructions for its key type. Then the key is
+ * compared with the only key found by @a rankf to check if it's equal.
+ * The function isn't used if encoded keys are prefixes of keys.
+ * Like other modes of searching keys, it's set for an empty tree.
+ *
+ * @param ttree - A pointer to an empty T*-tree.
+ * @param rankf - A function ranking keys, NULL turns binary search back.
+ * @return 0 on success, -1 if the tree isn't empty(errno is EBUSY).
+ * @see ttree_pack_keys
+ * @see ttree_encode_keys
+ */
+int ttree_set_rank_fn(Ttree *ttree, ttree_rank_fn rankf);
+
+/**
+ * @brief Allocate T*-tree nodes from the pool @a pool.
+ *
+ * The same pool may be shared by many trees, even if they have
+ * different number of keys per node.
+ *
+ * @param ttree - A pointer to an empty T*-tree.
+ * @param pool  - A pointer to initialized pool(NULL to use malloc).
+ * @return 0 on success, -1 if the tree is not empty.
+ * @see ttree_pool_init
+ */
+int ttree_set_pool(Ttree *ttree, struct ttree_pool *pool);
+
 int ttree_cursor_open_on_node(TtreeCursor *cusrsor, Ttree *tree,
                               TtreeNode *tnode, enum tnode_seek seek);
 int ttree_cursor_open(TtreeCursor *cursor, Ttree *ttree);
+int ttree_cursor_first(TtreeCursor *cursor);
+int ttree_cursor_last(TtreeCursor *cursor);
 int ttree_cursor_next(TtreeCursor *cursor);
 int ttree_cursor_prev(TtreeCursor *cursor);
 
-#define ttree_cursor_copy(csr_dst, csr_src)         \
-    memcpy(csr_dst, csr_src, sizeof(*(csr_src)))
+/**
+ * @brief Register the cursor in its T*-tree.
+ *
+ * Registered cursor pointing to an item stays on that item when other
+ * items are inserted or removed, even if the item is moved to another
+ * T*-tree node. If the item itself is removed, the cursor is moved
+ * to the following one (or closed if there is no such item). Thus
+ * a paginated scan may be resumed by a single ttree_cursor_next without
+ * looking the position up again.
+ * Pending cursors (filled by ttree_lookup for an absent key) are
+ * closed by any modification made by another cursor.
+ *
+ * @param cursor - A pointer to opened cursor.
+ * @return 0 on success, -1 if cursor is already registered.
+ * @see ttree_cursor_unregister
+ */
+int ttree_cursor_register(TtreeCursor *cursor);
+
+/**
+ * @brief Remove the cursor from the list of registered ones.
+ * @param cursor - A pointer to registered cursor.
+ * @return 0 on success, -1 if cursor was not registered.
+ * @see ttree_cursor_register
+ */
+int ttree_cursor_unregister(TtreeCursor *cursor);
+
+/**
+ * @brief Copy the position of a cursor to another cursor.
+ *
+ * If @a csr_dst is registered in the tree of @a csr_src, it stays
+ * registered. Otherwise the copy isn't registered even if @a csr_src
+ * is, so @a csr_dst may be an uninitialized cursor.
+ *
+ * @param csr_dst - A pointer to the destination cursor.
+ * @param csr_src - A pointer to the source cursor.
+ * @return @a csr_dst.
+ */
+TtreeCursor *ttree_cursor_copy(TtreeCursor *csr_dst,
+                               const TtreeCursor *csr_src);
 
 static __inline void *ttree_key_from_cursor(TtreeCursor *cursor)
 {
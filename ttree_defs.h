@@ -37,6 +37,17 @@
  */
 #define TTREE_DEFAULT_NUMKEYS 8
 
+/**
+ * Maximum number of keys per T*-tree node when the only
+ * node of a tree is kept inside the tree structure.
+ */
+#define TTREE_INLINE_NUMKEYS TTREE_DEFAULT_NUMKEYS
+
+/**
+ * Maximum size of a key encoded into a binary comparable string.
+ */
+#define TTREE_ENCODED_KEY_MAX 64
+
 /**
  * Minimum allowed number of keys per T*-tree node
  */
@@ -47,6 +58,19 @@
  */
 #define TNODE_ITEMS_MAX 4096
 
+/**
+ * Maximum allowed difference of heights of subtrees of T*-tree node
+ */
+#define TTREE_MAX_IMBALANCE 3
+
+/**
+ * Default difference of heights of subtrees of T*-tree node
+ * (1 means AVL balancing)
+ */
+#ifndef TTREE_DEFAULT_IMBALANCE
+#define TTREE_DEFAULT_IMBALANCE 1
+#endif /* !TTREE_DEFAULT_IMBALANCE */
+
 #define TTREE_ASSERT(cond) assert(cond)
 
 /**
@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file ttree_dir.c
+ * @brief Radix directory of T*-trees implementation.
+ *
+ * The directory has exactly prefix_len levels. Children of nodes of
+ * the last level are T*-trees, children of other nodes are directory
+ * nodes. Keys shorter than the prefix have zero bytes after their end,
+ * and trees for such prefixes compare keys from the terminating NUL.
+ * Empty trees and directory nodes are freed immediately, so each
+ * directory node has at least one child.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ttree_dir.h"
+
+#define SET_ERRNO(err) errno = (err)
+
+struct tdir_node {
+    int num_children;
+    bool is_dense;
+    unsigned char bytes[TDIR_SPARSE_MAX]; /* Sorted bytes of sparse node */
+    void *children[1];
+};
+
+#define tdir_node_size(is_dense)                                        \
+    (offsetof(struct tdir_node, children) +                             \
+     ((is_dense) ? 256 : TDIR_SPARSE_MAX) * sizeof(void *))
+
+#define tdir_last_level(dir, depth)             \
+    ((depth) == (dir)->prefix_len - 1)
+
+static struct tdir_node *tdir_alloc_node(bool is_dense)
+{
+    struct tdir_node *node = calloc(1, tdir_node_size(is_dense));
+
+    if (node) {
+        node->is_dense = is_dense;
+    }
+
+    return node;
+}
+
+/* Get the position of a byte in sparse node's arrays. */
+static int tdir_sparse_pos(struct tdir_node *node, int byte)
+{
+    int i;
+
+    for (i = 0; (i < node->num_children) && (node->bytes[i] < byte); i++);
+    return i;
+}
+
+static void *tdir_get_child(struct tdir_node *node, int byte)
+{
+    int i;
+
+    if (node->is_dense) {
+        return node->children[byte];
+    }
+
+    i = tdir_sparse_pos(node, byte);
+    if ((i < node->num_children) && (node->bytes[i] == byte)) {
+        return node->children[i];
+    }
+
+    return NULL;
+}
+
+static void tdir_set_child(struct tdir_node *node, int byte, void *child)
+{
+    if (node->is_dense) {
+        node->children[byte] = child;
+    }
+    else {
+        node->children[tdir_sparse_pos(node, byte)] = child;
+    }
+}
+
+/* Get the smallest byte not less than "byte" having a child, or -1. */
+static int tdir_next_byte(struct tdir_node *node, int byte)
+{
+    int i;
+
+    if (node->is_dense) {
+        for (i = byte; (i < 256) && !node->children[i]; i++);
+        return (i < 256) ? i : -1;
+    }
+
+    i = tdir_sparse_pos(node, byte);
+    return (i < node->num_children) ? node->bytes[i] : -1;
+}
+
+/*
+ * Add new child to a node. A sparse node having no free rooms
+ * is replaced by a dense one.
+ */
+static int tdir_add_child(struct tdir_node **nodep, int byte, void *child)
+{
+    struct tdir_node *node = *nodep;
+    int i;
+
+    if (!node->is_dense && (node->num_children == TDIR_SPARSE_MAX)) {
+        struct tdir_node *dense = tdir_alloc_node(true);
+
+        if (!dense) {
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+        for (i = 0; i < node->num_children; i++) {
+            dense->children[node->bytes[i]] = node->children[i];
+        }
+
+        dense->num_children = node->num_children;
+        free(node);
+        *nodep = node = dense;
+    }
+    if (node->is_dense) {
+        node->children[byte] = child;
+    }
+    else {
+        i = tdir_sparse_pos(node, byte);
+        memmove(node->bytes + i + 1, node->bytes + i,
+                node->num_children - i);
+        memmove(node->children + i + 1, node->children + i,
+                sizeof(void *) * (node->num_children - i));
+        node->bytes[i] = byte;
+        node->children[i] = child;
+    }
+
+    node->num_children++;
+    return 0;
+}
+
+/*
+ * Remove a child from a node. A dense node having few children
+ * is replaced by a sparse one, an empty node is freed.
+ */
+static void tdir_remove_child(struct tdir_node **nodep, int byte)
+{
+    struct tdir_node *node = *nodep;
+    int i;
+
+    if (--node->num_children == 0) {
+        free(node);
+        *nodep = NULL;
+        return;
+    }
+    if (!node->is_dense) {
+        i = tdir_sparse_pos(node, byte);
+        memmove(node->bytes + i, node->bytes + i + 1,
+                node->num_children - i);
+        memmove(node->children + i, node->children + i + 1,
+                sizeof(void *) * (node->num_children - i));
+        return;
+    }
+
+    node->children[byte] = NULL;
+    if (node->num_children <= (TDIR_SPARSE_MAX >> 1)) {
+        struct tdir_node *sparse = tdir_alloc_node(false);
+
+        if (!sparse) {
+            return; /* Dense node works as well */
+        }
+        for (i = 0; i < 256; i++) {
+            if (node->children[i]) {
+                sparse->bytes[sparse->num_children] = i;
+                sparse->children[sparse->num_children++] = node->children[i];
+            }
+        }
+
+        free(node);
+        *nodep = sparse;
+    }
+}
+
+/*
+ * Get leading bytes of a key the directory is indexed by. Bytes after
+ * the end of a short key are zeros. Returns the length of the prefix
+ * the tree holding the key strips off.
+ */
+static int tdir_key_prefix(TtreeDir *dir, const char *key,
+                           unsigned char *prefix)
+{
+    int i, len = dir->prefix_len;
+
+    for (i = 0; i < dir->prefix_len; i++) {
+        if ((len == dir->prefix_len) && !key[i]) {
+            len = i;
+        }
+
+        prefix[i] = (i < len) ? key[i] : 0;
+    }
+
+    return len;
+}
+
+/* Free a directory node of given depth and all its descendants. */
+static void tdir_free(TtreeDir *dir, struct tdir_node *node, int depth)
+{
+    int byte;
+    void *child;
+
+    for (byte = tdir_next_byte(node, 0); byte >= 0;
+         byte = (byte < 255) ? tdir_next_byte(node, byte + 1) : -1) {
+        child = tdir_get_child(node, byte);
+        if (tdir_last_level(dir, depth)) {
+            ttree_destroy(child);
+            free(child);
+        }
+        else {
+            tdir_free(dir, child, depth + 1);
+        }
+    }
+
+    free(node);
+}
+
+static int tdir_insert(TtreeDir *dir, struct tdir_node **nodep, int depth,
+                       unsigned char *prefix, int len, void *item)
+{
+    void *child;
+    int ret = -1;
+
+    if (!*nodep && !(*nodep = tdir_alloc_node(false))) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    child = tdir_get_child(*nodep, prefix[depth]);
+    if (tdir_last_level(dir, depth)) {
+        Ttree *ttree = child;
+
+        if (!ttree) {
+            ttree = malloc(sizeof(*ttree));
+            if (!ttree) {
+                SET_ERRNO(ENOMEM);
+                goto out;
+            }
+
+            __ttree_init(ttree, dir->keys_per_tnode, dir->keys_are_unique,
+                         dir->cmp_func, dir->key_offs + len);
+            if (tdir_add_child(nodep, prefix[depth], ttree) < 0) {
+                free(ttree);
+                goto out;
+            }
+        }
+
+        return ttree_insert(ttree, item);
+    }
+    if (child) {
+        ret = tdir_insert(dir, (struct tdir_node **)&child, depth + 1,
+                          prefix, len, item);
+        tdir_set_child(*nodep, prefix[depth], child);
+        return ret;
+    }
+
+    ret = tdir_insert(dir, (struct tdir_node **)&child, depth + 1,
+                      prefix, len, item);
+    if (child && (tdir_add_child(nodep, prefix[depth], child) < 0)) {
+        tdir_free(dir, child, depth + 1);
+        ret = -1;
+    }
+
+out:
+    if (!(*nodep)->num_children) {
+        free(*nodep);
+        *nodep = NULL;
+    }
+
+    return ret;
+}
+
+static void *tdir_delete(TtreeDir *dir, struct tdir_node **nodep, int depth,
+                         unsigned char *prefix, const char *suffix)
+{
+    void *child, *item;
+
+    child = tdir_get_child(*nodep, prefix[depth]);
+    if (!child) {
+        return NULL;
+    }
+    if (tdir_last_level(dir, depth)) {
+        item = ttree_delete(child, (void *)suffix);
+        if (item && ttree_is_empty((Ttree *)child)) {
+            ttree_destroy(child);
+            free(child);
+            tdir_remove_child(nodep, prefix[depth]);
+        }
+
+        return item;
+    }
+
+    item = tdir_delete(dir, (struct tdir_node **)&child, depth + 1,
+                       prefix, suffix);
+    if (!child) {
+        tdir_remove_child(nodep, prefix[depth]);
+    }
+    else {
+        tdir_set_child(*nodep, prefix[depth], child);
+    }
+
+    return item;
+}
+
+/* Find the tree with the smallest prefix in a subtree of the directory. */
+static Ttree *tdir_leftmost(TtreeDir *dir, struct tdir_node *node,
+                            int depth, unsigned char *prefix)
+{
+    for (; depth < dir->prefix_len; depth++) {
+        prefix[depth] = tdir_next_byte(node, 0);
+        node = tdir_get_child(node, prefix[depth]);
+    }
+
+    return (Ttree *)node;
+}
+
+/*
+ * Find the tree with the smallest prefix greater than "prefix". The
+ * prefix is replaced by the found one.
+ */
+static Ttree *tdir_next(TtreeDir *dir, struct tdir_node *node, int depth,
+                        unsigned char *prefix)
+{
+    Ttree *ttree;
+    int byte;
+
+    for (byte = tdir_next_byte(node, prefix[depth]); byte >= 0;
+         byte = (byte < 255) ? tdir_next_byte(node, byte + 1) : -1) {
+        if (byte == prefix[depth]) {
+            if (!tdir_last_level(dir, depth)) {
+                ttree = tdir_next(dir, tdir_get_child(node, byte),
+                                  depth + 1, prefix);
+                if (ttree) {
+                    return ttree;
+                }
+            }
+
+            continue;
+        }
+
+        prefix[depth] = byte;
+        if (tdir_last_level(dir, depth)) {
+            return tdir_get_child(node, byte);
+        }
+
+        return tdir_leftmost(dir, tdir_get_child(node, byte), depth + 1,
+                             prefix);
+    }
+
+    return NULL;
+}
+
+int __ttree_dir_init(TtreeDir *dir, int prefix_len, int num_keys,
+                     bool is_unique, ttree_cmp_func_fn cmpf, size_t key_offs)
+{
+    if ((prefix_len <= 0) || (prefix_len > TTREE_DIR_PREFIX_MAX) ||
+        (num_keys < TNODE_ITEMS_MIN) || (num_keys > TNODE_ITEMS_MAX) ||
+        !cmpf) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    dir->root = NULL;
+    dir->prefix_len = prefix_len;
+    dir->keys_per_tnode = num_keys;
+    dir->keys_are_unique = is_unique;
+    dir->cmp_func = cmpf;
+    dir->key_offs = key_offs;
+    dir->num_items = 0;
+    return 0;
+}
+
+void ttree_dir_destroy(TtreeDir *dir)
+{
+    if (dir->root) {
+        tdir_free(dir, dir->root, 0);
+    }
+
+    dir->root = NULL;
+    dir->num_items = 0;
+}
+
+int ttree_dir_insert(TtreeDir *dir, void *item)
+{
+    unsigned char prefix[TTREE_DIR_PREFIX_MAX];
+    int len;
+
+    len = tdir_key_prefix(dir, (char *)item + dir->key_offs, prefix);
+    if (tdir_insert(dir, &dir->root, 0, prefix, len, item) < 0) {
+        return -1;
+    }
+
+    dir->num_items++;
+    return 0;
+}
+
+static Ttree *tdir_find(TtreeDir *dir, unsigned char *prefix)
+{
+    struct tdir_node *node = dir->root;
+    int depth;
+
+    for (depth = 0; node && (depth < dir->prefix_len); depth++) {
+        node = tdir_get_child(node, prefix[depth]);
+    }
+
+    return (Ttree *)node;
+}
+
+Ttree *ttree_dir_find_tree(TtreeDir *dir, const char *key)
+{
+    unsigned char prefix[TTREE_DIR_PREFIX_MAX];
+
+    tdir_key_prefix(dir, key, prefix);
+    return tdir_find(dir, prefix);
+}
+
+void *ttree_dir_lookup(TtreeDir *dir, const char *key)
+{
+    unsigned char prefix[TTREE_DIR_PREFIX_MAX];
+    Ttree *ttree;
+    int len;
+
+    len = tdir_key_prefix(dir, key, prefix);
+    ttree = tdir_find(dir, prefix);
+    if (!ttree) {
+        return NULL;
+    }
+
+    return ttree_lookup(ttree, (void *)(key + len), NULL);
+}
+
+void *ttree_dir_delete(TtreeDir *dir, const char *key)
+{
+    unsigned char prefix[TTREE_DIR_PREFIX_MAX];
+    void *item;
+    int len;
+
+    if (!dir->root) {
+        return NULL;
+    }
+
+    len = tdir_key_prefix(dir, key, prefix);
+    item = tdir_delete(dir, &dir->root, 0, prefix, key + len);
+    if (item) {
+        dir->num_items--;
+    }
+
+    return item;
+}
+
+int ttree_dir_cursor_first(TtreeDirCursor *cursor, TtreeDir *dir)
+{
+    Ttree *ttree;
+
+    cursor->dir = dir;
+    if (!dir->root) {
+        return TCSR_END;
+    }
+
+    ttree = tdir_leftmost(dir, dir->root, 0, cursor->prefix);
+    ttree_cursor_open(&cursor->cursor, ttree);
+    return ttree_cursor_first(&cursor->cursor);
+}
+
+int ttree_dir_cursor_next(TtreeDirCursor *cursor)
+{
+    Ttree *ttree;
+
+    if (ttree_cursor_next(&cursor->cursor) == TCSR_OK) {
+        return TCSR_OK;
+    }
+
+    ttree = tdir_next(cursor->dir, cursor->dir->root, 0, cursor->prefix);
+    if (!ttree) {
+        return TCSR_END;
+    }
+
+    ttree_cursor_open(&cursor->cursor, ttree);
+    return ttree_cursor_first(&cursor->cursor);
+}
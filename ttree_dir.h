@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file ttree_dir.h
+ * @brief Radix directory of T*-trees keyed by string prefixes.
+ *
+ * String keys sharing a few leading bytes are kept in the same T*-tree,
+ * and trees are found by a small radix directory indexed by those bytes.
+ * Each tree compares only suffixes of keys following the prefix, so
+ * lookups pass through fewer nodes and compare shorter strings.
+ * Directory nodes having few children keep them in a sorted array,
+ * nodes with many children index them by a byte directly.
+ * Keys must be NUL terminated arrays of chars inside items.
+ */
+
+#ifndef __TTREE_DIR_H__
+#define __TTREE_DIR_H__
+
+#include "ttree.h"
+
+/**
+ * Maximum number of leading bytes of keys a directory is indexed by.
+ */
+#define TTREE_DIR_PREFIX_MAX 8
+
+/**
+ * Maximum number of children of a sparse directory node.
+ * Nodes with more children are dense.
+ */
+#define TDIR_SPARSE_MAX 16
+
+struct tdir_node;
+
+/**
+ * @brief Directory of T*-trees.
+ */
+typedef struct ttree_dir {
+    struct tdir_node *root;     /**< Root node of the directory */
+    int prefix_len;             /**< Number of bytes keys are indexed by */
+    int keys_per_tnode;         /**< Number of keys per T*-trees node */
+    bool keys_are_unique;       /**< True if keys must be unique */
+    ttree_cmp_func_fn cmp_func; /**< Function comparing suffixes of keys */
+    size_t key_offs;            /**< Offset of a key inside an item */
+    size_t num_items;           /**< Total number of items in trees */
+} TtreeDir;
+
+/**
+ * @brief Cursor iterating over all items of a directory in key order.
+ */
+typedef struct ttree_dir_cursor {
+    TtreeDir *dir;
+    unsigned char prefix[TTREE_DIR_PREFIX_MAX]; /**< Prefix of the tree */
+    TtreeCursor cursor;                         /**< Cursor inside the tree */
+} TtreeDirCursor;
+
+/**
+ * @brief Initialize a directory of T*-trees.
+ * @param dir         - A pointer to the directory.
+ * @param prefix_len  - Number of leading bytes of keys trees are found by.
+ * @param num_keys    - Number of keys per T*-tree node.
+ * @param is_unique   - True if keys must be unique.
+ * @param cmpf        - Function comparing keys without their prefixes,
+ *                      e.g. a wrapper of strcmp.
+ * @param data_struct - Type of items.
+ * @param key_field   - Name of a key field(array of chars) in @a data_struct.
+ * @return 0 on success, -1 on error.
+ * @see ttree_init
+ */
+#define ttree_dir_init(dir, prefix_len, num_keys, is_unique, cmpf,      \
+                       data_struct, key_field)                          \
+    __ttree_dir_init(dir, prefix_len, num_keys, is_unique, cmpf,        \
+                     offsetof(data_struct, key_field))
+
+int __ttree_dir_init(TtreeDir *dir, int prefix_len, int num_keys,
+                     bool is_unique, ttree_cmp_func_fn cmpf, size_t key_offs);
+
+/**
+ * @brief Destroy a directory and all its trees. Items aren't freed.
+ * @param dir - A pointer to the directory.
+ */
+void ttree_dir_destroy(TtreeDir *dir);
+
+/**
+ * @brief Insert an item into a directory.
+ * @param dir  - A pointer to the directory.
+ * @param item - An item to insert.
+ * @return 0 on success, -1 if the item with the same key exists in
+ *         a directory of unique keys or memory can't be allocated.
+ */
+int ttree_dir_insert(TtreeDir *dir, void *item);
+
+/**
+ * @brief Find an item by its key.
+ * @param dir - A pointer to the directory.
+ * @param key - A NUL terminated string.
+ * @return The item or NULL if it isn't found.
+ */
+void *ttree_dir_lookup(TtreeDir *dir, const char *key);
+
+/**
+ * @brief Remove an item from a directory by its key.
+ *
+ * A tree becoming empty is freed and removed from the directory.
+ *
+ * @param dir - A pointer to the directory.
+ * @param key - A NUL terminated string.
+ * @return Removed item or NULL if it isn't found.
+ */
+void *ttree_dir_delete(TtreeDir *dir, const char *key);
+
+/**
+ * @brief Find a tree holding keys with the same prefix as @a key.
+ * @param dir - A pointer to the directory.
+ * @param key - A NUL terminated string.
+ * @return The tree or NULL if there are no such keys.
+ */
+Ttree *ttree_dir_find_tree(TtreeDir *dir, const char *key);
+
+/**
+ * @brief Position a cursor at the item with the smallest key.
+ *
+ * Cursors don't follow modifications of a directory, so a cursor
+ * mustn't be used after the directory is modified.
+ *
+ * @param cursor - A pointer to the cursor.
+ * @param dir    - A pointer to the directory.
+ * @return TCSR_OK if the cursor points to an item, TCSR_END if
+ *         the directory is empty.
+ */
+int ttree_dir_cursor_first(TtreeDirCursor *cursor, TtreeDir *dir);
+
+/**
+ * @brief Move a cursor to the next item in key order.
+ *
+ * Items of the next tree follow the items of the current one.
+ *
+ * @param cursor - A pointer to the cursor.
+ * @return TCSR_OK if the cursor points to an item, TCSR_END if
+ *         there are no more items.
+ */
+int ttree_dir_cursor_next(TtreeDirCursor *cursor);
+
+/**
+ * @brief Get an item a directory cursor points to.
+ * @param dcursor - A pointer to the cursor.
+ */
+#define ttree_dir_item_from_cursor(dcursor)     \
+    ttree_item_from_cursor(&(dcursor)->cursor)
+
+#define ttree_dir_num_items(dir) ((dir)->num_items)
+
+#define ttree_dir_is_empty(dir) (!(dir)->root)
+
+#endif /* !__TTREE_DIR_H__ */
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_export.c
+ * @brief Streaming export of T*-tree ranges implementation.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "ttree_export.h"
+
+#define SET_ERRNO(err) errno = (err)
+
+struct texport {
+    int fd;
+    bool splice;
+    struct iovec iovs[TEXPORT_NUM_IOVS];
+    int num_iovs;
+    char *buf;                  /* Buffer items are encoded to */
+    size_t pos;                 /* Free space of the buffer starts here */
+};
+
+/*
+ * Write all gathered pieces. Pipes may take only a part of them,
+ * the rest is written by the following calls.
+ */
+static int flush_iovs(struct texport *ex)
+{
+    struct iovec *iov = ex->iovs;
+    int num = ex->num_iovs;
+    ssize_t ret;
+
+    while (num > 0) {
+#ifdef __linux__
+        if (ex->splice) {
+            ret = vmsplice(ex->fd, iov, num, 0);
+        }
+        else
+#endif /* __linux__ */
+        ret = writev(ex->fd, iov, num);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        while (num && ((size_t)ret >= iov->iov_len)) {
+            ret -= iov->iov_len;
+            iov++;
+            num--;
+        }
+        if (num) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    ex->num_iovs = 0;
+    return 0;
+}
+
+static int add_iov(struct texport *ex, void *base, size_t len)
+{
+    struct iovec *last = ex->iovs + ex->num_iovs - 1;
+
+    /* Adjacent pieces(e.g. items encoded one by one) are merged. */
+    if (ex->num_iovs && ((char *)last->iov_base + last->iov_len == base)) {
+        last->iov_len += len;
+        return 0;
+    }
+    if ((ex->num_iovs == TEXPORT_NUM_IOVS) && (flush_iovs(ex) < 0)) {
+        return -1;
+    }
+
+    ex->iovs[ex->num_iovs].iov_base = base;
+    ex->iovs[ex->num_iovs].iov_len = len;
+    ex->num_iovs++;
+    return 0;
+}
+
+static int add_item(struct texport *ex, void *item,
+                    ttree_export_fn encf, void *arg)
+{
+    ssize_t ret;
+
+    for (;;) {
+        ret = encf(item, ex->buf + ex->pos, TEXPORT_BUF_SIZE - ex->pos, arg);
+        if (ret < 0) {
+            return -1;
+        }
+        if ((size_t)ret <= TEXPORT_BUF_SIZE - ex->pos) {
+            break;
+        }
+
+        /* The buffer is reused when all pieces are written. */
+        if (!ex->pos) {
+            SET_ERRNO(E2BIG);
+            return -1;
+        }
+        if (flush_iovs(ex) < 0) {
+            return -1;
+        }
+
+        ex->pos = 0;
+    }
+    if (ret && (add_iov(ex, ex->buf + ex->pos, ret) < 0)) {
+        return -1;
+    }
+
+    ex->pos += ret;
+    return 0;
+}
+
+ssize_t ttree_export_range(Ttree *ttree, int fd, void *lo, void *hi,
+                           int flags, ttree_export_fn encf, void *arg)
+{
+    struct texport ex;
+    struct stat st;
+    TtreeRange range;
+    TtreeNode *tnode;
+    ssize_t num_items = 0;
+    int first, last, i;
+
+    if ((fd < 0) || (!encf && !ttree_keys_are_inline(ttree))) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    memset(&ex, 0, sizeof(ex));
+    ex.fd = fd;
+    if (encf) {
+        ex.buf = malloc(TEXPORT_BUF_SIZE);
+        if (!ex.buf) {
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+    }
+    else if ((flags & TEXPORT_SPLICE) && !fstat(fd, &st)) {
+        ex.splice = S_ISFIFO(st.st_mode);
+    }
+
+    ttree_range_open(&range, ttree, lo, hi);
+    while ((tnode = ttree_range_next(&range, &first, &last))) {
+        if (!encf) {
+            if (add_iov(&ex, tnode_packed_key(ttree, tnode, first),
+                        (last - first + 1) * ttree->packed_key_size) < 0) {
+                goto err;
+            }
+        }
+        else {
+            for (i = first; i <= last; i++) {
+                if (add_item(&ex, ttree_key2item(ttree, tnode_key(tnode, i)),
+                             encf, arg) < 0) {
+                    goto err;
+                }
+            }
+        }
+
+        num_items += last - first + 1;
+    }
+    if (flush_iovs(&ex) < 0) {
+        goto err;
+    }
+
+    free(ex.buf);
+    return num_items;
+
+err:
+    free(ex.buf);
+    return -1;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_export.h
+ * @brief Streaming sorted ranges of a T*-tree to a file descriptor.
+ *
+ * Keys of a range are written by slices of nodes gathered into iovecs,
+ * so each writev passes many nodes at once. If nodes keep raw copies of
+ * keys, slices are written straight from the nodes without copying
+ * them. Otherwise items are encoded by a user function into a staging
+ * buffer and the encoded pieces are gathered the same way.
+ */
+
+#ifndef __TTREE_EXPORT_H__
+#define __TTREE_EXPORT_H__
+
+#include <sys/types.h>
+#include "ttree.h"
+
+/**
+ * Maximum number of pieces written by one system call.
+ */
+#define TEXPORT_NUM_IOVS 64
+
+/**
+ * Size of the buffer items are encoded to.
+ * An encoded item must fit into it.
+ */
+#define TEXPORT_BUF_SIZE (64 * 1024)
+
+/**
+ * Move pages of nodes into a pipe by vmsplice instead of copying them.
+ * The data stays in the tree's memory until it's read from the pipe,
+ * so the tree mustn't be modified until then. Each slice takes a slot
+ * of the pipe, so the pipe is filled by fewer keys than with writev.
+ * It's used only when raw keys are exported and @a fd is a pipe.
+ */
+#define TEXPORT_SPLICE 0x01
+
+/**
+ * Function encoding an item to buffer @a buf of @a size bytes.
+ * Returns the size of the encoded item or -1 on error. If the size is
+ * bigger than @a size, the function is called again with bigger buffer.
+ * @see ttree_export_range
+ */
+typedef ssize_t (*ttree_export_fn)(void *item, void *buf, size_t size,
+                                   void *arg);
+
+/**
+ * @brief Write items with keys in a range to a file descriptor.
+ *
+ * If @a encf is NULL, keys kept inside nodes are written as is
+ * (packed_key_size bytes each), otherwise the items encoded by @a encf
+ * are written. Writes are retried until all data is written, so
+ * @a fd should be blocking.
+ *
+ * @param ttree - A pointer to a T*-tree.
+ * @param fd    - A file descriptor opened for writing.
+ * @param lo    - The lowest key of the range(NULL if unbounded).
+ * @param hi    - The highest key of the range(NULL if unbounded).
+ * @param flags - 0 or TEXPORT_SPLICE.
+ * @param encf  - A function encoding items or NULL.
+ * @param arg   - An argument passed to @a encf.
+ * @return The number of exported items or -1 on error.
+ * @see ttree_keys_are_inline
+ */
+ssize_t ttree_export_range(Ttree *ttree, int fd, void *lo, void *hi,
+                           int flags, ttree_export_fn encf, void *arg);
+
+#endif /* !__TTREE_EXPORT_H__ */
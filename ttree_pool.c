@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_pool.c
+ * @brief T*-tree nodes pool implementation.
+ *
+ * Each chunk is TPOOL_CHUNK_SIZE bytes long and aligned by its size, so
+ * the chunk a block belongs to is found by masking block's address.
+ * The chunk header lives in the beginning of the chunk, the rest of it is
+ * divided into blocks of the same size class. Never used blocks are taken
+ * by moving chunk's "bump" pointer, freed ones are kept in a list linked
+ * through the blocks themselves.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ttree_pool.h"
+
+#define SET_ERRNO(err) errno = (err)
+
+struct tpool_chunk {
+    struct tpool_chunk *next;
+    struct tpool_chunk *prev;
+    size_t block_size;
+    unsigned int used;  /* Number of blocks given out of the chunk */
+    bool released;      /* True if chunk's pages were given back to the OS */
+    char *bump;         /* Beginning of never used area */
+    void *free_blocks;  /* List of freed blocks */
+};
+
+struct tpool_cache {
+    TtreePool *pool;
+    struct tpool_cache *next;
+    void *blocks[TPOOL_NUM_CLASSES];
+    unsigned int counts[TPOOL_NUM_CLASSES];
+};
+
+#define CHUNK_HDR_SIZE                                                  \
+    ((sizeof(struct tpool_chunk) + TPOOL_CLASS_STEP - 1) &              \
+     ~(TPOOL_CLASS_STEP - 1))
+
+#define size2class(size)                                \
+    (((size) + TPOOL_CLASS_STEP - 1) / TPOOL_CLASS_STEP - 1)
+
+#define class2size(cls)                         \
+    (((cls) + 1) * TPOOL_CLASS_STEP)
+
+#define block2chunk(ptr)                                                \
+    ((struct tpool_chunk *)((uintptr_t)(ptr) &                          \
+                            ~((uintptr_t)TPOOL_CHUNK_SIZE - 1)))
+
+#define chunk_end(chunk)                        \
+    ((char *)(chunk) + TPOOL_CHUNK_SIZE)
+
+#define chunk_has_free_blocks(chunk)                                    \
+    ((chunk)->free_blocks ||                                            \
+     ((chunk)->bump + (chunk)->block_size <= chunk_end(chunk)))
+
+#define block_next(block) (*(void **)(block))
+
+static void chunk_unlink(struct tpool_chunk **list, struct tpool_chunk *chunk)
+{
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    }
+    else {
+        *list = chunk->next;
+    }
+    if (chunk->next) {
+        chunk->next->prev = chunk->prev;
+    }
+
+    chunk->next = chunk->prev = NULL;
+}
+
+static void chunk_link(struct tpool_chunk **list, struct tpool_chunk *chunk)
+{
+    chunk->prev = NULL;
+    chunk->next = *list;
+    if (chunk->next) {
+        chunk->next->prev = chunk;
+    }
+
+    *list = chunk;
+}
+
+/*
+ * Map new chunk aligned by its size. Since mmap doesn't
+ * allow to specify an alignment, twice bigger area is mapped
+ * and unaligned parts of it are unmapped then.
+ */
+static struct tpool_chunk *map_chunk(TtreePool *pool, int cls)
+{
+    struct tpool_chunk *chunk;
+    char *area, *aligned;
+    size_t head;
+
+    area = mmap(NULL, 2 * TPOOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        return NULL;
+    }
+
+    aligned = (char *)(((uintptr_t)area + TPOOL_CHUNK_SIZE - 1) &
+                       ~((uintptr_t)TPOOL_CHUNK_SIZE - 1));
+    head = aligned - area;
+    if (head) {
+        munmap(area, head);
+    }
+
+    munmap(aligned + TPOOL_CHUNK_SIZE, TPOOL_CHUNK_SIZE - head);
+    chunk = (struct tpool_chunk *)aligned;
+    chunk->block_size = class2size(cls);
+    chunk->used = 0;
+    chunk->released = false;
+    chunk->bump = aligned + CHUNK_HDR_SIZE;
+    chunk->free_blocks = NULL;
+    pool->mem_mapped += TPOOL_CHUNK_SIZE;
+    chunk_link(&pool->chunks[cls], chunk);
+    return chunk;
+}
+
+/*
+ * Give pages of completely free chunk back to the OS. The pages
+ * become zero-filled, so the list of free blocks is dropped and
+ * the whole chunk will be used from the beginning again.
+ */
+static void release_chunk(TtreePool *pool, struct tpool_chunk *chunk)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    char *start;
+
+    start = (char *)chunk + page_size;
+    if (start < chunk_end(chunk)) {
+        madvise(start, chunk_end(chunk) - start, MADV_DONTNEED);
+    }
+
+    chunk->bump = (char *)chunk + CHUNK_HDR_SIZE;
+    chunk->free_blocks = NULL;
+    chunk->released = true;
+    pool->mem_released += TPOOL_CHUNK_SIZE;
+}
+
+/* Must be called with pool lock held. */
+static void *pool_get_block(TtreePool *pool, int cls)
+{
+    struct tpool_chunk *chunk = pool->chunks[cls];
+    void *block;
+
+    if (!chunk) {
+        chunk = map_chunk(pool, cls);
+        if (!chunk) {
+            return NULL;
+        }
+    }
+    if (chunk->released) {
+        chunk->released = false;
+        pool->mem_released -= TPOOL_CHUNK_SIZE;
+    }
+    if (chunk->free_blocks) {
+        block = chunk->free_blocks;
+        chunk->free_blocks = block_next(block);
+    }
+    else {
+        block = chunk->bump;
+        chunk->bump += chunk->block_size;
+    }
+
+    chunk->used++;
+
+    if (!chunk_has_free_blocks(chunk)) {
+        chunk_unlink(&pool->chunks[cls], chunk);
+        chunk_link(&pool->full_chunks[cls], chunk);
+    }
+
+    return block;
+}
+
+/* Must be called with pool lock held. */
+static void pool_put_block(TtreePool *pool, int cls, void *block)
+{
+    struct tpool_chunk *chunk = block2chunk(block);
+    bool was_full = !chunk_has_free_blocks(chunk);
+
+    block_next(block) = chunk->free_blocks;
+    chunk->free_blocks = block;
+    chunk->used--;
+    if (!chunk->used) {
+        release_chunk(pool, chunk);
+    }
+    if (was_full) {
+        chunk_unlink(&pool->full_chunks[cls], chunk);
+        chunk_link(&pool->chunks[cls], chunk);
+    }
+}
+
+/*
+ * Give "num" blocks of size class "cls" from the cache back to the pool.
+ * Must be called with pool lock held.
+ */
+static void cache_drain(struct tpool_cache *cache, int cls, unsigned int num)
+{
+    void *block;
+
+    while (num-- && cache->counts[cls]) {
+        block = cache->blocks[cls];
+        cache->blocks[cls] = block_next(block);
+        cache->counts[cls]--;
+        pool_put_block(cache->pool, cls, block);
+    }
+}
+
+static void cache_destructor(void *arg)
+{
+    struct tpool_cache *cache = arg, **c;
+    TtreePool *pool = cache->pool;
+    int cls;
+
+    pthread_mutex_lock(&pool->lock);
+    for (cls = 0; cls < TPOOL_NUM_CLASSES; cls++) {
+        cache_drain(cache, cls, cache->counts[cls]);
+    }
+    for (c = &pool->caches; *c; c = &(*c)->next) {
+        if (*c == cache) {
+            *c = cache->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    free(cache);
+}
+
+static struct tpool_cache *get_cache(TtreePool *pool)
+{
+    struct tpool_cache *cache = pthread_getspecific(pool->cache_key);
+
+    if (LIKELY(cache != NULL)) {
+        return cache;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->pool = pool;
+    if (pthread_setspecific(pool->cache_key, cache)) {
+        free(cache);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    cache->next = pool->caches;
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->lock);
+    return cache;
+}
+
+int ttree_pool_init(TtreePool *pool)
+{
+    int ret;
+
+    memset(pool, 0, sizeof(*pool));
+    ret = pthread_mutex_init(&pool->lock, NULL);
+    if (ret) {
+        SET_ERRNO(ret);
+        return -1;
+    }
+
+    ret = pthread_key_create(&pool->cache_key, cache_destructor);
+    if (ret) {
+        pthread_mutex_destroy(&pool->lock);
+        SET_ERRNO(ret);
+        return -1;
+    }
+
+    return 0;
+}
+
+void ttree_pool_destroy(TtreePool *pool)
+{
+    struct tpool_cache *cache, *next_cache;
+    struct tpool_chunk *chunk, *next_chunk;
+    int cls;
+
+    pthread_key_delete(pool->cache_key);
+    for (cache = pool->caches; cache; cache = next_cache) {
+        next_cache = cache->next;
+        free(cache);
+    }
+    for (cls = 0; cls < TPOOL_NUM_CLASSES; cls++) {
+        for (chunk = pool->chunks[cls]; chunk; chunk = next_chunk) {
+            next_chunk = chunk->next;
+            munmap(chunk, TPOOL_CHUNK_SIZE);
+        }
+        for (chunk = pool->full_chunks[cls]; chunk; chunk = next_chunk) {
+            next_chunk = chunk->next;
+            munmap(chunk, TPOOL_CHUNK_SIZE);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+}
+
+void *ttree_pool_alloc(TtreePool *pool, size_t size)
+{
+    struct tpool_cache *cache;
+    void *block;
+    int cls, i;
+
+    if (UNLIKELY(!size || (size > TPOOL_MAX_BLOCK_SIZE))) {
+        return malloc(size);
+    }
+
+    cls = size2class(size);
+    cache = get_cache(pool);
+    if (UNLIKELY(!cache)) {
+        pthread_mutex_lock(&pool->lock);
+        block = pool_get_block(pool, cls);
+        pthread_mutex_unlock(&pool->lock);
+        goto out;
+    }
+    if (!cache->counts[cls]) {
+        /* Refill the cache by a half of its capacity. */
+        pthread_mutex_lock(&pool->lock);
+        for (i = 0; i < TPOOL_CACHE_MAX / 2; i++) {
+            block = pool_get_block(pool, cls);
+            if (!block) {
+                break;
+            }
+
+            block_next(block) = cache->blocks[cls];
+            cache->blocks[cls] = block;
+            cache->counts[cls]++;
+        }
+
+        pthread_mutex_unlock(&pool->lock);
+        if (!cache->counts[cls]) {
+            SET_ERRNO(ENOMEM);
+            return NULL;
+        }
+    }
+
+    block = cache->blocks[cls];
+    cache->blocks[cls] = block_next(block);
+    cache->counts[cls]--;
+
+out:
+    if (!block) {
+        SET_ERRNO(ENOMEM);
+    }
+
+    return block;
+}
+
+void ttree_pool_free(TtreePool *pool, void *ptr, size_t size)
+{
+    struct tpool_cache *cache;
+    int cls;
+
+    if (UNLIKELY(!size || (size > TPOOL_MAX_BLOCK_SIZE))) {
+        free(ptr);
+        return;
+    }
+
+    cls = size2class(size);
+    cache = get_cache(pool);
+    if (UNLIKELY(!cache)) {
+        pthread_mutex_lock(&pool->lock);
+        pool_put_block(pool, cls, ptr);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+
+    block_next(ptr) = cache->blocks[cls];
+    cache->blocks[cls] = ptr;
+    if (++cache->counts[cls] > TPOOL_CACHE_MAX) {
+        pthread_mutex_lock(&pool->lock);
+        cache_drain(cache, cls, TPOOL_CACHE_MAX / 2);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void ttree_pool_flush_cache(TtreePool *pool)
+{
+    struct tpool_cache *cache = pthread_getspecific(pool->cache_key);
+    int cls;
+
+    if (!cache) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (cls = 0; cls < TPOOL_NUM_CLASSES; cls++) {
+        cache_drain(cache, cls, cache->counts[cls]);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+}
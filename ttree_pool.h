@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_pool.h
+ * @brief Memory pool for T*-tree nodes shared between trees.
+ *
+ * A lot of small trees allocating their nodes by malloc waste
+ * a noticeable amount of memory on allocator's headers and
+ * fragmentation. The pool carves nodes out of big aligned chunks
+ * grouped by size classes, so trees with different number of keys per
+ * node may share the same pool. Each thread keeps a small cache of
+ * free nodes of each size class, thus the pool lock is taken only
+ * when the cache is empty or overfilled. Chunks that become completely
+ * free are given back to the OS by madvise(MADV_DONTNEED) while their
+ * address space is kept for future allocations.
+ */
+
+#ifndef __TTREE_POOL_H__
+#define __TTREE_POOL_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include "ttree_defs.h"
+
+/**
+ * Size of a pool chunk in bytes. Chunks are aligned by their size.
+ */
+#define TPOOL_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Granularity of pool size classes in bytes.
+ */
+#define TPOOL_CLASS_STEP 16
+
+/**
+ * Maximum size of a block allocated from a pool. Bigger blocks
+ * are allocated by malloc.
+ */
+#define TPOOL_MAX_BLOCK_SIZE 4096
+
+#define TPOOL_NUM_CLASSES (TPOOL_MAX_BLOCK_SIZE / TPOOL_CLASS_STEP)
+
+/**
+ * Maximum number of free blocks of one size class kept in
+ * a thread cache. Half of them is given back to the pool when
+ * the cache is overfilled.
+ */
+#define TPOOL_CACHE_MAX 64
+
+struct tpool_chunk;
+struct tpool_cache;
+
+/**
+ * @brief T*-tree nodes pool.
+ * @see ttree_pool_init
+ */
+typedef struct ttree_pool {
+    pthread_mutex_t lock;
+    pthread_key_t cache_key;    /**< Key of per-thread caches */
+
+    /**
+     * Chunks of each size class having free blocks
+     */
+    struct tpool_chunk *chunks[TPOOL_NUM_CLASSES];
+
+    /**
+     * Chunks of each size class without free blocks
+     */
+    struct tpool_chunk *full_chunks[TPOOL_NUM_CLASSES];
+    struct tpool_cache *caches; /**< All thread caches of the pool */
+    size_t mem_mapped;          /**< Size of all mapped chunks */
+    size_t mem_released;        /**< Size of chunks given back to the OS */
+} TtreePool;
+
+/**
+ * @brief Initialize T*-tree nodes pool.
+ * @param pool[out] - A pointer to the pool to initialize.
+ * @return 0 on success, -1 on error.
+ * @see ttree_set_pool
+ */
+int ttree_pool_init(TtreePool *pool);
+
+/**
+ * @brief Destroy T*-tree nodes pool and unmap all its chunks.
+ * @warning All trees using the pool must be destroyed before and the
+ *          pool must not be used by other threads anymore.
+ * @param pool - A pointer to the pool.
+ */
+void ttree_pool_destroy(TtreePool *pool);
+
+/**
+ * @brief Allocate a block of @a size bytes from the pool.
+ * @param pool - A pointer to the pool.
+ * @param size - Size of a block in bytes.
+ * @return A pointer to allocated block or NULL if there is no memory.
+ */
+void *ttree_pool_alloc(TtreePool *pool, size_t size);
+
+/**
+ * @brief Give a block allocated by ttree_pool_alloc back to the pool.
+ * @param pool - A pointer to the pool.
+ * @param ptr  - A pointer to the block.
+ * @param size - Size of the block(the same one it was allocated with).
+ */
+void ttree_pool_free(TtreePool *pool, void *ptr, size_t size);
+
+/**
+ * @brief Give all free blocks cached by the calling thread back to the pool.
+ *
+ * Thread caches are flushed automatically when threads exit. Flushing
+ * them explicitly allows the pool to release chunks that became free.
+ *
+ * @param pool - A pointer to the pool.
+ */
+void ttree_pool_flush_cache(TtreePool *pool);
+
+#endif /* !__TTREE_POOL_H__ */
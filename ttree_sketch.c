@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_sketch.c
+ * @brief Quantile sketch implementation.
+ *
+ * A positive value v is counted in the bucket k = ceil(log(v) / log(g)),
+ * where g = (1 + e) / (1 - e) and e is the relative error. All values
+ * of the bucket are in (g^(k-1), g^k], so 2 * g^k / (g + 1) differs
+ * from each of them no more than by e. Negative values are counted
+ * the same way by their absolute values.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "ttree_sketch.h"
+
+#define SET_ERRNO(err) errno = (err)
+
+int ttree_sketch_init(TtreeSketch *sketch, double rel_err)
+{
+    if (!(rel_err > 0) || !(rel_err < 1)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    sketch->rel_err = rel_err;
+    sketch->log_gamma = log((1 + rel_err) / (1 - rel_err));
+    sketch->num_buckets = 2 * (int)ceil(TSKETCH_MAX_EXP / sketch->log_gamma);
+    sketch->pos = calloc(2 * sketch->num_buckets, sizeof(uint64_t));
+    if (!sketch->pos) {
+        SET_ERRNO(ENOMEM);
+        return -1;
+    }
+
+    sketch->neg = sketch->pos + sketch->num_buckets;
+    sketch->zero = 0;
+    sketch->total = 0;
+    return 0;
+}
+
+void ttree_sketch_destroy(TtreeSketch *sketch)
+{
+    free(sketch->pos);
+    sketch->pos = sketch->neg = NULL;
+    sketch->total = sketch->zero = 0;
+}
+
+void ttree_sketch_clear(TtreeSketch *sketch)
+{
+    memset(sketch->pos, 0, 2 * sketch->num_buckets * sizeof(uint64_t));
+    sketch->total = sketch->zero = 0;
+}
+
+/*
+ * Get the counter of a value. Buckets of each sign are indexed
+ * from the smallest absolute value, bucket 0 is centered at 1.
+ */
+static uint64_t *sketch_counter(TtreeSketch *sketch, double value)
+{
+    int half = sketch->num_buckets / 2;
+    double k;
+
+    if (isnan(value)) {
+        return NULL;
+    }
+    if (fabs(value) < exp(-TSKETCH_MAX_EXP)) {
+        return &sketch->zero;
+    }
+
+    k = ceil(log(fabs(value)) / sketch->log_gamma);
+    if (k < -half) {
+        k = -half;
+    }
+    else if (k > half - 1) {
+        k = half - 1;
+    }
+
+    return ((value > 0) ? sketch->pos : sketch->neg) + ((int)k + half);
+}
+
+void ttree_sketch_add(TtreeSketch *sketch, double value)
+{
+    uint64_t *cnt = sketch_counter(sketch, value);
+
+    if (cnt) {
+        (*cnt)++;
+        sketch->total++;
+    }
+}
+
+void ttree_sketch_remove(TtreeSketch *sketch, double value)
+{
+    uint64_t *cnt = sketch_counter(sketch, value);
+
+    if (cnt && *cnt) {
+        (*cnt)--;
+        sketch->total--;
+    }
+}
+
+int ttree_sketch_merge(TtreeSketch *dst, const TtreeSketch *src)
+{
+    int i;
+
+    if ((dst->rel_err != src->rel_err) ||
+        (dst->num_buckets != src->num_buckets)) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+
+    for (i = 0; i < 2 * dst->num_buckets; i++) {
+        dst->pos[i] += src->pos[i];
+    }
+
+    dst->zero += src->zero;
+    dst->total += src->total;
+    return 0;
+}
+
+/* The value representing all values of a bucket. */
+static double bucket_value(const TtreeSketch *sketch, int idx)
+{
+    double k = idx - sketch->num_buckets / 2;
+
+    return 2 / (1 + exp(-sketch->log_gamma)) *
+        exp((k - 1) * sketch->log_gamma);
+}
+
+double ttree_sketch_quantile(const TtreeSketch *sketch, double q)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (!sketch->total) {
+        return NAN;
+    }
+    if (q < 0) {
+        q = 0;
+    }
+    else if (q > 1) {
+        q = 1;
+    }
+
+    rank = (uint64_t)(q * (sketch->total - 1));
+    for (i = sketch->num_buckets - 1; i >= 0; i--) {
+        seen += sketch->neg[i];
+        if (seen > rank) {
+            return -bucket_value(sketch, i);
+        }
+    }
+
+    seen += sketch->zero;
+    if (seen > rank) {
+        return 0;
+    }
+    for (i = 0; i < sketch->num_buckets; i++) {
+        seen += sketch->pos[i];
+        if (seen > rank) {
+            return bucket_value(sketch, i);
+        }
+    }
+
+    return bucket_value(sketch, sketch->num_buckets - 1);
+}
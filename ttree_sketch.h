@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_sketch.h
+ * @brief Mergeable quantile sketch of numeric values of keys.
+ *
+ * The sketch splits the range of values into buckets growing
+ * geometrically, so each value is counted in a bucket which bounds
+ * differ no more than by the relative error. Unlike sampling sketches
+ * (KLL, t-digest) it allows values to be removed, so a sketch attached
+ * to a T*-tree follows both insertions and deletions. Sketches with
+ * the same relative error are merged by adding their counters.
+ * Quantiles are found in time depending on the relative error only,
+ * not on the number of counted values.
+ */
+
+#ifndef __TTREE_SKETCH_H__
+#define __TTREE_SKETCH_H__
+
+#include <stdint.h>
+#include "ttree_defs.h"
+
+/**
+ * Absolute values of counted values are in [exp(-TSKETCH_MAX_EXP),
+ * exp(TSKETCH_MAX_EXP)]. Smaller and bigger ones are counted in
+ * the outermost buckets.
+ */
+#define TSKETCH_MAX_EXP 40
+
+/**
+ * @brief Quantile sketch.
+ * @see ttree_sketch_init
+ */
+typedef struct ttree_sketch {
+    double rel_err;     /**< Relative error of quantiles */
+    double log_gamma;   /**< Logarithm of buckets growth factor */
+    int num_buckets;    /**< Number of buckets of each sign */
+    uint64_t *pos;      /**< Counters of positive values */
+    uint64_t *neg;      /**< Counters of negative values */
+    uint64_t zero;      /**< Counter of values too close to zero */
+    uint64_t total;     /**< Number of counted values */
+} TtreeSketch;
+
+/**
+ * @brief Initialize an empty quantile sketch.
+ *
+ * Memory used by the sketch is inversely proportional to
+ * @a rel_err: 0.01 takes about 64KB.
+ *
+ * @param sketch[out] - A pointer to the sketch to initialize.
+ * @param rel_err     - Relative error of quantiles in (0, 1).
+ * @return 0 on success, -1 on error.
+ */
+int ttree_sketch_init(TtreeSketch *sketch, double rel_err);
+
+/**
+ * @brief Free memory used by a quantile sketch.
+ * @param sketch - A pointer to the sketch.
+ */
+void ttree_sketch_destroy(TtreeSketch *sketch);
+
+/**
+ * @brief Forget all values counted by a quantile sketch.
+ * @param sketch - A pointer to the sketch.
+ */
+void ttree_sketch_clear(TtreeSketch *sketch);
+
+/**
+ * @brief Count a value in a quantile sketch.
+ * @param sketch - A pointer to the sketch.
+ * @param value  - The value(NaN is ignored).
+ */
+void ttree_sketch_add(TtreeSketch *sketch, double value);
+
+/**
+ * @brief Remove a value counted by ttree_sketch_add from a sketch.
+ * @param sketch - A pointer to the sketch.
+ * @param value  - The value.
+ */
+void ttree_sketch_remove(TtreeSketch *sketch, double value);
+
+/**
+ * @brief Add values counted by one sketch to another one.
+ * @param dst - A pointer to the sketch values are added to.
+ * @param src - A pointer to the sketch values are taken from.
+ * @return 0 on success, -1 if sketches have different relative errors.
+ */
+int ttree_sketch_merge(TtreeSketch *dst, const TtreeSketch *src);
+
+/**
+ * @brief Get an approximate quantile of counted values.
+ *
+ * The result differs from the value of rank q * (N - 1) among
+ * N counted values no more than by the relative error.
+ *
+ * @param sketch - A pointer to the sketch.
+ * @param q      - The quantile in [0, 1](0.5 is the median).
+ * @return The value of the quantile or NaN if the sketch is empty.
+ */
+double ttree_sketch_quantile(const TtreeSketch *sketch, double q);
+
+#endif /* !__TTREE_SKETCH_H__ */
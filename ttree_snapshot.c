@@ -0,0 +1,677 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_snapshot.c
+ * @brief T*-tree snapshots implementation.
+ *
+ * Buffers are used round-robin: before a buffer is filled(or parsed)
+ * the request issued for it the previous time must complete. io_uring
+ * is driven by raw system calls, so no library is needed. If the kernel
+ * doesn't support it, requests are served synchronously when submitted.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#ifdef TTREE_WITH_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif /* TTREE_WITH_IO_URING */
+
+#include "ttree_snapshot.h"
+
+#define SET_ERRNO(err) errno = (err)
+
+#define TSNAP_MAGIC "TTSNAP01"
+#define TSNAP_REC_HDR sizeof(uint32_t)
+#define tsnap_align_up(size)                                        \
+    (((size) + TSNAP_ALIGN - 1) & ~((size_t)TSNAP_ALIGN - 1))
+
+struct tsnap_header {
+    char magic[8];
+    uint64_t num_items;
+    uint64_t data_size;         /* Size of data following the header */
+    uint32_t buf_size;
+};
+
+struct tsnap_buf {
+    char *data;
+    off_t offs;                 /* Offset of the buffer in the file */
+    size_t len;                 /* Number of bytes to transfer */
+    size_t done;                /* Number of bytes transferred */
+    int err;                    /* Error of the last request */
+    bool busy;                  /* The request is in flight */
+};
+
+#ifdef TTREE_WITH_IO_URING
+struct tsnap_ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+};
+#endif /* TTREE_WITH_IO_URING */
+
+struct tsnap_io {
+    int fd;
+    int old_flags;              /* File status flags to restore or -1 */
+    bool writing;
+    int cur;                    /* Current buffer */
+    size_t pos;                 /* Position in the current buffer */
+    off_t offs;                 /* Offset of the current buffer */
+    struct tsnap_buf bufs[TSNAP_NUM_BUFS];
+#ifdef TTREE_WITH_IO_URING
+    struct tsnap_ring ring;
+    bool use_ring;
+#endif /* TTREE_WITH_IO_URING */
+};
+
+#ifdef TTREE_WITH_IO_URING
+static int ring_init(struct tsnap_ring *ring)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, TSNAP_NUM_BUFS, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_size > ring->sq_map_size) {
+            ring->sq_map_size = ring->cq_map_size;
+        }
+
+        ring->cq_map_size = ring->sq_map_size;
+    }
+
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        goto err_close;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    }
+    else {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            goto err_unmap_sq;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto err_unmap_cq;
+    }
+
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+err_unmap_cq:
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+err_unmap_sq:
+    munmap(ring->sq_map, ring->sq_map_size);
+err_close:
+    close(ring->fd);
+    return -1;
+}
+
+static void ring_destroy(struct tsnap_ring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+/*
+ * Queue a request transferring the rest of buffer "i".
+ * The ring has an entry for each buffer, so it's never full.
+ */
+static int ring_submit(struct tsnap_io *io, int i)
+{
+    struct tsnap_ring *ring = &io->ring;
+    struct tsnap_buf *buf = &io->bufs[i];
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = io->writing ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = io->fd;
+    sqe->addr = (uintptr_t)(buf->data + buf->done);
+    sqe->len = buf->len - buf->done;
+    sqe->off = buf->offs + buf->done;
+    sqe->user_data = i;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for at least one request to complete and handle all completed
+ * ones. Short transfers are resubmitted.
+ */
+static int ring_reap(struct tsnap_io *io)
+{
+    struct tsnap_ring *ring = &io->ring;
+    struct io_uring_cqe *cqe;
+    struct tsnap_buf *buf;
+    unsigned head, tail, resubmit = 0;
+    int i;
+
+    if ((syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                 IORING_ENTER_GETEVENTS, NULL, 0) < 0) && (errno != EINTR)) {
+        return -1;
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        i = (int)cqe->user_data;
+        buf = &io->bufs[i];
+        if ((cqe->res == -EINTR) || (cqe->res == -EAGAIN)) {
+            resubmit |= 1U << i;
+            continue;
+        }
+        else if (cqe->res < 0) {
+            buf->err = -cqe->res;
+        }
+        else if (cqe->res == 0) {
+            buf->err = EIO;
+        }
+        else {
+            buf->done += cqe->res;
+            if (buf->done < buf->len) {
+                resubmit |= 1U << i;
+                continue;
+            }
+        }
+
+        buf->busy = false;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    for (i = 0; i < TSNAP_NUM_BUFS; i++) {
+        if ((resubmit & (1U << i)) && (ring_submit(io, i) < 0)) {
+            io->bufs[i].err = errno;
+            io->bufs[i].busy = false;
+        }
+    }
+
+    return 0;
+}
+#endif /* TTREE_WITH_IO_URING */
+
+static int io_init(struct tsnap_io *io, int fd, int flags, bool writing)
+{
+    int i, fl;
+
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->old_flags = -1;
+    io->writing = writing;
+    for (i = 0; i < TSNAP_NUM_BUFS; i++) {
+        if (posix_memalign((void **)&io->bufs[i].data, TSNAP_ALIGN,
+                           TSNAP_BUF_SIZE)) {
+            while (--i >= 0) {
+                free(io->bufs[i].data);
+            }
+
+            SET_ERRNO(ENOMEM);
+            return -1;
+        }
+    }
+
+    /*
+     * Files on file systems not supporting O_DIRECT are accessed
+     * through the page cache.
+     */
+    if (flags & TSNAP_DIRECT) {
+        fl = fcntl(fd, F_GETFL);
+        if ((fl >= 0) && !(fl & O_DIRECT) &&
+            !fcntl(fd, F_SETFL, fl | O_DIRECT)) {
+            io->old_flags = fl;
+        }
+    }
+
+#ifdef TTREE_WITH_IO_URING
+    io->use_ring = !(flags & TSNAP_SYNC_IO) && !ring_init(&io->ring);
+#endif /* TTREE_WITH_IO_URING */
+    return 0;
+}
+
+static void io_destroy(struct tsnap_io *io)
+{
+    bool idle = true;
+    int i, err = errno;
+
+#ifdef TTREE_WITH_IO_URING
+    if (io->use_ring) {
+        for (i = 0; (i < TSNAP_NUM_BUFS) && idle; i++) {
+            while (io->bufs[i].busy) {
+                if (ring_reap(io) < 0) {
+                    idle = false;
+                    break;
+                }
+            }
+        }
+
+        ring_destroy(&io->ring);
+    }
+#endif /* TTREE_WITH_IO_URING */
+
+    /* Buffers the kernel may still transfer to are leaked. */
+    for (i = 0; (i < TSNAP_NUM_BUFS) && idle; i++) {
+        free(io->bufs[i].data);
+    }
+    if (io->old_flags >= 0) {
+        fcntl(io->fd, F_SETFL, io->old_flags);
+    }
+
+    SET_ERRNO(err);
+}
+
+/*
+ * Start transferring "len" bytes of buffer "i" at offset "offs".
+ * Errors are reported by io_wait.
+ */
+static int io_submit(struct tsnap_io *io, int i, off_t offs, size_t len)
+{
+    struct tsnap_buf *buf = &io->bufs[i];
+    ssize_t ret;
+
+    buf->offs = offs;
+    buf->len = len;
+    buf->done = 0;
+    buf->err = 0;
+#ifdef TTREE_WITH_IO_URING
+    if (io->use_ring) {
+        buf->busy = true;
+        if (ring_submit(io, i) < 0) {
+            buf->busy = false;
+            return -1;
+        }
+
+        return 0;
+    }
+#endif /* TTREE_WITH_IO_URING */
+
+    while (buf->done < buf->len) {
+        if (io->writing) {
+            ret = pwrite(io->fd, buf->data + buf->done,
+                         buf->len - buf->done, buf->offs + buf->done);
+        }
+        else {
+            ret = pread(io->fd, buf->data + buf->done,
+                        buf->len - buf->done, buf->offs + buf->done);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            buf->err = errno;
+            break;
+        }
+        if (ret == 0) {
+            buf->err = EIO;
+            break;
+        }
+
+        buf->done += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait until the request of buffer "i" completes.
+ */
+static int io_wait(struct tsnap_io *io, int i)
+{
+    struct tsnap_buf *buf = &io->bufs[i];
+
+#ifdef TTREE_WITH_IO_URING
+    while (buf->busy) {
+        if (ring_reap(io) < 0) {
+            return -1;
+        }
+    }
+#endif /* TTREE_WITH_IO_URING */
+
+    if (buf->err) {
+        SET_ERRNO(buf->err);
+        buf->err = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the current buffer padded by zeros and wait for the next one.
+ * Only the last buffer may be shorter than TSNAP_BUF_SIZE.
+ */
+static int write_buf(struct tsnap_io *io, bool last)
+{
+    struct tsnap_buf *buf = &io->bufs[io->cur];
+    size_t len = last ? tsnap_align_up(io->pos) : TSNAP_BUF_SIZE;
+
+    if (!len) {
+        return 0;
+    }
+
+    memset(buf->data + io->pos, 0, len - io->pos);
+    if (io_submit(io, io->cur, io->offs, len) < 0) {
+        return -1;
+    }
+
+    io->offs += len;
+    io->pos = 0;
+    io->cur = (io->cur + 1) % TSNAP_NUM_BUFS;
+    return io_wait(io, io->cur);
+}
+
+/*
+ * Encode an item to the current buffer, the buffer is written
+ * if the item doesn't fit into the rest of it.
+ */
+static int put_item(struct tsnap_io *io, void *item,
+                    ttree_snap_encode_fn encf, void *arg)
+{
+    char *rec;
+    size_t room;
+    ssize_t ret;
+    uint32_t size;
+
+    for (;;) {
+        room = TSNAP_BUF_SIZE - io->pos;
+        if (room > TSNAP_REC_HDR) {
+            rec = io->bufs[io->cur].data + io->pos;
+            ret = encf(item, rec + TSNAP_REC_HDR, room - TSNAP_REC_HDR, arg);
+            if (ret < 0) {
+                return -1;
+            }
+            if (ret == 0) {
+                SET_ERRNO(EINVAL);
+                return -1;
+            }
+            if ((size_t)ret <= room - TSNAP_REC_HDR) {
+                size = ret;
+                memcpy(rec, &size, sizeof(size));
+                io->pos += TSNAP_REC_HDR + ret;
+                return 0;
+            }
+        }
+        if (!io->pos) {
+            SET_ERRNO(E2BIG);
+            return -1;
+        }
+        if (write_buf(io, false) < 0) {
+            return -1;
+        }
+    }
+}
+
+ssize_t ttree_snapshot_save(Ttree *ttree, int fd, int flags,
+                            ttree_snap_encode_fn encf, void *arg)
+{
+    struct tsnap_io io;
+    struct tsnap_header *hdr;
+    TtreeCursor cursor;
+    uint64_t num_items = 0;
+    int i, ret = -1;
+
+    if ((fd < 0) || !encf) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (io_init(&io, fd, flags, true) < 0) {
+        return -1;
+    }
+
+    io.offs = TSNAP_ALIGN;
+    if (!ttree_is_empty(ttree)) {
+        ttree_cursor_open(&cursor, ttree);
+        ttree_cursor_first(&cursor);
+        do {
+            if (put_item(&io, ttree_item_from_cursor(&cursor),
+                         encf, arg) < 0) {
+                goto out;
+            }
+
+            num_items++;
+        } while (ttree_cursor_next(&cursor) == TCSR_OK);
+    }
+    if (write_buf(&io, true) < 0) {
+        goto out;
+    }
+    for (i = 0; i < TSNAP_NUM_BUFS; i++) {
+        if (io_wait(&io, i) < 0) {
+            goto out;
+        }
+    }
+
+    /*
+     * The header is written when all data is on the disk, otherwise
+     * the header might get there first and a crash would leave
+     * a valid header followed by garbage.
+     */
+    if (fdatasync(fd) < 0) {
+        goto out;
+    }
+
+    memset(io.bufs[0].data, 0, TSNAP_ALIGN);
+    hdr = (struct tsnap_header *)io.bufs[0].data;
+    memcpy(hdr->magic, TSNAP_MAGIC, sizeof(hdr->magic));
+    hdr->num_items = num_items;
+    hdr->data_size = io.offs - TSNAP_ALIGN;
+    hdr->buf_size = TSNAP_BUF_SIZE;
+    if ((io_submit(&io, 0, 0, TSNAP_ALIGN) < 0) || (io_wait(&io, 0) < 0)) {
+        goto out;
+    }
+
+    ret = fdatasync(fd);
+
+out:
+    io_destroy(&io);
+    return (ret < 0) ? -1 : (ssize_t)num_items;
+}
+
+/*
+ * Start reading "k"th buffer of data if the snapshot has it.
+ */
+static int read_buf(struct tsnap_io *io, uint64_t k, uint64_t data_size)
+{
+    uint64_t offs = k * TSNAP_BUF_SIZE;
+    uint64_t len = data_size - offs;
+
+    if (offs >= data_size) {
+        return 0;
+    }
+
+    return io_submit(io, k % TSNAP_NUM_BUFS, TSNAP_ALIGN + offs,
+                     (len < TSNAP_BUF_SIZE) ? len : TSNAP_BUF_SIZE);
+}
+
+/*
+ * Insert items of a read buffer into the tree.
+ * Returns the number of items or -1 on error.
+ */
+static ssize_t load_buf(Ttree *ttree, struct tsnap_buf *buf,
+                        ttree_snap_decode_fn decf,
+                        ttree_snap_free_fn freef, void *arg)
+{
+    size_t pos = 0;
+    ssize_t num = 0;
+    uint32_t size;
+    void *item;
+
+    while (pos + TSNAP_REC_HDR <= buf->len) {
+        memcpy(&size, buf->data + pos, sizeof(size));
+        if (!size) {
+            break;
+        }
+
+        pos += TSNAP_REC_HDR;
+        if (size > buf->len - pos) {
+            SET_ERRNO(EINVAL);
+            return -1;
+        }
+
+        item = decf(buf->data + pos, size, arg);
+        if (!item) {
+            return -1;
+        }
+        if (ttree_insert(ttree, item) < 0) {
+            if (freef) {
+                freef(item, arg);
+            }
+
+            return -1;
+        }
+
+        pos += size;
+        num++;
+    }
+
+    return num;
+}
+
+ssize_t ttree_snapshot_load(Ttree *ttree, int fd, int flags,
+                            ttree_snap_decode_fn decf,
+                            ttree_snap_free_fn freef, void *arg)
+{
+    struct tsnap_io io;
+    struct tsnap_header hdr;
+    uint64_t num_items = 0, num_bufs, k;
+    ssize_t ret = -1;
+
+    if ((fd < 0) || !decf) {
+        SET_ERRNO(EINVAL);
+        return -1;
+    }
+    if (!ttree_is_empty(ttree)) {
+        SET_ERRNO(EBUSY);
+        return -1;
+    }
+    if (io_init(&io, fd, flags, false) < 0) {
+        return -1;
+    }
+    if ((io_submit(&io, 0, 0, TSNAP_ALIGN) < 0) || (io_wait(&io, 0) < 0)) {
+        goto out;
+    }
+
+    memcpy(&hdr, io.bufs[0].data, sizeof(hdr));
+    if (memcmp(hdr.magic, TSNAP_MAGIC, sizeof(hdr.magic)) ||
+        (hdr.buf_size != TSNAP_BUF_SIZE) ||
+        (hdr.data_size % TSNAP_ALIGN)) {
+        SET_ERRNO(EINVAL);
+        goto out;
+    }
+
+    /*
+     * While a buffer is parsed, the following ones are read.
+     */
+    num_bufs = (hdr.data_size + TSNAP_BUF_SIZE - 1) / TSNAP_BUF_SIZE;
+    for (k = 0; k < TSNAP_NUM_BUFS; k++) {
+        if (read_buf(&io, k, hdr.data_size) < 0) {
+            goto out;
+        }
+    }
+    for (k = 0; k < num_bufs; k++) {
+        if (io_wait(&io, k % TSNAP_NUM_BUFS) < 0) {
+            goto out;
+        }
+
+        ret = load_buf(ttree, &io.bufs[k % TSNAP_NUM_BUFS], decf, freef,
+                       arg);
+        if (ret < 0) {
+            goto out;
+        }
+
+        num_items += ret;
+        ret = read_buf(&io, k + TSNAP_NUM_BUFS, hdr.data_size);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    if (num_items != hdr.num_items) {
+        SET_ERRNO(EINVAL);
+        ret = -1;
+        goto out;
+    }
+
+    ret = num_items;
+
+out:
+    io_destroy(&io);
+    return ret;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2008, 2009 Dan Kruchinin <dkruchinin@acm.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file ttree_snapshot.h
+ * @brief Saving items of a T*-tree to a file and loading them back.
+ *
+ * Items are encoded by a user function in key order into a ring of
+ * aligned buffers, each buffer is written while the next ones are
+ * filled. Where io_uring is available, several buffers are in flight
+ * at once and encoding overlaps with disk I/O, otherwise buffers are
+ * written by pwrite. Loading reads buffers ahead the same way.
+ * Optionally the file is accessed with O_DIRECT, bypassing the page
+ * cache: all offsets and sizes of I/O are multiples of TSNAP_ALIGN.
+ *
+ * The snapshot starts with a header block keeping the number of items
+ * and the size of data, followed by TSNAP_BUF_SIZE long buffers of
+ * records. Each record is a 32 bit size of the encoded item followed
+ * by the item. Records never cross buffers, zero size ends a buffer.
+ */
+
+#ifndef __TTREE_SNAPSHOT_H__
+#define __TTREE_SNAPSHOT_H__
+
+#include <sys/types.h>
+#include "ttree.h"
+
+/**
+ * Alignment of I/O buffers, offsets and sizes.
+ */
+#define TSNAP_ALIGN 4096
+
+/**
+ * Size of I/O buffer. An encoded item must fit into one buffer.
+ */
+#define TSNAP_BUF_SIZE (1 << 20)
+
+/**
+ * Number of I/O buffers, i.e. the maximum number of requests in flight.
+ */
+#define TSNAP_NUM_BUFS 4
+
+/**
+ * Access the snapshot file with O_DIRECT if the file system allows it.
+ */
+#define TSNAP_DIRECT  0x01
+
+/**
+ * Use pread/pwrite even if io_uring is available.
+ */
+#define TSNAP_SYNC_IO 0x02
+
+/**
+ * Function encoding an item to buffer @a buf of @a size bytes.
+ * Returns the size of the encoded item or -1 on error. If the size is
+ * bigger than @a size, the function is called again with bigger buffer.
+ * @see ttree_snapshot_save
+ */
+typedef ssize_t (*ttree_snap_encode_fn)(void *item, void *buf,
+                                        size_t size, void *arg);
+
+/**
+ * Function creating an item from @a size bytes encoded by
+ * ttree_snap_encode_fn. @a buf isn't aligned.
+ * Returns the item or NULL on error.
+ * @see ttree_snapshot_load
+ */
+typedef void *(*ttree_snap_decode_fn)(const void *buf, size_t size,
+                                      void *arg);
+
+/**
+ * Function freeing an item created by ttree_snap_decode_fn
+ * that couldn't be inserted into the tree.
+ * @see ttree_snapshot_load
+ */
+typedef void (*ttree_snap_free_fn)(void *item, void *arg);
+
+/**
+ * @brief Save all items of a T*-tree to a file.
+ *
+ * The snapshot is written from the beginning of file @a fd. Items are
+ * flushed to the disk by fdatasync before the header is written, and
+ * the header is flushed before the function returns, so a crash never
+ * leaves a valid header followed by partially written items. Spilled
+ * items are faulted in.
+ *
+ * @param ttree - A pointer to the T*-tree.
+ * @param fd    - A file descriptor opened for writing.
+ * @param flags - TSNAP_DIRECT and(or) TSNAP_SYNC_IO.
+ * @param encf  - A function encoding items.
+ * @param arg   - An argument passed to @a encf.
+ * @return The number of saved items or -1 on error.
+ */
+ssize_t ttree_snapshot_save(Ttree *ttree, int fd, int flags,
+                            ttree_snap_encode_fn encf, void *arg);
+
+/**
+ * @brief Load items saved by ttree_snapshot_save to an empty T*-tree.
+ *
+ * Items created by @a decf are inserted into the tree. An item that
+ * can't be inserted(e.g. its key is duplicated in a tree with unique
+ * keys, errno is EEXIST then) is passed to @a freef. On error items
+ * loaded so far stay in the tree, so the caller has to free them and
+ * destroy the tree, or empty it before the next attempt.
+ *
+ * @param ttree - A pointer to the empty T*-tree.
+ * @param fd    - A file descriptor opened for reading.
+ * @param flags - TSNAP_DIRECT and(or) TSNAP_SYNC_IO.
+ * @param decf  - A function creating items.
+ * @param freef - A function freeing items that weren't inserted(may be
+ *                NULL).
+ * @param arg   - An argument passed to @a decf and @a freef.
+ * @return The number of loaded items or -1 on error.
+ */
+ssize_t ttree_snapshot_load(Ttree *ttree, int fd, int flags,
+                            ttree_snap_decode_fn decf,
+                            ttree_snap_free_fn freef, void *arg);
+
+#endif /* !__TTREE_SNAPSHOT_H__ */